@@ -207,3 +207,40 @@ void eqsort(void *a, size_t n, size_t es, int (*cmp)(const void *,const void *,v
     }
     if(left < (ssize_t)n) SymPartitionSort(a, left, n, es, cmp, data);
 }
+
+// Sift item i down the max-heap a[0..k) ordered by cmp
+static void TopHeapDown(char *a, size_t i, size_t k, size_t es, int (*cmp)(const void *,const void *,void *), void *data)
+{   size_t l,r,m;
+
+    while(1){
+        l=2*i+1; r=l+1; m=i;
+        if(l < k && cmp(a+l*es, a+m*es, data) > 0) m=l;
+        if(r < k && cmp(a+r*es, a+m*es, data) > 0) m=r;
+        if(m == i) return;
+        swap(a+i*es, a+m*es);
+        i=m;
+    }
+}
+
+// Partial sort: the k first items in cmp order end up sorted in
+// a[0..k), the order of the others is unspecified
+void eqsort_top(void *a, size_t n, size_t k, size_t es, int (*cmp)(const void *,const void *,void *),void *data)
+{   char *b=(char*)a;
+    size_t i;
+
+    if(k >= n) { eqsort(a, n, es, cmp, data); return; }
+    if(k == 0) return;
+//Max-heap of the k best items seen so far, its top is the worst of them
+    for(i=k/2; i-- > 0; ) TopHeapDown(b, i, k, es, cmp, data);
+    for(i=k; i < n; i++){
+        if(cmp(b+i*es, b, data) < 0){
+            swap(b+i*es, b);
+            TopHeapDown(b, 0, k, es, cmp, data);
+        }
+    }
+//Heap sort of the k items
+    for(i=k; i-- > 1; ){
+        swap(b, b+i*es);
+        TopHeapDown(b, 0, i, es, cmp, data);
+    }
+}
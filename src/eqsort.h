@@ -35,4 +35,8 @@ void memswap(void *a, void *b, size_t n);
 
 void eqsort(void *a, size_t n, size_t es, int (*cmp)(const void *,const void *,void *),void *data);
 
+/* like eqsort, but only the first k items in cmp order are sorted
+ * into a[0..k); the remaining items are left in unspecified order */
+void eqsort_top(void *a, size_t n, size_t k, size_t es, int (*cmp)(const void *,const void *,void *),void *data);
+
 #endif
@@ -56,6 +56,7 @@
 #include "mem.h"
 #include "sregister.h"
 #include "iregister.h"
+#include "sentcache.h"
 
 /* ------------------------------------------------------------ */
 
@@ -566,10 +567,12 @@ void print_wtree(wtree_pt t, size_t indent)
 }
 
 /* ------------------------------------------------------------ */
-static void tagging(const char* fn, model_pt m)
+static void tagging(const char* fn, size_t cache, model_pt m)
 {
   size_t not=iregister_get_length(m->tags), nop=0;
   FILE *f= fn ? try_to_open(fn, "r") : stdin;
+  sentcache_pt c= cache>0 ? sentcache_new(cache*1024*1024) : NULL;
+  const int *ct=NULL;
   char **words=NULL;
   int *tags=NULL;
   ssize_t r;
@@ -598,48 +601,62 @@ static void tagging(const char* fn, model_pt m)
 	  words[wno]=t;
 	}
       /* Now we have the sentence available. */
-      for (i=0; i<wno; i++)
+      if (c && wno>0 && (ct=sentcache_get(c, words, wno)))
+	{ memcpy(tags, ct, wno*sizeof(int)); }
+      else
 	{
-	  char *word=words[i];
-	  word_pt w=hash_get(m->dictionary, word);
-	  wtree_pt tree= w ? m->known : m->unknown;
-
-	  report(4, "word %s is %sknown.\n", word, w ? "" : "un");
-	  while (1)
+	  for (i=0; i<wno; i++)
 	    {
-	      feature_pt f=tree->feature;
-	      wtree_pt next;
-	      ptrdiff_t fi;
-
-	      if (!f) { report(4, "leaf node reached, breaking out\n"); break; }
-
-	      fi=find_feature_value_from_sentence(m, f, words, tags, i, wno);
-	      if (fi<0) { report(4, "can't find value, breaking out\n"); break; }
-	      if (fi>=(ssize_t)array_count(tree->children))
-		{ report(4, "can't find child %zd>=%zd, breaking out\n", fi, array_count(tree->children)); break; }
-	      next=(wtree_pt)array_get(tree->children, fi);
-	      if (!next) { report(4, "can't find child for %zd, breaking out\n", fi); break; }
-	      tree=next;
-	      {
-		size_t j;
-		report(4, "  current node %p %td %s :::",
-		       tree, tree->defaulttag, (char *)iregister_get_name(m->tags, tree->defaulttag));
-		for (j=0; j<not; j++)
+	      char *word=words[i];
+	      word_pt w=hash_get(m->dictionary, word);
+	      wtree_pt tree= w ? m->known : m->unknown;
+
+	      report(4, "word %s is %sknown.\n", word, w ? "" : "un");
+	      while (1)
+		{
+		  feature_pt f=tree->feature;
+		  wtree_pt next;
+		  ptrdiff_t fi;
+
+		  if (!f) { report(4, "leaf node reached, breaking out\n"); break; }
+
+		  fi=find_feature_value_from_sentence(m, f, words, tags, i, wno);
+		  if (fi<0) { report(4, "can't find value, breaking out\n"); break; }
+		  if (fi>=(ssize_t)array_count(tree->children))
+		    { report(4, "can't find child %zd>=%zd, breaking out\n", fi, array_count(tree->children)); break; }
+		  next=(wtree_pt)array_get(tree->children, fi);
+		  if (!next) { report(4, "can't find child for %zd, breaking out\n", fi); break; }
+		  tree=next;
 		  {
-		    if (tree->tagcount[j]<=0) { continue; }
-		    report(-4, " %s:%d", (char *)iregister_get_name(m->tags, j), tree->tagcount[j]);
+		    size_t j;
+		    report(4, "  current node %p %td %s :::",
+			   tree, tree->defaulttag, (char *)iregister_get_name(m->tags, tree->defaulttag));
+		    for (j=0; j<not; j++)
+		      {
+			if (tree->tagcount[j]<=0) { continue; }
+			report(-4, " %s:%d", (char *)iregister_get_name(m->tags, j), tree->tagcount[j]);
+		      }
+		    report(-4, "\n");
 		  }
-		report(-4, "\n");
-	      }
+		}
+	      tags[i]=tree->defaulttag;
+	      report(4, "OUT: %s %s\n", word, (char *)iregister_get_name(m->tags, tags[i]));
 	    }
-	  tags[i]=tree->defaulttag;
+	  if (c && wno>0) { sentcache_put(c, words, wno, tags, wno); }
+	}
+      for (i=0; i<wno; i++)
+	{
 	  if (i>0) { printf(" "); }
-	  printf("%s %s", word, (char *)iregister_get_name(m->tags, tags[i]));
-	  report(4, "OUT: %s %s\n", word, (char *)iregister_get_name(m->tags, tags[i]));
+	  printf("%s %s", words[i], (char *)iregister_get_name(m->tags, tags[i]));
 	}
       printf("\n");
     }
   if (words) { mem_free(words); mem_free(tags); }
+  if (c)
+    {
+      sentcache_report(c, 1);
+      sentcache_delete(c);
+    }
   if(buf!=NULL){
     free(buf);
     buf = NULL;
@@ -720,6 +737,7 @@ int main(int argc, char **argv)
   int h = 0;
   unsigned long v = 1;
   char *l = NULL;
+  unsigned long c = 0;
   enum OPTION_OPERATION_MODE o = OPTION_OPERATION_TAG;
   option_callback_data_t cd = {
     &o,
@@ -736,6 +754,7 @@ int main(int argc, char **argv)
 		  { 'v', OPTION_UNSIGNED_LONG, (void*)&v, "verbosity level [1]" },
 		  { 'l', OPTION_STRING, (void*)&l, "lexicon file [none]" },
 		  { 'o', OPTION_CALLBACK, (void*)&cd, "mode of operation 0/tag, 1/test [tag]" },
+		  { 'c', OPTION_UNSIGNED_LONG, (void*)&c, "sentence cache size in MB for tag mode [0, no cache]" },
 		  { '\0', OPTION_NONE, NULL, NULL }
 	  }
   };
@@ -789,7 +808,7 @@ int main(int argc, char **argv)
   switch (o)
     {
     case OPTION_OPERATION_TAG:
-      tagging(ipf, model); break;
+      tagging(ipf, c, model); break;
     case OPTION_OPERATION_TEST:
       testing(model); break;
     default:
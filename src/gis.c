@@ -36,16 +36,26 @@
 */
 
 /* ------------------------------------------------------------ */
+#define _POSIX_C_SOURCE 200809L /* fileno */
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include "config.h"
 #include "array.h"
+#include "hash.h"
 #include "mem.h"
 #include "gis.h"
 #include "util.h"
+#include "parallel.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* ------------------------------------------------------------ */
 event_pt new_event(int count, int oc)
@@ -57,6 +67,13 @@ event_pt new_event(int count, int oc)
   return e;
 }
 
+/* ------------------------------------------------------------ */
+void delete_event(event_pt ev)
+{
+  array_free(ev->predicates);
+  mem_free(ev);
+}
+
 /* ------------------------------------------------------------ */
 predicate_pt new_predicate(int count, void *data, int no_ocs)
 {
@@ -64,6 +81,7 @@ predicate_pt new_predicate(int count, void *data, int no_ocs)
   p->count=count;
   p->data=data;
   p->features=array_new_fill(no_ocs, NULL);
+  p->id=-1;
   return p;
 }
 
@@ -102,101 +120,799 @@ model_pt new_model(array_pt ocs, array_pt pds)
   md->min_pds=md->max_pds=0;
   md->inv_max_pds=md->cf_alpha=md->cf_E=0.0;
   md->userdata=NULL;
+  md->compiled=NULL;
   return md;
 }
 
 /* ------------------------------------------------------------ */
-double train_iteration(model_pt m, array_pt evs)
+static int compare_predicate_ids(const void *a, const void *b)
+{
+  const predicate_pt *p=(const predicate_pt *)a;
+  const predicate_pt *q=(const predicate_pt *)b;
+
+  return (*p)->id - (*q)->id;
+}
+
+/* ------------------------------------------------------------ */
+static size_t event_hash(void *p)
+{
+  event_pt ev=(event_pt)p;
+  size_t h=ev->outcome;
+  size_t i;
+
+  for (i=0; i<array_count(ev->predicates); i++)
+    { h=h*31+((predicate_pt)array_get(ev->predicates, i))->id; }
+  return h;
+}
+
+/* ------------------------------------------------------------ */
+static int event_equal(void *p, void *q)
+{
+  event_pt e=(event_pt)p, f=(event_pt)q;
+  size_t i;
+
+  if (e->outcome!=f->outcome) { return 0; }
+  if (array_count(e->predicates)!=array_count(f->predicates)) { return 0; }
+  for (i=0; i<array_count(e->predicates); i++)
+    { if (array_get(e->predicates, i)!=array_get(f->predicates, i)) { return 0; } }
+  return 1;
+}
+
+/* ------------------------------------------------------------ */
+static int merge_event(void *p, void *data)
+{
+  event_pt ev=(event_pt)p;
+  hash_pt h=(hash_pt)data;
+  event_pt first;
+
+  qsort(ev->predicates->v, array_count(ev->predicates), sizeof(predicate_pt),
+	compare_predicate_ids);
+  first=(event_pt)hash_get(h, ev);
+  if (!first) { hash_put(h, ev, ev); return 0; }
+  first->count+=ev->count;
+  delete_event(ev);
+  return 1;
+}
+
+/* ------------------------------------------------------------ */
+size_t merge_events(model_pt m, array_pt evs)
+{
+  hash_pt h=hash_new(array_count(evs)/4+16, 0.7, event_hash, event_equal);
+  size_t i;
+
+  /* sorting by pointer would make the order of the sums in
+     training depend on the heap layout */
+  for (i=0; i<array_count(m->predicates); i++)
+    { ((predicate_pt)array_get(m->predicates, i))->id=i; }
+  array_filter_with(evs, merge_event, h);
+  hash_delete(h);
+  return array_count(evs);
+}
+
+/* ------------------------------------------------------------ */
+compiled_model_pt compile_model(model_pt m, array_pt evs)
+{
+  compiled_model_pt cm=(compiled_model_pt)mem_malloc(sizeof(compiled_model_t));
+  size_t no_pds=array_count(m->predicates);
+  size_t nf=0, np=0, i;
+
+  for (i=0; i<no_pds; i++)
+    {
+      predicate_pt pd=(predicate_pt)array_get(m->predicates, i);
+      size_t j;
+
+      pd->id=i;
+      if (!pd->features) { continue; }
+      for (j=0; j<array_count(pd->features); j++)
+	{ if (array_get(pd->features, j)) { nf++; } }
+    }
+  cm->no_ocs=m->outcomes ? array_count(m->outcomes) : m->no_ocs;
+  cm->no_pds=no_pds;
+  cm->no_fts=nf;
+  cm->pd_begin=(size_t *)mem_malloc((no_pds+1)*sizeof(size_t));
+  cm->oc=(int *)mem_malloc((nf+1)*sizeof(int));
+  cm->alpha=(double *)mem_malloc((nf+1)*sizeof(double));
+  cm->fts=(feature_pt *)mem_malloc((nf+1)*sizeof(feature_pt));
+  for (nf=0, i=0; i<no_pds; i++)
+    {
+      predicate_pt pd=(predicate_pt)array_get(m->predicates, i);
+      size_t j;
+
+      cm->pd_begin[i]=nf;
+      if (!pd->features) { continue; }
+      for (j=0; j<array_count(pd->features); j++)
+	{
+	  feature_pt ft=(feature_pt)array_get(pd->features, j);
+	  if (!ft) { continue; }
+	  cm->oc[nf]=j;
+	  cm->alpha[nf]=ft->alpha;
+	  cm->fts[nf]=ft;
+	  nf++;
+	}
+    }
+  cm->pd_begin[no_pds]=nf;
+  cm->min_pds=m->min_pds;
+  cm->max_pds=m->max_pds;
+  cm->inv_max_pds=m->inv_max_pds;
+  cm->cf_alpha=m->cf_alpha;
+  cm->cf_E=m->cf_E;
+  cm->ev_map=NULL;
+  cm->ev_map_size=0;
+  if (!evs)
+    {
+      cm->no_evs=0;
+      cm->ev_begin=(size_t *)mem_malloc(sizeof(size_t));
+      cm->ev_pd=cm->ev_oc=cm->ev_count=NULL;
+      cm->ev_begin[0]=0;
+      return cm;
+    }
+
+  cm->no_evs=array_count(evs);
+  for (i=0; i<cm->no_evs; i++)
+    { np+=array_count(((event_pt)array_get(evs, i))->predicates); }
+  cm->ev_begin=(size_t *)mem_malloc((cm->no_evs+1)*sizeof(size_t));
+  cm->ev_pd=(int *)mem_malloc((np+1)*sizeof(int));
+  cm->ev_oc=(int *)mem_malloc((cm->no_evs+1)*sizeof(int));
+  cm->ev_count=(int *)mem_malloc((cm->no_evs+1)*sizeof(int));
+  for (np=0, i=0; i<cm->no_evs; i++)
+    {
+      event_pt ev=(event_pt)array_get(evs, i);
+      size_t j;
+
+      cm->ev_begin[i]=np;
+      cm->ev_oc[i]=ev->outcome;
+      cm->ev_count[i]=ev->count;
+      for (j=0; j<array_count(ev->predicates); j++)
+	{ cm->ev_pd[np++]=((predicate_pt)array_get(ev->predicates, j))->id; }
+    }
+  cm->ev_begin[cm->no_evs]=np;
+  return cm;
+}
+
+/* ------------------------------------------------------------ */
+typedef struct event_file_s
+{
+  char *data;                   /* the mapped region */
+  size_t size;
+  size_t no_evs;                /* room for that many events */
+  size_t max_np;                /* and that many predicates */
+  size_t i;                     /* events added so far */
+  size_t np;                    /* predicates added so far */
+  size_t *ev_begin;
+  int *ev_oc;
+  int *ev_count;
+  int *ev_pd;
+} event_file_t;
+
+/* ------------------------------------------------------------ */
+event_file_pt event_file_new(FILE *f, size_t no_evs, size_t max_np)
 {
-  unsigned int no_ocs=m->outcomes ? array_count(m->outcomes) : 0;
-  unsigned int no_evs=array_count(evs);
-  int modulo=no_evs/20;
+  event_file_pt ef=(event_file_pt)mem_malloc(sizeof(event_file_t));
+
+  ef->size=(no_evs+1)*sizeof(size_t)+(2*no_evs+max_np+1)*sizeof(int);
+#ifdef HAVE_SYS_MMAN_H
+  {
+    off_t page=sysconf(_SC_PAGESIZE);
+    off_t offset;
+
+    /* the region starts on the first page after the data in f */
+    if (fflush(f) || fseeko(f, 0, SEEK_END)<0)
+      { error("can't seek in event file\n"); }
+    offset=ftello(f);
+    if (offset<0) { error("can't seek in event file\n"); }
+    offset=(offset+page-1)/page*page;
+    if (ftruncate(fileno(f), offset+ef->size)<0)
+      { error("can't extend event file\n"); }
+    ef->data=mmap(NULL, ef->size, PROT_READ|PROT_WRITE, MAP_SHARED, fileno(f), offset);
+    if (ef->data==MAP_FAILED) { error("can't map event file\n"); }
+  }
+#else
+  (void)f;
+  ef->data=(char *)mem_malloc(ef->size);
+#endif
+  ef->no_evs=no_evs;
+  ef->max_np=max_np;
+  ef->i=ef->np=0;
+  ef->ev_begin=(size_t *)ef->data;
+  ef->ev_oc=(int *)(ef->data+(no_evs+1)*sizeof(size_t));
+  ef->ev_count=ef->ev_oc+no_evs;
+  ef->ev_pd=ef->ev_count+no_evs;
+  return ef;
+}
+
+/* ------------------------------------------------------------ */
+void event_file_add(event_file_pt ef, event_pt ev)
+{
+  size_t n=array_count(ev->predicates);
+  size_t j;
+
+  if (ef->i>=ef->no_evs || ef->np+n>ef->max_np)
+    { error("too many events for event file\n"); }
+  ef->ev_begin[ef->i]=ef->np;
+  ef->ev_oc[ef->i]=ev->outcome;
+  ef->ev_count[ef->i]=ev->count;
+  for (j=0; j<n; j++)
+    { ef->ev_pd[ef->np++]=((predicate_pt)array_get(ev->predicates, j))->id; }
+  ef->i++;
+}
+
+/* ------------------------------------------------------------ */
+void compiled_model_use_events(compiled_model_pt cm, event_file_pt ef)
+{
+  mem_free(cm->ev_begin);
+  mem_free(cm->ev_pd);
+  mem_free(cm->ev_oc);
+  mem_free(cm->ev_count);
+  ef->ev_begin[ef->i]=ef->np;
+  cm->no_evs=ef->i;
+  cm->ev_begin=ef->ev_begin;
+  cm->ev_oc=ef->ev_oc;
+  cm->ev_count=ef->ev_count;
+  cm->ev_pd=ef->ev_pd;
+  cm->ev_map=ef->data;
+  cm->ev_map_size=ef->size;
+  mem_free(ef);
+}
+
+/* ------------------------------------------------------------ */
+void compiled_model_update(compiled_model_pt cm, model_pt m)
+{
+  size_t i;
+
+  for (i=0; i<cm->no_fts; i++)
+    { if (cm->fts[i]) { cm->fts[i]->alpha=cm->alpha[i]; } }
+  m->cf_alpha=cm->cf_alpha;
+}
+
+/* ------------------------------------------------------------ */
+void compiled_model_drop_features(compiled_model_pt cm, model_pt m)
+{
+  size_t i;
+
+  for (i=0; i<array_count(m->predicates); i++)
+    {
+      predicate_pt pd=(predicate_pt)array_get(m->predicates, i);
+
+      if (!pd->features) { continue; }
+      array_map(pd->features, (void (*)(void *))delete_feature);
+      array_free(pd->features);
+      pd->features=NULL;
+    }
+  memset(cm->fts, 0, cm->no_fts*sizeof(feature_pt));
+}
+
+/* ------------------------------------------------------------ */
+void delete_compiled_model(compiled_model_pt cm)
+{
+  mem_free(cm->pd_begin);
+  mem_free(cm->oc);
+  mem_free(cm->alpha);
+  mem_free(cm->fts);
+  if (cm->ev_map)
+    {
+#ifdef HAVE_SYS_MMAN_H
+      munmap(cm->ev_map, cm->ev_map_size);
+#else
+      mem_free(cm->ev_map);
+#endif
+    }
+  else
+    {
+      mem_free(cm->ev_begin);
+      mem_free(cm->ev_pd);
+      mem_free(cm->ev_oc);
+      mem_free(cm->ev_count);
+    }
+  mem_free(cm);
+}
+
+/* ------------------------------------------------------------ */
+/* exp() for the softmax: x=(64*m+j)*ln2/64+r with |r|<=ln2/128,
+   exp(x)=2^m*2^(j/64)*exp(r), 2^(j/64) from a table, exp(r)-1 from
+   its Taylor series up to r^5 and 2^m put into the exponent bits; libm is
+   used outside [EXP_MIN, EXP_MAX], where 2^m would not be normal */
+#define EXP_MIN -708.0
+#define EXP_MAX 709.0
+#define EXP_64_LN2 92.33248261689366
+#define EXP_LN2_64_HI 0.010830424696223417 /* low 17 bits zero */
+#define EXP_LN2_64_LO 2.572804622327669e-14
+
+static const double exp_2_j_64[64]=
+  {
+    1.0, 1.0108892860517005, 1.0218971486541166, 1.0330248790212284,
+    1.0442737824274138, 1.0556451783605572, 1.0671404006768237, 1.0787607977571199,
+    1.0905077326652577, 1.1023825833078409, 1.1143867425958924, 1.1265216186082418,
+    1.1387886347566916, 1.1511892299529827, 1.1637248587775775, 1.1763969916502812,
+    1.189207115002721, 1.2021567314527031, 1.215247359980469, 1.22848053610687,
+    1.241857812073484, 1.2553807570246911, 1.2690509571917332, 1.2828700160787783,
+    1.2968395546510096, 1.3109612115247644, 1.3252366431597413, 1.3396675240533029,
+    1.3542555469368927, 1.3690024229745905, 1.383909881963832, 1.3989796725383112,
+    1.4142135623730951, 1.42961333839197, 1.4451808069770467, 1.460917794180647,
+    1.4768261459394993, 1.4929077282912648, 1.5091644275934228, 1.5255981507445384,
+    1.5422108254079407, 1.5590044002378369, 1.5759808451078865, 1.593142151342267,
+    1.6104903319492543, 1.6280274218573478, 1.6457554781539649, 1.6636765803267364,
+    1.681792830507429, 1.7001063537185235, 1.7186192981224779, 1.7373338352737062,
+    1.7562521603732995, 1.7753764925265212, 1.7947090750031072, 1.8142521755003989,
+    1.8340080864093424, 1.8539791250833855, 1.8741676341103, 1.8945759815869656,
+    1.9152065613971474, 1.9360617934922943, 1.9571441241754002, 1.9784560263879509
+  };
+
+/* ------------------------------------------------------------ */
+double gis_exp(double x)
+{
+  union { double d; uint64_t u; } e;
+  double dk, r, r2, q, t;
+  long k;
+
+  if (!(x>=EXP_MIN && x<=EXP_MAX)) { return exp(x); }
+  k=lrint(x*EXP_64_LN2);
+  dk=(double)k;
+  r=(x-dk*EXP_LN2_64_HI)-dk*EXP_LN2_64_LO;
+  r2=r*r;
+  q=(r+(1.0/2+1.0/6*r)*r2)+(1.0/24+1.0/120*r)*(r2*r2);
+  t=exp_2_j_64[k&63];
+  e.u=(uint64_t)((k>>6)+1023)<<52;
+  return (t+t*q)*e.d;
+}
+
+#ifdef __SSE2__
+/* ------------------------------------------------------------ */
+/* gis_exp() of both lanes, same operations in the same order */
+static __m128d exp_pd(__m128d x)
+{
+  __m128i k=_mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(EXP_64_LN2)));
+  __m128d dk=_mm_cvtepi32_pd(k);
+  __m128d r=_mm_sub_pd(_mm_sub_pd(x, _mm_mul_pd(dk, _mm_set1_pd(EXP_LN2_64_HI))),
+		       _mm_mul_pd(dk, _mm_set1_pd(EXP_LN2_64_LO)));
+  __m128d r2=_mm_mul_pd(r, r);
+  __m128i j=_mm_and_si128(k, _mm_set1_epi32(63));
+  __m128i e=_mm_add_epi32(_mm_srai_epi32(k, 6), _mm_set1_epi32(1023));
+  __m128d t=_mm_loadh_pd(_mm_load_sd(exp_2_j_64+_mm_cvtsi128_si32(j)),
+			 exp_2_j_64+_mm_cvtsi128_si32(_mm_srli_si128(j, 4)));
+  __m128d q;
+
+#define ADD(a, b) _mm_add_pd(a, b)
+#define MUL(a, b) _mm_mul_pd(a, b)
+#define C(c) _mm_set1_pd(c)
+  q=ADD(ADD(r, MUL(ADD(C(1.0/2), MUL(C(1.0/6), r)), r2)),
+	MUL(ADD(C(1.0/24), MUL(C(1.0/120), r)), MUL(r2, r2)));
+#undef C
+#undef ADD
+#undef MUL
+  e=_mm_slli_epi64(_mm_unpacklo_epi32(e, _mm_setzero_si128()), 52);
+  return _mm_mul_pd(_mm_add_pd(t, _mm_mul_pd(t, q)), _mm_castsi128_pd(e));
+}
+#endif
+
+/* ------------------------------------------------------------ */
+double gis_softmax(double p[], const double sc[], const int n[], double cf,
+		   int max_pds, int seen_only, size_t no_ocs)
+{
+  /* even and odd outcomes are summed apart, like the two lanes */
+  double s[2]={ 0.0, 0.0 };
+  double psum;
+  size_t j=0;
+
+#ifdef __SSE2__
+  {
+    const __m128d vcf=_mm_set1_pd(cf);
+    const __m128d lo=_mm_set1_pd(EXP_MIN), hi=_mm_set1_pd(EXP_MAX);
+    const __m128i vmax=_mm_set1_epi32(max_pds);
+    __m128d vs=_mm_setzero_pd();
+
+    for (; j+2<=no_ocs; j+=2)
+      {
+	__m128i vn=_mm_loadl_epi64((const __m128i *)(n+j));
+	__m128d x=_mm_add_pd(_mm_loadu_pd(sc+j),
+			     _mm_mul_pd(vcf, _mm_cvtepi32_pd(_mm_sub_epi32(vmax, vn))));
+	__m128d e;
+
+	if (_mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(x, lo), _mm_cmple_pd(x, hi)))==3)
+	  { e=exp_pd(x); }
+	else
+	  {
+	    double t[2];
+	    _mm_storeu_pd(t, x);
+	    e=_mm_set_pd(gis_exp(t[1]), gis_exp(t[0]));
+	  }
+	if (seen_only)
+	  { e=_mm_and_pd(e, _mm_cmpneq_pd(_mm_cvtepi32_pd(vn), _mm_setzero_pd())); }
+	_mm_storeu_pd(p+j, e);
+	vs=_mm_add_pd(vs, e);
+      }
+    _mm_storeu_pd(s, vs);
+  }
+#endif
+  for (; j<no_ocs; j++)
+    {
+      double e= seen_only && !n[j] ? 0.0 : gis_exp(sc[j]+cf*(max_pds-n[j]));
+      p[j]=e;
+      s[j&1]+=e;
+    }
+  psum=s[0]+s[1];
+  if (psum>0.0)
+    {
+      double f=1.0/psum;
+      for (j=0; j<no_ocs; j++) { p[j]*=f; }
+    }
+  return psum;
+}
+
+/* ------------------------------------------------------------ */
+/* data shared by the threads of train_iteration_compiled() */
+typedef struct train_job_s
+{
+  compiled_model_pt cm;
+  double *mod;     /* per thread: no_fts additive components */
+  double *cf_mod;  /* per thread: correction feature component */
+  int *pos;        /* per thread: correctly classified events */
+  int *neg;        /* per thread: misclassified events */
+} train_job_t;
+typedef train_job_t *train_job_pt;
+
+/* ------------------------------------------------------------ */
+static void train_worker(size_t id, size_t n, void *data)
+{
+  train_job_pt job=(train_job_pt)data;
+  compiled_model_pt cm=job->cm;
+  unsigned int no_ocs=cm->no_ocs;
+  size_t from=parallel_shard_begin(cm->no_evs, id, n);
+  size_t to=parallel_shard_begin(cm->no_evs, id+1, n);
+  size_t modulo=(to-from)/20;
+  double *mod=job->mod+id*cm->no_fts;
   double pab[no_ocs];
-  int corr[no_ocs];  
+  int n_fts[no_ocs];
+  double cf=cm->max_pds!=cm->min_pds ? cm->cf_alpha : 0.0;
   double cf_mod=0.0;  
   int pos=0, neg=0;
-  unsigned int i;
+  size_t i;
 
-  for (i=0; i<no_evs; i++)
+  for (i=from; i<to; i++)
     {      
-      event_pt ev=(event_pt)array_get(evs, i);
-      double psum=0.0, b_pab;
+      int count=cm->ev_count[i];
+      double b_pab;
       int b_oc;
       unsigned int j;
+      size_t r;
       
-      if (i%modulo==0) { report(3, "%3d%%\r", i*100/no_evs); }
-      for (j=0; j<no_ocs; j++) { pab[j]=0.0; corr[j]=m->max_pds; }
-      for (j=0; j<array_count(ev->predicates); j++)
+      if (id==0 && modulo>0 && (i-from)%modulo==0) { report(3, "%3d%%\r", (int)((i-from)*100/(to-from))); }
+      for (j=0; j<no_ocs; j++) { pab[j]=0.0; n_fts[j]=0; }
+      for (r=cm->ev_begin[i]; r<cm->ev_begin[i+1]; r++)
 	{
-	  predicate_pt pd=(predicate_pt)array_get(ev->predicates, j);
-	  unsigned int k;
+	  int p=cm->ev_pd[r];
+	  size_t k;
 
-	  for (k=0; k<array_count(pd->features); k++)
+	  for (k=cm->pd_begin[p]; k<cm->pd_begin[p+1]; k++)
 	    {
-	      feature_pt ft=(feature_pt)array_get(pd->features, k);
-	      if (!ft) { continue; }
-	      corr[k]--;
-	      pab[k]+=ft->alpha;
+	      n_fts[cm->oc[k]]++;
+	      pab[cm->oc[k]]+=cm->alpha[k];
 	    }
 	}
-      /* */      
-      for (j=0; j<no_ocs; j++)
-	{
-	  if (corr[j]==m->max_pds) { continue; }
-	  if (m->max_pds!=m->min_pds) { pab[j]+=m->cf_alpha*corr[j]; }
-	  pab[j]=exp(pab[j]);
-	  psum+=pab[j];
-	}
-      /* normalize */
-      if (psum>0.0) { for (j=0; j<no_ocs; j++) { if (corr[j]!=m->max_pds) { pab[j]/=psum; } } }
+      /* outcomes without features keep probability 0 */
+      (void)gis_softmax(pab, pab, n_fts, cf, cm->max_pds, 1, no_ocs);
 
       /* store success (could be done in loop above) */
-      for (j=0; j<no_ocs && corr[j]==m->max_pds; j++) { /* nothing */ }
+      for (j=0; j<no_ocs && !n_fts[j]; j++) { /* nothing */ }
       b_pab=pab[j]; b_oc=j;
       for (j=j+1; j<no_ocs; j++)
 	{ if (pab[j]>b_pab) { b_pab=pab[j]; b_oc=j; } }
-      if (b_oc==ev->outcome) { pos+=ev->count; } else { neg+=ev->count; }
+      if (b_oc==cm->ev_oc[i]) { pos+=count; } else { neg+=count; }
       
       /* update correction */
-      if (m->max_pds!=m->min_pds)
-	{ for (j=0; j<no_ocs; j++) { if (corr[j]!=m->max_pds) { cf_mod+=pab[j]*corr[j]*ev->count; } } }
+      if (cm->max_pds!=cm->min_pds)
+	{ for (j=0; j<no_ocs; j++) { if (n_fts[j]) { cf_mod+=pab[j]*(cm->max_pds-n_fts[j])*count; } } }
 
-      for (j=0; j<array_count(ev->predicates); j++)
+      for (r=cm->ev_begin[i]; r<cm->ev_begin[i+1]; r++)
 	{
-	  predicate_pt pd=(predicate_pt)array_get(ev->predicates, j);
-	  unsigned int k;
+	  int p=cm->ev_pd[r];
+	  size_t k;
 
-	  for (k=0; k<array_count(pd->features); k++)
-	    {
-	      feature_pt ft=(feature_pt)array_get(pd->features, k);
-	      if (!ft) { continue; }
- 	      ft->mod+=pab[k]*ev->count; 
-	    }
+	  for (k=cm->pd_begin[p]; k<cm->pd_begin[p+1]; k++)
+	    { mod[k]+=pab[cm->oc[k]]*count; }
 	}
     }
+  job->cf_mod[id]=cf_mod;
+  job->pos[id]=pos;
+  job->neg[id]=neg;
+}
 
-  for (i=0; i<array_count(m->predicates); i++)
+/* ------------------------------------------------------------ */
+double train_iteration_compiled(compiled_model_pt cm, size_t nt)
+{
+  train_job_t job;
+  double cf_mod=0.0;
+  int pos=0, neg=0;
+  size_t nf=cm->no_fts, t, i;
+
+  if (nt==0) { nt=1; }
+  job.cm=cm;
+  job.mod=(double *)mem_malloc(nt*nf*sizeof(double)+1);
+  memset(job.mod, 0, nt*nf*sizeof(double));
+  job.cf_mod=(double *)mem_malloc(nt*sizeof(double));
+  job.pos=(int *)mem_malloc(nt*sizeof(int));
+  job.neg=(int *)mem_malloc(nt*sizeof(int));
+  parallel_run(nt, train_worker, &job);
+
+  for (t=0; t<nt; t++)
     {
-      predicate_pt pd=(predicate_pt)array_get(m->predicates, i);
-      unsigned int j;
+      cf_mod+=job.cf_mod[t];
+      pos+=job.pos[t];
+      neg+=job.neg[t];
+    }
+  for (i=0; i<nf; i++)
+    {
+      double mod=0.0;
 
-      for (j=0; j<array_count(pd->features); j++)
-	{
-	  feature_pt ft=(feature_pt)array_get(pd->features, j);
-	  if (!ft) { continue; }
-	  ft->alpha+=m->inv_max_pds*(ft->E - log(ft->mod));
-	  ft->mod=0.0;
-	}
+      for (t=0; t<nt; t++) { mod+=job.mod[t*nf+i]; }
+      cm->alpha[i]+=cm->inv_max_pds*(cm->fts[i]->E - log(mod));
     }
+  mem_free(job.mod);
+  mem_free(job.cf_mod);
+  mem_free(job.pos);
+  mem_free(job.neg);
   
   /* update alpha for correction feature */
   if (cf_mod>0.0)
-    { m->cf_alpha+=m->inv_max_pds*(m->cf_E - log(cf_mod)); }
+    { cm->cf_alpha+=cm->inv_max_pds*(cm->cf_E - log(cf_mod)); }
   report(3, "done\r");
 
   return (double)pos/((double)(pos+neg));
 }
 
+/* ------------------------------------------------------------ */
+double train_iteration(model_pt m, array_pt evs)
+{
+  compiled_model_pt cm=compile_model(m, evs);
+  double a=train_iteration_compiled(cm, 1);
+
+  compiled_model_update(cm, m);
+  delete_compiled_model(cm);
+  return a;
+}
+
+/* ------------------------------------------------------------ */
+/* number of correction pairs kept by train_lbfgs() */
+#define LBFGS_MEMORY 10
+/* relative decrease of the objective below which training stops */
+#define LBFGS_EPSILON 1e-6
+
+/* data shared by the threads of lbfgs_evaluate() */
+typedef struct lbfgs_job_s
+{
+  compiled_model_pt cm;
+  const double *x; /* parameters, indexed like cm->alpha */
+  double *g;       /* per thread: no_fts model expectations */
+  double *ll;      /* per thread: log-likelihood */
+  int *pos;        /* per thread: correctly classified events */
+  int *neg;        /* per thread: misclassified events */
+} lbfgs_job_t;
+typedef lbfgs_job_t *lbfgs_job_pt;
+
+/* ------------------------------------------------------------ */
+static void lbfgs_worker(size_t id, size_t n, void *data)
+{
+  lbfgs_job_pt job=(lbfgs_job_pt)data;
+  compiled_model_pt cm=job->cm;
+  unsigned int no_ocs=cm->no_ocs;
+  size_t from=parallel_shard_begin(cm->no_evs, id, n);
+  size_t to=parallel_shard_begin(cm->no_evs, id+1, n);
+  const double *x=job->x;
+  double *g=job->g+id*cm->no_fts;
+  double sc[no_ocs], pab[no_ocs];
+  double ll=0.0;
+  int pos=0, neg=0;
+  size_t i;
+
+  memset(g, 0, cm->no_fts*sizeof(double));
+  for (i=from; i<to; i++)
+    {
+      int count=cm->ev_count[i];
+      double max, psum=0.0, lz;
+      int b_oc=0;
+      unsigned int j;
+      size_t r;
+
+      for (j=0; j<no_ocs; j++) { sc[j]=0.0; }
+      for (r=cm->ev_begin[i]; r<cm->ev_begin[i+1]; r++)
+	{
+	  int p=cm->ev_pd[r];
+	  size_t k;
+
+	  for (k=cm->pd_begin[p]; k<cm->pd_begin[p+1]; k++)
+	    { sc[cm->oc[k]]+=x[k]; }
+	}
+      /* log of the normalization, as in assign_probabilities() */
+      max=sc[0];
+      for (j=1; j<no_ocs; j++) { if (sc[j]>max) { max=sc[j]; b_oc=j; } }
+      for (j=0; j<no_ocs; j++) { psum+=(pab[j]=exp(sc[j]-max)); }
+      lz=max+log(psum);
+      ll+=count*(sc[cm->ev_oc[i]]-lz);
+      for (j=0; j<no_ocs; j++) { pab[j]*=count/psum; }
+      if (b_oc==cm->ev_oc[i]) { pos+=count; } else { neg+=count; }
+
+      for (r=cm->ev_begin[i]; r<cm->ev_begin[i+1]; r++)
+	{
+	  int p=cm->ev_pd[r];
+	  size_t k;
+
+	  for (k=cm->pd_begin[p]; k<cm->pd_begin[p+1]; k++)
+	    { g[k]+=pab[cm->oc[k]]; }
+	}
+    }
+  job->ll[id]=ll;
+  job->pos[id]=pos;
+  job->neg[id]=neg;
+}
+
+/* ------------------------------------------------------------ */
+/* negative log-likelihood (plus prior) at x and its gradient g */
+static double lbfgs_evaluate(lbfgs_job_pt job, size_t nt, const double *x,
+			     const double *emp, double sigma2, double *g, double *acc)
+{
+  size_t nf=job->cm->no_fts;
+  double f=0.0;
+  int pos=0, neg=0;
+  size_t i, t;
+
+  job->x=x;
+  parallel_run(nt, lbfgs_worker, job);
+  for (t=0; t<nt; t++)
+    {
+      f-=job->ll[t];
+      pos+=job->pos[t];
+      neg+=job->neg[t];
+    }
+  for (i=0; i<nf; i++)
+    {
+      g[i]=-emp[i];
+      for (t=0; t<nt; t++) { g[i]+=job->g[t*nf+i]; }
+      if (sigma2>0.0)
+	{
+	  f+=x[i]*x[i]/(2.0*sigma2);
+	  g[i]+=x[i]/sigma2;
+	}
+    }
+  *acc=(double)pos/((double)(pos+neg));
+  return f;
+}
+
+/* ------------------------------------------------------------ */
+static double dot_product(const double *a, const double *b, size_t n)
+{
+  double r=0.0;
+  size_t i;
+
+  for (i=0; i<n; i++) { r+=a[i]*b[i]; }
+  return r;
+}
+
+/* ------------------------------------------------------------ */
+double train_lbfgs(compiled_model_pt cm, size_t mi, double sigma2, size_t nt)
+{
+  lbfgs_job_t job;
+  double *block, *x, *g, *xn, *gn, *d, *emp, *sv, *yv;
+  double rho[LBFGS_MEMORY], al[LBFGS_MEMORY];
+  double f, acc=0.0;
+  size_t nf=cm->no_fts, nh=0, last=0, it, i;
+
+  if (nt==0) { nt=1; }
+  block=(double *)mem_malloc((6+2*LBFGS_MEMORY)*(nf+1)*sizeof(double));
+  x=block; g=x+(nf+1); xn=g+(nf+1); gn=xn+(nf+1); d=gn+(nf+1); emp=d+(nf+1);
+  sv=emp+(nf+1); yv=sv+LBFGS_MEMORY*(nf+1);
+  memcpy(x, cm->alpha, nf*sizeof(double));
+  memset(emp, 0, nf*sizeof(double));
+  /* empirical counts, taken from the events themselves */
+  for (i=0; i<cm->no_evs; i++)
+    {
+      size_t r;
+
+      for (r=cm->ev_begin[i]; r<cm->ev_begin[i+1]; r++)
+	{
+	  int p=cm->ev_pd[r];
+	  size_t k;
+
+	  for (k=cm->pd_begin[p]; k<cm->pd_begin[p+1]; k++)
+	    { if (cm->oc[k]==cm->ev_oc[i]) { emp[k]+=cm->ev_count[i]; } }
+	}
+    }
+  /* the correction feature is a GIS device, the tagger's model
+     without it is a plain conditional maximum entropy model */
+  cm->cf_alpha=0.0;
+
+  job.cm=cm;
+  job.g=(double *)mem_malloc(nt*nf*sizeof(double)+1);
+  job.ll=(double *)mem_malloc(nt*sizeof(double));
+  job.pos=(int *)mem_malloc(nt*sizeof(int));
+  job.neg=(int *)mem_malloc(nt*sizeof(int));
+
+  f=lbfgs_evaluate(&job, nt, x, emp, sigma2, g, &acc);
+  for (it=1; it<=mi; it++)
+    {
+      double dg, step=1.0, fn=f, accn=acc, *tmp;
+      size_t k, tries;
+
+      /* two-loop recursion: d=-H g, slot last holds the newest pair */
+      for (i=0; i<nf; i++) { d[i]=-g[i]; }
+      for (k=0; k<nh; k++)
+	{
+	  size_t h=(last+LBFGS_MEMORY-k) % LBFGS_MEMORY;
+	  al[h]=rho[h]*dot_product(sv+h*(nf+1), d, nf);
+	  for (i=0; i<nf; i++) { d[i]-=al[h]*yv[h*(nf+1)+i]; }
+	}
+      if (nh>0)
+	{
+	  double *y=yv+last*(nf+1);
+	  double gamma=1.0/(rho[last]*dot_product(y, y, nf));
+	  for (i=0; i<nf; i++) { d[i]*=gamma; }
+	}
+      else
+	{
+	  double gg=sqrt(dot_product(g, g, nf));
+	  if (gg>0.0) { for (i=0; i<nf; i++) { d[i]/=gg; } }
+	}
+      for (k=nh; k>0; k--)
+	{
+	  size_t h=(last+LBFGS_MEMORY-k+1) % LBFGS_MEMORY;
+	  double b=rho[h]*dot_product(yv+h*(nf+1), d, nf);
+	  for (i=0; i<nf; i++) { d[i]+=(al[h]-b)*sv[h*(nf+1)+i]; }
+	}
+      dg=dot_product(d, g, nf);
+      if (dg>=0.0)
+	{
+	  /* not a descent direction, start afresh */
+	  double gg=sqrt(dot_product(g, g, nf));
+	  for (i=0; i<nf; i++) { d[i]=-g[i]/gg; }
+	  dg=-gg;
+	  nh=0;
+	}
+
+      /* backtracking line search (Armijo condition) */
+      for (tries=0; tries<30; tries++, step*=0.5)
+	{
+	  for (i=0; i<nf; i++) { xn[i]=x[i]+step*d[i]; }
+	  fn=lbfgs_evaluate(&job, nt, xn, emp, sigma2, gn, &accn);
+	  if (fn<=f+1e-4*step*dg) { break; }
+	}
+      if (tries==30)
+	{ report(1, "line search failed, stopping\n"); break; }
+
+      /* remember the correction pair */
+      {
+	size_t h=nh>0 ? (last+1) % LBFGS_MEMORY : 0;
+	double *s=sv+h*(nf+1), *y=yv+h*(nf+1);
+	double sy;
+
+	for (i=0; i<nf; i++) { s[i]=xn[i]-x[i]; y[i]=gn[i]-g[i]; }
+	sy=dot_product(s, y, nf);
+	/* skip pairs that would spoil positive definiteness */
+	if (sy>1e-10)
+	  {
+	    rho[h]=1.0/sy;
+	    last=h;
+	    if (nh<LBFGS_MEMORY) { nh++; }
+	  }
+	else if (nh==LBFGS_MEMORY) { nh--; } /* slot h was the oldest pair */
+      }
+      report(2, "%4d: accuracy %7.3f%%, %+9.5f%%, objective %f\n",
+	     (int)it, accn*100.0, (accn-acc)*100.0, fn);
+      tmp=x; x=xn; xn=tmp;
+      tmp=g; g=gn; gn=tmp;
+      acc=accn;
+      if ((f-fn)/(fabs(f)>1.0 ? fabs(f) : 1.0)<LBFGS_EPSILON)
+	{ f=fn; report(1, "converged after %d iterations\n", (int)it); break; }
+      f=fn;
+    }
+
+  memcpy(cm->alpha, x, nf*sizeof(double));
+  mem_free(job.g);
+  mem_free(job.ll);
+  mem_free(job.pos);
+  mem_free(job.neg);
+  mem_free(block);
+
+  return acc;
+}
+
 /* ------------------------------------------------------------ */
 void assign_probabilities2(model_pt m, array_pt pds, double p[])
 {
@@ -230,38 +946,54 @@ void assign_probabilities2(model_pt m, array_pt pds, double p[])
 }
 
 /* ------------------------------------------------------------ */
-void assign_probabilities(model_pt m, array_pt pds, double p[])
+void add_feature_weights(model_pt m, array_pt pds, double sc[], int n[])
 {
   unsigned int j;
-  unsigned int no_ocs=array_count(m->outcomes);
-  int corr[no_ocs];  
-  double psum=0.0;
-  
-  for (j=0; j<no_ocs; j++) { p[j]=0.0; corr[j]=m->max_pds; }
+
   for (j=0; j<array_count(pds); j++)
     {
       predicate_pt pd=(predicate_pt)array_get(pds, j);
       unsigned int k;
 
+      if (m->compiled)
+	{
+	  compiled_model_pt cm=m->compiled;
+	  size_t r;
+
+	  for (r=cm->pd_begin[pd->id]; r<cm->pd_begin[pd->id+1]; r++)
+	    {
+	      n[cm->oc[r]]++;
+	      sc[cm->oc[r]]+=cm->alpha[r];
+	    }
+	  continue;
+	}
       for (k=0; k<array_count(pd->features); k++)
 	{
 	  feature_pt ft=(feature_pt)array_get(pd->features, k);
 	  if (!ft) { continue; }
-	  corr[ft->outcome]--;
-	  p[ft->outcome]+=ft->alpha;
+	  n[ft->outcome]++;
+	  sc[ft->outcome]+=ft->alpha;
 	}
     }
-  /* exponentiate and compute normalization */      
-  for (j=0; j<no_ocs; j++)
-    {
-      /* if (m->max_pds!=m->min_pds) { p[j]+=m->cf_alpha*corr[j]; } */
-      p[j]+=m->cf_alpha*corr[j];
-      p[j]=exp(p[j]);
-      psum+=p[j];
-    }
-  /* normalize */
-  /* if (psum>0.0) { for (j=0; j<no_ocs; j++) { p[j]/=psum; } } */
-  for (j=0; j<no_ocs; j++) { p[j]/=psum; }
+}
+
+/* ------------------------------------------------------------ */
+void scores_to_probabilities(model_pt m, const double sc[], const int n[], double p[])
+{
+  (void)gis_softmax(p, sc, n, m->cf_alpha, m->max_pds, 0, array_count(m->outcomes));
+}
+
+/* ------------------------------------------------------------ */
+void assign_probabilities(model_pt m, array_pt pds, double p[])
+{
+  unsigned int no_ocs=array_count(m->outcomes);
+  double sc[no_ocs];
+  int n[no_ocs];  
+  unsigned int j;
+  
+  for (j=0; j<no_ocs; j++) { sc[j]=0.0; n[j]=0; }
+  add_feature_weights(m, pds, sc, n);
+  scores_to_probabilities(m, sc, n, p);
 }
 
 /* ------------------------------------------------------------ */
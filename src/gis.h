@@ -39,6 +39,8 @@
 #define GIS_H
 
 /* ------------------------------------------------------------ */
+#include <stddef.h> /* for size_t. */
+#include <stdio.h> /* for FILE. */
 #include "array.h"
 
 /* ------------------------------------------------------------ */
@@ -55,6 +57,7 @@ typedef struct predicate_s
   int count;
   array_pt features;
   void *data;
+  int id;                       /* index in the model, see compile_model */
 } predicate_t;
 typedef predicate_t *predicate_pt;
 
@@ -69,6 +72,36 @@ typedef struct feature_s
 } feature_t;
 typedef feature_t *feature_pt;
 
+/* compressed sparse row form of a model and its events: the
+   features of predicate p are oc/alpha[pd_begin[p]..pd_begin[p+1]),
+   the predicates of event e are ev_pd[ev_begin[e]..ev_begin[e+1]) */
+typedef struct compiled_model_s
+{
+  size_t no_ocs;
+  size_t no_pds;
+  size_t no_fts;
+  size_t *pd_begin;             /* no_pds+1 offsets into oc/alpha */
+  int *oc;                      /* outcome of each feature */
+  double *alpha;                /* weight of each feature */
+  feature_pt *fts;              /* the features themselves, or NULL */
+
+  size_t no_evs;
+  size_t *ev_begin;             /* no_evs+1 offsets into ev_pd */
+  int *ev_pd;                   /* predicate ids of the events */
+  int *ev_oc;                   /* outcome of each event */
+  int *ev_count;                /* count of each event */
+
+  int min_pds;
+  int max_pds;
+  double inv_max_pds;
+  double cf_alpha;
+  double cf_E;
+
+  void *ev_map;                 /* events mapped from a file, or NULL */
+  size_t ev_map_size;
+} compiled_model_t;
+typedef compiled_model_t *compiled_model_pt;
+
 typedef struct model_s
 {
   int no_fts;
@@ -84,6 +117,7 @@ typedef struct model_s
   double cf_alpha;
   double cf_E;
 
+  compiled_model_pt compiled;   /* used for tagging if not NULL */
   void *userdata;
 } model_t;
 typedef model_t *model_pt;
@@ -92,6 +126,7 @@ typedef model_t *model_pt;
 /* ------------------------------------------------------------ */
 /* parameters: count, outcome */
 event_pt new_event(int, int);
+void delete_event(event_pt);
 
 /* parameters: count, data, no_ocs */
 predicate_pt new_predicate(int, void *, int);
@@ -104,6 +139,38 @@ void delete_feature(feature_pt);
 /* */
 model_pt new_model(array_pt evs, array_pt pds);
 
+/* ------------------------------------------------------------
+   merge events with the same outcome and predicates into one
+   event with the summed count; sorts the predicates of each event
+   - parameters: model, events
+   - returns: number of events left
+*/
+size_t merge_events(model_pt, array_pt);
+
+/* ------------------------------------------------------------
+   compile model and events (may be NULL) into CSR form; numbers
+   the predicates of the model
+*/
+compiled_model_pt compile_model(model_pt, array_pt);
+/* copy the trained weights back into the model's features */
+void compiled_model_update(compiled_model_pt, model_pt);
+/* free the model's features and tag with the compiled form only */
+void compiled_model_drop_features(compiled_model_pt, model_pt);
+void delete_compiled_model(compiled_model_pt);
+
+/* ------------------------------------------------------------
+   compiled events in a region mapped after the end of a file, for
+   event sets larger than main memory; the events are added one by
+   one, using the predicate ids, and then handed to a compiled model
+   - parameters: file, number of events, number of predicates of
+     all events
+*/
+typedef struct event_file_s *event_file_pt;
+event_file_pt event_file_new(FILE *, size_t, size_t);
+void event_file_add(event_file_pt, event_pt);
+/* the compiled model takes over the region; its own events go */
+void compiled_model_use_events(compiled_model_pt, event_file_pt);
+
 /* ------------------------------------------------------------
   accuracy of all events in evs 
   - parameters: model, events
@@ -117,6 +184,33 @@ model_pt new_model(array_pt evs, array_pt pds);
 void assign_probabilities(model_pt, array_pt, double []);
 void assign_probabilities2(model_pt, array_pt, double []);
 
+/* ------------------------------------------------------------
+   the two steps of assign_probabilities: add the weights of the
+   features of the predicates to the scores sc and count them in n
+   (both zero for a fresh context), and turn scores into
+   probabilities; lets callers share the scores of common predicates
+   - parameters: model, predicates, scores, feature counts
+   - parameters: model, scores, feature counts, p field
+*/
+void add_feature_weights(model_pt, array_pt, double [], int []);
+void scores_to_probabilities(model_pt, const double [], const int [], double []);
+
+/* ------------------------------------------------------------
+   exp(x) within a few ulps of libm, for the softmax below
+*/
+double gis_exp(double);
+
+/* ------------------------------------------------------------
+   the softmax of the scores: p[j]=exp(sc[j]+cf*(max_pds-n[j]))
+   normalized to sum 1, with p[j]=0 where n[j]==0 if seen_only;
+   p may be sc; vectorized with SSE2 if the compiler targets it,
+   with the same results
+   - parameters: p field, scores, feature counts, correction weight,
+     max_pds, seen_only, number of outcomes
+   - returns: the sum before normalization
+*/
+double gis_softmax(double [], const double [], const int [], double, int, int, size_t);
+
 /* ------------------------------------------------------------
    GIS training
    - m: model to train
@@ -131,6 +225,22 @@ void assign_probabilities2(model_pt, array_pt, double []);
 */
 double train_iteration(model_pt, array_pt);
 
+/* ------------------------------------------------------------
+  like train_iteration, but on the compiled model, with the events
+  split among nt threads
+  - parameters: compiled model, number of threads
+*/
+double train_iteration_compiled(compiled_model_pt, size_t);
+
+/* ------------------------------------------------------------
+  trains the compiled model with L-BFGS instead of GIS; the
+  correction feature is not used and cf_alpha is set to 0
+  - parameters: compiled model, maximum number of iterations,
+    variance of the Gaussian prior (<=0 for none), number of threads
+  - returns: accuracy on the events
+*/
+double train_lbfgs(compiled_model_pt, size_t, double, size_t);
+
 /* ------------------------------------------------------------
    redistribute the probability in p setting all outcomes except
    those in keep to zero
@@ -36,6 +36,7 @@
 */
 
 /* ------------------------------------------------------------ */
+#define _POSIX_C_SOURCE 200809L /* fileno */
 #include "config-common.h"
 #include "options.h"
 #include "option_mode.h"
@@ -54,6 +55,12 @@
 #include <time.h>
 #include <sys/time.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include "hash.h"
 #include "array.h"
 #include "util.h"
@@ -61,12 +68,17 @@
 #include "sregister.h"
 #include "gis.h"
 #include "eqsort.h"
+#include "sentcache.h"
+#include "parallel.h"
 
 typedef struct globals_s
 {
   char *cmd;    /* command name */
   unsigned int rwt;  /* threshold for rare words */
   sregister_pt strings;
+  size_t memo_size;  /* bytes for the probability memo, 0 for none */
+  unsigned int hash_bits; /* hash word predicates into 2^hash_bits buckets, 0 for none */
+  struct sketch_s *sketch; /* approximate feature counts, train mode */
 } globals_t;
 typedef globals_t *globals_pt;
 
@@ -93,10 +105,11 @@ typedef enum {
   pt_wm2,
   pt_wp1,
   pt_wp2,
-  pt_default
+  pt_default,
+  pt_hashed
 } ptype_e;
 #define min_ptype_e ((int)pt_word)
-#define max_ptype_e ((int)pt_default)
+#define max_ptype_e ((int)pt_hashed)
 #define no_ptype_e (max_ptype_e-min_ptype_e+1)
 
 typedef struct predinfo_s
@@ -113,15 +126,196 @@ typedef struct predindex_s
 {
   hash_pt wm2, wm1, word, wp1, wp2;
   predicate_pt wm2_null, wm1_null, wp1_null, wp2_null;
-  hash_pt prefix, suffix;
+  struct affix_trie_s *prefix, *suffix;
   array_pt tm1, tm1tm2;
   predicate_pt number;
   predicate_pt uppercase;
   predicate_pt hyphen;
   predicate_pt def;
+  predicate_pt *hashed;         /* 2^g->hash_bits buckets, or NULL */
+  struct binmodel_s *bin;       /* binary model, or NULL */
 } predindex_t;
 typedef predindex_t *predindex_pt;
 
+/* ------------------------------------------------------------ */
+static size_t predicate_hash(int type, const char *s)
+{
+  size_t h=2166136261u;
+
+  h=(h^(size_t)type)*16777619u;
+  for (; *s; s++) { h=(h^(unsigned char)*s)*16777619u; }
+  return h;
+}
+
+/* ------------------------------------------------------------ */
+/* prefix and suffix predicates in a trie over the bytes of the affix,
+   read from the end for suffixes; all affixes of a word are then
+   found in one walk over it */
+typedef struct affix_node_s
+{
+  unsigned char c;              /* byte leading here */
+  predicate_pt pd;              /* predicate of the affix ending here */
+  uint32_t child;               /* first child, children sorted by c */
+  uint32_t no_children;
+} affix_node_t;
+
+typedef struct affix_entry_s
+{
+  const char *s;
+  size_t n;
+  predicate_pt pd;
+} affix_entry_t;
+
+typedef struct affix_trie_s
+{
+  int reverse;                  /* suffixes */
+  affix_node_t *nodes;          /* nodes[0] is the root */
+  size_t no_nodes;
+  affix_entry_t *es;            /* added, not yet built */
+  size_t no_es, size;
+} affix_trie_t;
+typedef affix_trie_t *affix_trie_pt;
+
+/* ------------------------------------------------------------ */
+static affix_trie_pt affix_trie_new(int reverse)
+{
+  affix_trie_pt t=(affix_trie_pt)mem_malloc(sizeof(affix_trie_t));
+
+  memset(t, 0, sizeof(affix_trie_t));
+  t->reverse=reverse;
+  return t;
+}
+
+/* ------------------------------------------------------------ */
+/* s must live until affix_trie_build() */
+static void affix_trie_add(affix_trie_pt t, const char *s, predicate_pt pd)
+{
+  if (t->no_es==t->size)
+    {
+      t->size= t->size ? 2*t->size : 256;
+      t->es=(affix_entry_t *)mem_realloc(t->es, t->size*sizeof(affix_entry_t));
+    }
+  t->es[t->no_es].s=s;
+  t->es[t->no_es].n=strlen(s);
+  t->es[t->no_es].pd=pd;
+  t->no_es++;
+}
+
+/* ------------------------------------------------------------ */
+static int affix_byte(const affix_entry_t *e, size_t i, int reverse)
+{
+  return (unsigned char)e->s[reverse ? e->n-1-i : i];
+}
+
+/* ------------------------------------------------------------ */
+static int compare_affixes(const affix_entry_t *a, const affix_entry_t *b, int reverse)
+{
+  size_t i;
+
+  for (i=0; i<a->n && i<b->n; i++)
+    {
+      int d=affix_byte(a, i, reverse)-affix_byte(b, i, reverse);
+      if (d) { return d; }
+    }
+  return a->n<b->n ? -1 : a->n>b->n;
+}
+
+static int compare_prefixes(const void *a, const void *b) { return compare_affixes(a, b, 0); }
+static int compare_suffixes(const void *a, const void *b) { return compare_affixes(a, b, 1); }
+
+/* ------------------------------------------------------------ */
+/* children of node k from the sorted entries [lo, hi), which all
+   share their first i bytes */
+static void affix_trie_fill(affix_trie_pt t, size_t k, size_t lo, size_t hi, size_t i)
+{
+  size_t j, c;
+
+  if (lo<hi && t->es[lo].n==i) { t->nodes[k].pd=t->es[lo++].pd; }
+  t->nodes[k].child=t->no_nodes;
+  for (j=lo; j<hi; j=c)
+    {
+      affix_node_t *nd=t->nodes+t->no_nodes++;
+
+      nd->c=affix_byte(t->es+j, i, t->reverse);
+      nd->pd=NULL;
+      nd->no_children=0;
+      for (c=j+1; c<hi && affix_byte(t->es+c, i, t->reverse)==nd->c; c++) ;
+    }
+  t->nodes[k].no_children=t->no_nodes-t->nodes[k].child;
+  for (c=t->nodes[k].child, j=lo; j<hi; c++)
+    {
+      size_t e;
+
+      for (e=j+1; e<hi && affix_byte(t->es+e, i, t->reverse)==t->nodes[c].c; e++) ;
+      affix_trie_fill(t, c, j, e, i+1);
+      j=e;
+    }
+}
+
+/* ------------------------------------------------------------ */
+static void affix_trie_build(affix_trie_pt t)
+{
+  size_t n=1, i;
+
+  /* hashed models have no entries, and es is NULL then; the trie
+     is only the root */
+  if (t->no_es>0)
+    { qsort(t->es, t->no_es, sizeof(affix_entry_t), t->reverse ? compare_suffixes : compare_prefixes); }
+  /* at most one node per byte of each entry */
+  for (i=0; i<t->no_es; i++) { n+=t->es[i].n; }
+  t->nodes=(affix_node_t *)mem_malloc(n*sizeof(affix_node_t));
+  memset(t->nodes, 0, sizeof(affix_node_t));
+  t->no_nodes=1;
+  affix_trie_fill(t, 0, 0, t->no_es, 0);
+  mem_free(t->es);
+  t->es=NULL;
+  t->no_es=t->size=0;
+}
+
+/* ------------------------------------------------------------ */
+/* child of node k for byte c, or NULL */
+static const affix_node_t *affix_child(affix_trie_pt t, const affix_node_t *k, unsigned char c)
+{
+  const affix_node_t *lo=t->nodes+k->child, *hi=lo+k->no_children;
+
+  while (lo<hi)
+    {
+      const affix_node_t *mid=lo+(hi-lo)/2;
+      if (mid->c<c) { lo=mid+1; }
+      else if (mid->c>c) { hi=mid; }
+      else { return mid; }
+    }
+  return NULL;
+}
+
+/* ------------------------------------------------------------ */
+/* pds[i] is the predicate of the affix of length i+1 of w, which has
+   length cl, or NULL; i<n */
+static void affix_trie_walk(affix_trie_pt t, const char *w, size_t cl, size_t n, predicate_pt pds[])
+{
+  const affix_node_t *k=t->nodes;
+  size_t i;
+
+  for (i=0; i<n; i++)
+    {
+      k= k ? affix_child(t, k, (unsigned char)w[t->reverse ? cl-1-i : i]) : NULL;
+      pds[i]= k ? k->pd : NULL;
+    }
+}
+
+/* ------------------------------------------------------------ */
+/* predicate of the affix s, or NULL */
+static predicate_pt affix_trie_get(affix_trie_pt t, const char *s)
+{
+  size_t cl=strlen(s);
+  const affix_node_t *k=t->nodes;
+  size_t i;
+
+  for (i=0; k && i<cl; i++)
+    { k=affix_child(t, k, (unsigned char)s[t->reverse ? cl-1-i : i]); }
+  return k ? k->pd : NULL;
+}
+
 /* ------------------------------------------------------------ */
 static globals_pt new_globals(globals_pt old)
 {
@@ -131,6 +325,9 @@ static globals_pt new_globals(globals_pt old)
 
   g->cmd=NULL;
   g->rwt=5;
+  g->memo_size=0;
+  g->hash_bits=0;
+  g->sketch=NULL;
   return g;
 }
 
@@ -160,13 +357,109 @@ static char *register_word(char *w, size_t t, array_pt wds, array_pt wtgs, array
   return s;
 }
 
+/* ------------------------------------------------------------ */
+/* count-min sketch of the feature counts: an estimate never falls
+   short of the true count, so a feature estimated below the cutoff
+   would not survive select_features() anyway */
+#define SKETCH_DEPTH 4
+
+typedef struct sketch_s
+{
+  int counting;                 /* first pass: count, don't collect */
+  int fmin;                     /* feature count cutoff */
+  size_t mask;                  /* row width-1 */
+  unsigned int *c;              /* SKETCH_DEPTH rows */
+} sketch_t;
+typedef sketch_t *sketch_pt;
+
+/* ------------------------------------------------------------ */
+static sketch_pt sketch_new(unsigned int bits, int fmin)
+{
+  sketch_pt sk=(sketch_pt)mem_malloc(sizeof(sketch_t));
+  size_t n=SKETCH_DEPTH*((size_t)1<<bits);
+
+  sk->counting=1;
+  sk->fmin=fmin;
+  sk->mask=((size_t)1<<bits)-1;
+  sk->c=(unsigned int *)mem_malloc(n*sizeof(unsigned int));
+  memset(sk->c, 0, n*sizeof(unsigned int));
+  return sk;
+}
+
+/* ------------------------------------------------------------ */
+static void sketch_delete(sketch_pt sk)
+{
+  mem_free(sk->c);
+  mem_free(sk);
+}
+
+/* ------------------------------------------------------------ */
+/* column of key k in row r */
+static size_t sketch_column(sketch_pt sk, uint64_t k, int r)
+{
+  k+=(uint64_t)(r+1)*0x9e3779b97f4a7c15ull;
+  k=(k^(k>>30))*0xbf58476d1ce4e5b9ull;
+  k=(k^(k>>27))*0x94d049bb133111ebull;
+  return (size_t)(k^(k>>31))&sk->mask;
+}
+
+/* ------------------------------------------------------------ */
+static void sketch_add(sketch_pt sk, uint64_t k, unsigned int n)
+{
+  int r;
+
+  for (r=0; r<SKETCH_DEPTH; r++)
+    {
+      unsigned int *c=sk->c+(size_t)r*(sk->mask+1)+sketch_column(sk, k, r);
+      *c= *c+n<*c ? UINT_MAX : *c+n;
+    }
+}
+
+/* ------------------------------------------------------------ */
+static unsigned int sketch_get(sketch_pt sk, uint64_t k)
+{
+  unsigned int min=UINT_MAX;
+  int r;
+
+  for (r=0; r<SKETCH_DEPTH; r++)
+    {
+      unsigned int c=sk->c[(size_t)r*(sk->mask+1)+sketch_column(sk, k, r)];
+      if (c<min) { min=c; }
+    }
+  return min;
+}
+
+/* ------------------------------------------------------------ */
+static size_t predinfo_hash(void *p);
+
+/* key of the feature of pi for outcome o; o==no_ocs for the
+   predicate as a whole */
+static uint64_t feature_key(predinfo_pt pi, size_t o)
+{
+  return ((uint64_t)predinfo_hash(pi)<<8)^(uint64_t)o;
+}
+
+/* ------------------------------------------------------------ */
+/* whether the sketch rules out the feature of pi for outcome o */
+static int below_cutoff(predinfo_pt pi, size_t o)
+{
+  sketch_pt sk=g->sketch;
+
+  return sk && pi->type!=pt_word && sketch_get(sk, feature_key(pi, o))<(unsigned int)sk->fmin;
+}
+
 /* ------------------------------------------------------------ */
 static void add_feature(predinfo_pt pi, model_pt m, event_pt ev)
 {
   predicate_pt pd=pi->predicate;  
   feature_pt ft=array_get(pd->features, ev->outcome);
+  size_t n=array_count(ev->predicates);
   
+  /* put pd into ev; in hashing mode several predicates of an event
+     can fall into one bucket, which the event holds and counts once */
+  if (array_add_unique(ev->predicates, pd)<n) { return; }
   /* check whether feature exists already */
+  if (!ft && below_cutoff(pi, ev->outcome)) { return; }
   if (!ft)
     {
       ft=new_feature(0, ev->outcome, pd);
@@ -175,10 +468,6 @@ static void add_feature(predinfo_pt pi, model_pt m, event_pt ev)
     }
   ft->count+=ev->count;
   ft->E=log((double)ft->count);
-
-  /* put pd into ev */
-  (void)array_add_unique(ev->predicates, pd);
-  /* store max_pds & min_pds */
 }
 
 /* ------------------------------------------------------------ */
@@ -201,95 +490,103 @@ static void delete_predinfo(predinfo_pt p)
 }
 
 /* ------------------------------------------------------------ */
-static void register_predinfo(predinfo_pt p, model_pt m, event_pt ev)
+/* identity of a predicate: the type and those parameters that the
+   type uses; the strings are registered, so their addresses will do */
+static size_t predinfo_hash(void *p)
 {
-  static array_pt table[no_ptype_e]={ NULL };
-  array_pt pds=m->predicates;
-  array_pt ta;
-  predinfo_pt pr;
-  size_t i;
+  predinfo_pt pi=(predinfo_pt)p;
+  size_t h=(size_t)pi->type*16777619u;
 
-  if (!table[0])
+  switch (pi->type)
     {
-      for (i=min_ptype_e; i<=max_ptype_e; i++)
-	{
-	  int j;
-	  table[i]=array_new(256);
-	  for (j=0; j<256; j++) { array_add(table[i], array_new(32)); }	      
-	}
+    case pt_word: case pt_prefix: case pt_suffix:
+    case pt_wm1: case pt_wm2: case pt_wp1: case pt_wp2:
+      return (h^((size_t)pi->w>>3))*2654435761u;
+    case pt_tm1: case pt_hashed:
+      return (h^(size_t)(pi->t1+1))*2654435761u;
+    case pt_tm1tm2:
+      return (h^(size_t)((pi->t1+1)*1031+pi->t2+1))*2654435761u;
+    default:
+      return h;
     }
+}
 
-  /* poor man's hash table */
-  /* first indexed on type */
-  ta=table[p->type];
-  /* second index depends on type */
-  switch (p->type)
+/* ------------------------------------------------------------ */
+static int predinfo_equal(void *p, void *q)
+{
+  predinfo_pt a=(predinfo_pt)p, b=(predinfo_pt)q;
+
+  if (a->type!=b->type) { return 0; }
+  switch (a->type)
     {
-    case pt_prefix: case pt_word:
-      ta=array_get(ta, (unsigned char)p->w[0]);
-      break;
-    case pt_suffix:
-      ta=array_get(ta, (unsigned char)p->w[strlen(p->w)-1]);
-      break;
+    case pt_word: case pt_prefix: case pt_suffix:
     case pt_wm1: case pt_wm2: case pt_wp1: case pt_wp2:
-      ta=array_get(ta, (unsigned char)(p->w? p->w[0] : 0));
-      break;
-    case pt_tm1:
-      ta=array_get(ta, (unsigned char)p->t1);
-      break;
+      return a->w==b->w;
+    case pt_tm1: case pt_hashed:
+      return a->t1==b->t1;
     case pt_tm1tm2:
-      ta=array_get(ta, (unsigned char)(((p->t1+3)*(p->t2+7)%255)));
-      break;
-    case pt_number: case pt_uppercase: case pt_hyphen:
-    case pt_default:
-      ta=array_get(ta, 0);
-      break;
+      return a->t1==b->t1 && a->t2==b->t2;
+    default:
+      return 1;
     }
+}
 
-  for (i=0; i<array_count(ta); i++)
-    {
-      size_t l=0;
-      ptype_e pt=p->type;
-      pr=(predinfo_pt)array_get(ta, i);
-      
-      if (pt==pt_prefix)
-	{ l=common_prefix_length(p->w, pr->w); }
-      else if (pt==pt_suffix)
-	{ l=common_suffix_length(p->w, pr->w); }
+/* ------------------------------------------------------------ */
+/* while features are collected, m->userdata holds the predicates
+   hashed on their identity */
+static void register_predinfo(predinfo_pt p, model_pt m, event_pt ev)
+{
+  hash_pt h=(hash_pt)m->userdata;
+  predinfo_pt pr;
+  predinfo_t q;
 
-      switch (pt)
+  /* in hashing mode words, prefixes and suffixes only select a bucket */
+  if (g->hash_bits>0 && p->w && p->type!=pt_number && p->type!=pt_uppercase
+      && p->type!=pt_hyphen && p->type!=pt_tm1 && p->type!=pt_tm1tm2)
+    {
+      memset(&q, 0, sizeof(q));
+      q.type=pt_hashed;
+      q.t1=predicate_hash(p->type, p->w)&(((size_t)1<<g->hash_bits)-1);
+      p=&q;
+    }
+  if (g->sketch && g->sketch->counting)
+    {
+      /* the event is thrown away, so meanwhile it holds the buckets
+	 counted for it, and a bucket counts once as in add_feature() */
+      if (p->type==pt_hashed)
 	{
-	case pt_word: case pt_wm1: case pt_wm2: case pt_wp1: case pt_wp2:
-	  if (p->w==pr->w) { add_feature(pr, m, ev); return; }
-	  break;
-	case pt_tm1:
-	  if (p->t1==pr->t1) { add_feature(pr, m, ev); return; }
-	  break;
-	case pt_tm1tm2:
-	  if (p->t1==pr->t1 && p->t2==pr->t2) { add_feature(pr, m, ev); return; }
-	  break;
-	case pt_number: case pt_uppercase: case pt_hyphen:
-	  add_feature(pr, m, ev); return;
-	  break;
-	case pt_prefix:
-	  if (l==strlen(p->w)) { add_feature(pr, m, ev); return; }
-	  break;
-	case pt_suffix:
-	  if (l==strlen(p->w)) { add_feature(pr, m, ev); return; }
-	  break;
-	case pt_default:
-	  /* nothing, just for the compiler */
-	  break;
+	  size_t n=array_count(ev->predicates);
+	  if (array_add_unique(ev->predicates, (void *)(size_t)(p->t1+1))<n) { return; }
 	}
-    }  
+      /* the predicate's own count bounds all of its features */
+      sketch_add(g->sketch, feature_key(p, ev->outcome), ev->count);
+      sketch_add(g->sketch, feature_key(p, m->no_ocs), ev->count);
+      return;
+    }
+  if (!h)
+    {
+      h=hash_new(4096, 0.7, predinfo_hash, predinfo_equal);
+      m->userdata=h;
+    }
+  pr=(predinfo_pt)hash_get(h, p);
+  if (pr) { add_feature(pr, m, ev); return; }
+  if (below_cutoff(p, m->no_ocs)) { return; }
 
   /* since we're here, p is not yet available:
      new predinfo + predicate */
   pr=new_predinfo(p, m->no_ocs);
   add_feature(pr, m, ev);  
   /* put both in global array and in index */
-  array_add(pds, pr->predicate);
-  array_add(ta, pr);
+  pr->predicate->id=array_add(m->predicates, pr->predicate);
+  hash_put(h, pr, pr);
+}
+
+/* ------------------------------------------------------------ */
+/* done with collecting features */
+static void unregister_predinfos(model_pt m)
+{
+  if (m->userdata) { hash_delete((hash_pt)m->userdata); }
+  m->userdata=NULL;
 }
 
 /* ------------------------------------------------------------ */
@@ -305,19 +602,25 @@ static predindex_pt new_predindex(model_pt m)
   pi->wm1=hash_new(1000, 0.7, hash_string_hash, hash_string_equal);
   pi->wp1=hash_new(1000, 0.7, hash_string_hash, hash_string_equal);
   pi->wp2=hash_new(1000, 0.7, hash_string_hash, hash_string_equal);
-  pi->prefix=hash_new(1000, 0.7, hash_string_hash, hash_string_equal);
-  pi->suffix=hash_new(1000, 0.7, hash_string_hash, hash_string_equal);
+  pi->prefix=affix_trie_new(0);
+  pi->suffix=affix_trie_new(1);
   pi->tm1=array_new_fill(not+1, NULL);
   pi->tm1tm2=array_new_fill(not+1, NULL);
   for (i=0; i<=not; i++)
     { array_set(pi->tm1tm2, i, array_new_fill(not+1, NULL)); }
+  if (g->hash_bits>0)
+    {
+      size_t nb=(size_t)1<<g->hash_bits;
+      pi->hashed=(predicate_pt *)mem_malloc(nb*sizeof(predicate_pt));
+      for (i=0; i<nb; i++) { pi->hashed[i]=NULL; }
+    }
   return pi;
 }
 
 /* ------------------------------------------------------------ */
 static void make_event(globals_pt g, char *w[], int t[], array_pt wcs, hash_pt wh, model_pt m, array_pt evs)
 {
-  predinfo_t p;
+  predinfo_t p={0};
   event_pt ev=new_event(1, t[2]);
   size_t wc= (size_t) array_get(wcs, ((ptrdiff_t)hash_get(wh, w[2]))-1);
 
@@ -373,11 +676,22 @@ static void make_event(globals_pt g, char *w[], int t[], array_pt wcs, hash_pt w
 }
 
 /* ------------------------------------------------------------ */
-static void sample2event(globals_pt g, array_pt wcs, hash_pt wh,
+/* the last five samples, the event is made for the middle one */
+typedef struct window_s
+{
+  char *wds[5];
+  int tgs[5];
+} window_t;
+typedef window_t *window_pt;
+
+#define WINDOW_INIT { { 0, 0, 0, 0, 0 }, { -1, -1, -1, -1, -1 } }
+
+/* ------------------------------------------------------------ */
+static void sample2event(globals_pt g, window_pt win, array_pt wcs, hash_pt wh,
 			 char *w, int tg, model_pt m, array_pt evs)
 {
-  static char *wds[5]={0, 0, 0, 0, 0};
-  static int tgs[5]={-1, -1, -1, -1, -1};
+  char **wds=win->wds;
+  int *tgs=win->tgs;
 
   do
     {
@@ -447,6 +761,9 @@ static void print_predinfo(predinfo_pt p, FILE *f, array_pt tgs)
     case pt_default:
       fprintf(f, "DEFAULT");
       break;
+    case pt_hashed:
+      fprintf(f, "hashed=%d", p->t1);
+      break;
     }
 }
 
@@ -574,7 +891,9 @@ static void write_model_file(FILE *f, model_pt m)
   array_pt tgs=m->outcomes;
   size_t i;
   
-  fprintf(f, "MET %lu %d %+12.11e\n", (unsigned long) array_count(m->outcomes), m->max_pds, m->cf_alpha);
+  fprintf(f, "MET %lu %d %+12.11e", (unsigned long) array_count(m->outcomes), m->max_pds, m->cf_alpha);
+  if (g->hash_bits>0) { fprintf(f, " %u", g->hash_bits); }
+  fprintf(f, "\n");
   for (i=0; i<array_count(pds); i++)
     {
       predicate_pt pd=(predicate_pt)array_get(pds, i);
@@ -642,6 +961,9 @@ static predicate_pt read_predicate(char *s, model_pt m)
     { pi->type=pt_hyphen; }
   else if (!strcmp(s, "DEFAULT"))
     { pi->type=pt_default; }
+  else if (1==sscanf(s, "hashed=%d", &pi->t1) && g->hash_bits>0
+	   && pi->t1>=0 && pi->t1<(1<<g->hash_bits))
+    { pi->type=pt_hashed; }
   else
     { error("can't read predicate \"%s\"\n", s); }
 
@@ -690,93 +1012,536 @@ static void index_predicates(model_pt m)
 	case pt_tm1tm2:
 	  array_set((array_pt)array_get(idx->tm1tm2, pi->t1+1), pi->t2+1, pd);
 	  break;
-	case pt_prefix: hash_put(idx->prefix, pi->w, pd); break;
-	case pt_suffix: hash_put(idx->suffix, pi->w, pd); break;
+	case pt_prefix: affix_trie_add(idx->prefix, pi->w, pd); break;
+	case pt_suffix: affix_trie_add(idx->suffix, pi->w, pd); break;
 	case pt_number: idx->number=pd; break;
 	case pt_uppercase: idx->uppercase=pd; break;
 	case pt_hyphen: idx->hyphen=pd; break;
 	case pt_default: idx->def=pd; break;
+	case pt_hashed: idx->hashed[pi->t1]=pd; break;
 	}
     }
+  affix_trie_build(idx->prefix);
+  affix_trie_build(idx->suffix);
   report(2, "%d predicates indexed\n", array_count(pds));
 }
 
 /* ------------------------------------------------------------ */
-static model_pt read_model_file(FILE *f)
+/* binary model files: the compiled feature tables, the predicates
+   and a hash table of the string keyed predicates, optionally the
+   lexicon, all in a form that can be mapped into memory as is;
+   they are only meant for the platform they were written on */
+#define METB_MAGIC "ACOMETB2"
+#define METB_MAGIC_OLD "ACOMETB1" /* without quantized alphas */
+#define METB_NULL ((uint64_t)-1)
+
+typedef enum {
+  metb_tags,        /* uint64_t[no_ocs], string offsets */
+  metb_pd_begin,    /* size_t[no_pds+1] */
+  metb_oc,          /* int[no_fts] */
+  metb_alpha,       /* double[no_fts], or int8_t/int16_t codes */
+  metb_scale,       /* float[no_pds], scales of the codes */
+  metb_pinfo,       /* metb_pinfo_t[no_pds] */
+  metb_table,       /* int32_t[table_size], predicate ids or -1 */
+  metb_dic,         /* metb_dic_t[no_dic] */
+  metb_dic_tags,    /* int32_t[], tags of the lexicon entries */
+  metb_strings,     /* char[strings_size] */
+  metb_sections
+} metb_section_e;
+
+typedef struct metb_header_s
 {
-  array_pt pds=array_new(64);
-  array_pt tgs=array_new(32);
-  model_pt m=new_model(tgs, pds);
-  predicate_pt pd=NULL;
-  char b[1024];
-  size_t lno=1;
-  unsigned long tmp;
-  
-  if (!fgets(b, 1024, f))
-    { error("can't read from model file\n"); }
-  if (3!=sscanf(b, "MET %lu %d %lf", &tmp, &m->max_pds, &m->cf_alpha))
-    { error("can't read signature from model file\n"); }
-  m->no_ocs = tmp;
-  m->inv_max_pds=1.0/(double)m->max_pds;
-  while (fgets(b, 1024, f))
+  char magic[8];
+  uint32_t order;               /* 0x01020304 */
+  uint32_t sizes;               /* sizes of size_t, int and double */
+  uint64_t no_ocs;
+  uint64_t no_pds;
+  uint64_t no_fts;
+  uint64_t table_size;          /* power of 2 */
+  uint64_t no_dic;              /* 0: no lexicon */
+  uint64_t dic_cs;              /* lexicon read case sensitive */
+  uint64_t strings_size;
+  int64_t max_pds;
+  uint64_t hash_bits;           /* 0: no hashed predicates */
+  uint64_t alpha_bits;          /* 0: no quantized alphas, 8 or 16 */
+  double cf_alpha;
+  uint64_t off[metb_sections];  /* section offsets */
+} metb_header_t;
+
+typedef struct metb_pinfo_s
+{
+  int32_t type;
+  int32_t t1;
+  int32_t t2;
+  int32_t pad;
+  uint64_t w;                   /* string offset or METB_NULL */
+} metb_pinfo_t;
+
+typedef struct metb_dic_s
+{
+  uint64_t w;                   /* string offset */
+  uint64_t first;               /* index into metb_dic_tags */
+  uint64_t n;                   /* number of tags */
+} metb_dic_t;
+
+typedef struct binmodel_s
+{
+  char *data;                   /* the file contents */
+  size_t size;
+  int mapped;                   /* data is mmapped, not allocated */
+  const metb_header_t *h;
+  const metb_pinfo_t *pinfo;
+  const int32_t *table;
+  const char *strings;
+  predicate_t *pdtab;           /* one predicate per id */
+} binmodel_t;
+typedef binmodel_t *binmodel_pt;
+
+#define METB_SIZES ((uint32_t)(sizeof(size_t)<<16 | sizeof(int)<<8 | sizeof(double)))
+
+/* ------------------------------------------------------------ */
+static predicate_pt binary_lookup(binmodel_pt b, ptype_e type, const char *s)
+{
+  size_t mask=b->h->table_size-1;
+  size_t i;
+
+  for (i=predicate_hash(type, s)&mask; b->table[i]>=0; i=(i+1)&mask)
     {
-      lno++;
-      if (b[0]=='\n') { continue; }
-      if (b[0]!=' ')
-	{
-	  pd=read_predicate(b, m);
-	  if (!pd) { error("can't read predicate in line %d\n", lno); }
-	  array_add(pds, pd);
-	}
-      else
-	{
-	  feature_pt ft;
-          // if for some reason the strtok and the sscanf don't fail, `alpha` might
-          // end up used uninitialized; there is no problem in setting its value here,
-          // as the program will exit (with error()) if some of them fail; this just
-          // guarantees the variable is not (eventually) used uninitalized; a negative
-          // alpha should guarantee, in these cases, that the tagging goes exceptionally
-          // wrong, thus making clear to the user that something wrong happened; the same
-          // is true for `c`
-	  double alpha = -1.0;
-          int c = -1;
-	  char *t=strtok(b, " \n");
-	  
-	  if (!t || 1!=sscanf(t, "%lf", &alpha))
-	    { error("can't read alpha in line %d\n", lno); }
-	  t=strtok(NULL, " \n");
-	  if (!t || 1!=sscanf(t, "%d", &c))
-	    { error("can't read count in line %d\n", lno); }
-	  t=strtok(NULL, " \n");
-	  if (!t || !*t)
-	    { error("can't read tag in line %d\n", lno); }
-	  ft=new_feature(c, array_add_unique(tgs, (char*)sregister_get(g->strings,t)), pd);
-	  m->no_fts++;
-	  t=strtok(NULL, " \n");
-	  if (t)
-	    { error("additional material in line %d\n", lno); }
-	  ft->alpha=alpha;
-	  /* insert ft in pd */
-	  array_set(pd->features, ft->outcome, ft);
-	}
+      const metb_pinfo_t *pi=b->pinfo+b->table[i];
+      if (pi->type==(int32_t)type && !strcmp(b->strings+pi->w, s))
+	{ return b->pdtab+b->table[i]; }
     }
-  if (array_count(tgs)!=m->no_ocs)
-    { error("no of outcomes: declared %d != found %d\n", m->no_ocs, array_count(tgs)); }
-  report(1, "read %d tags, %d predicates and %d features\n",
-	 m->no_ocs, array_count(pds), m->no_fts);
+  return NULL;
+}
 
-  index_predicates(m);
+/* ------------------------------------------------------------ */
+/* string pool for writing binary models */
+typedef struct metb_pool_s
+{
+  char *s;
+  size_t n;
+  size_t size;
+} metb_pool_t;
 
-#define DEBUG_READ_MODEL_FILE 0
-#if DEBUG_READ_MODEL_FILE
-  {
-    FILE *f=fopen("M-TT", "w");
-    size_t i;
-    for (i=0; i<array_count(pds); i++)
-      {
-	size_t j;
-	pd=array_get(pds, i);
-	print_predinfo(pd->data, f, tgs);
+static uint64_t metb_pool_add(metb_pool_t *p, const char *s)
+{
+  size_t l;
+  uint64_t o=p->n;
+
+  if (!s) { return METB_NULL; }
+  l=strlen(s)+1;
+  while (p->n+l>p->size)
+    {
+      p->size=p->size ? 2*p->size : 4096;
+      p->s=(char *)mem_realloc(p->s, p->size);
+    }
+  memcpy(p->s+p->n, s, l);
+  p->n+=l;
+  return o;
+}
+
+/* ------------------------------------------------------------ */
+static size_t metb_write(FILE *f, size_t pos, const void *p, size_t n)
+{
+  static const char zeros[8]={0, 0, 0, 0, 0, 0, 0, 0};
+
+  if (n>0 && fwrite(p, 1, n, f)!=n) { error("can't write binary model\n"); }
+  pos+=n;
+  /* keep the sections aligned */
+  if (pos%8!=0)
+    {
+      size_t pad=8-pos%8;
+      if (fwrite(zeros, 1, pad, f)!=pad) { error("can't write binary model\n"); }
+      pos+=pad;
+    }
+  return pos;
+}
+
+/* ------------------------------------------------------------ */
+/* with bits of 8 or 16 the alphas, multiples of scale[p] for
+   predicate p, are stored as codes of that many bits */
+static size_t write_binary_model(FILE *f, model_pt m, hash_pt d, int cs, int bits, const float *scale)
+{
+  compiled_model_pt cm=m->compiled;
+  metb_header_t h;
+  metb_pool_t pool={ NULL, 0, 0 };
+  size_t no_pds=cm->no_pds;
+  uint64_t *tags=(uint64_t *)mem_malloc((m->no_ocs+1)*sizeof(uint64_t));
+  metb_pinfo_t *pinfo=(metb_pinfo_t *)mem_malloc((no_pds+1)*sizeof(metb_pinfo_t));
+  int32_t *table;
+  metb_dic_t *dic=NULL;
+  int32_t *dic_tags=NULL;
+  size_t no_dic=0, no_dic_tags=0, pos, i;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, METB_MAGIC, 8);
+  h.order=0x01020304;
+  h.sizes=METB_SIZES;
+  h.no_ocs=m->no_ocs;
+  h.no_pds=no_pds;
+  h.no_fts=cm->no_fts;
+  h.max_pds=m->max_pds;
+  h.hash_bits=g->hash_bits;
+  h.alpha_bits=bits;
+  h.cf_alpha=m->cf_alpha;
+  h.dic_cs=cs;
+
+  for (i=0; i<m->no_ocs; i++)
+    { tags[i]=metb_pool_add(&pool, array_get(m->outcomes, i)); }
+  for (i=0; i<no_pds; i++)
+    {
+      predinfo_pt pi=((predicate_pt)array_get(m->predicates, i))->data;
+      pinfo[i].type=pi->type;
+      pinfo[i].t1=pi->t1;
+      pinfo[i].t2=pi->t2;
+      pinfo[i].pad=0;
+      pinfo[i].w=metb_pool_add(&pool, pi->w);
+    }
+  for (h.table_size=16; h.table_size<2*no_pds; h.table_size*=2) { /* nothing */ }
+  table=(int32_t *)mem_malloc(h.table_size*sizeof(int32_t));
+  for (i=0; i<h.table_size; i++) { table[i]=-1; }
+  for (i=0; i<no_pds; i++)
+    {
+      size_t j;
+      if (pinfo[i].w==METB_NULL) { continue; }
+      for (j=predicate_hash(pinfo[i].type, pool.s+pinfo[i].w)&(h.table_size-1);
+	   table[j]>=0; j=(j+1)&(h.table_size-1)) { /* nothing */ }
+      table[j]=i;
+    }
+  if (d)
+    {
+      hash_iterator_pt hi=hash_iterator_new(d);
+      char *w;
+
+      dic=(metb_dic_t *)mem_malloc((hash_size(d)+1)*sizeof(metb_dic_t));
+      for (w=hash_iterator_next_key(hi); w; w=hash_iterator_next_key(hi))
+	{ no_dic_tags+=array_count((array_pt)hash_get(d, w)); }
+      hash_iterator_delete(hi);
+      dic_tags=(int32_t *)mem_malloc((no_dic_tags+1)*sizeof(int32_t));
+      no_dic_tags=0;
+      hi=hash_iterator_new(d);
+      for (w=hash_iterator_next_key(hi); w; w=hash_iterator_next_key(hi), no_dic++)
+	{
+	  array_pt a=(array_pt)hash_get(d, w);
+	  size_t j;
+
+	  dic[no_dic].w=metb_pool_add(&pool, w);
+	  dic[no_dic].first=no_dic_tags;
+	  dic[no_dic].n=array_count(a);
+	  for (j=0; j<array_count(a); j++)
+	    { dic_tags[no_dic_tags++]=(ptrdiff_t)array_get(a, j); }
+	}
+      hash_iterator_delete(hi);
+    }
+  h.no_dic=no_dic;
+  h.strings_size=pool.n;
+
+  /* sections follow the header in metb_section_e order */
+  pos=metb_write(f, 0, &h, sizeof(h));
+  h.off[metb_tags]=pos;
+  pos=metb_write(f, pos, tags, m->no_ocs*sizeof(uint64_t));
+  h.off[metb_pd_begin]=pos;
+  pos=metb_write(f, pos, cm->pd_begin, (no_pds+1)*sizeof(size_t));
+  h.off[metb_oc]=pos;
+  pos=metb_write(f, pos, cm->oc, cm->no_fts*sizeof(int));
+  h.off[metb_alpha]=pos;
+  if (bits)
+    {
+      size_t size=bits/8;
+      char *codes=(char *)mem_malloc(cm->no_fts*size+1);
+
+      for (i=0; i<no_pds; i++)
+	{
+	  size_t k;
+	  for (k=cm->pd_begin[i]; k<cm->pd_begin[i+1]; k++)
+	    {
+	      long c= scale[i]>0.0 ? lrint(cm->alpha[k]/scale[i]) : 0;
+	      if (bits==8) { ((int8_t *)codes)[k]=c; } else { ((int16_t *)codes)[k]=c; }
+	    }
+	}
+      pos=metb_write(f, pos, codes, cm->no_fts*size);
+      mem_free(codes);
+      h.off[metb_scale]=pos;
+      pos=metb_write(f, pos, scale, no_pds*sizeof(float));
+    }
+  else
+    {
+      pos=metb_write(f, pos, cm->alpha, cm->no_fts*sizeof(double));
+      h.off[metb_scale]=pos;
+    }
+  h.off[metb_pinfo]=pos;
+  pos=metb_write(f, pos, pinfo, no_pds*sizeof(metb_pinfo_t));
+  h.off[metb_table]=pos;
+  pos=metb_write(f, pos, table, h.table_size*sizeof(int32_t));
+  h.off[metb_dic]=pos;
+  pos=metb_write(f, pos, dic, no_dic*sizeof(metb_dic_t));
+  h.off[metb_dic_tags]=pos;
+  pos=metb_write(f, pos, dic_tags, no_dic_tags*sizeof(int32_t));
+  h.off[metb_strings]=pos;
+  pos=metb_write(f, pos, pool.s, pool.n);
+  /* now that the offsets are known */
+  rewind(f);
+  metb_write(f, 0, &h, sizeof(h));
+  report(1, "wrote binary model: %lu predicates, %lu features, %lu lexicon entries, %lu bytes\n",
+	 (unsigned long)no_pds, (unsigned long)cm->no_fts, (unsigned long)no_dic, (unsigned long)pos);
+
+  mem_free(tags);
+  mem_free(pinfo);
+  mem_free(table);
+  if (dic) { mem_free(dic); mem_free(dic_tags); }
+  if (pool.s) { mem_free(pool.s); }
+  return pos;
+}
+
+/* ------------------------------------------------------------ */
+static model_pt read_binary_model(FILE *f)
+{
+  binmodel_pt b=(binmodel_pt)mem_malloc(sizeof(binmodel_t));
+  const metb_header_t *h;
+  compiled_model_pt cm=(compiled_model_pt)mem_malloc(sizeof(compiled_model_t));
+  array_pt tgs=array_new(32);
+  model_pt m=new_model(tgs, array_new(1));
+  predindex_pt idx;
+  struct stat st;
+  size_t i;
+
+  if (fstat(fileno(f), &st)<0 || (size_t)st.st_size<sizeof(metb_header_t))
+    { error("can't read binary model\n"); }
+  b->size=st.st_size;
+#ifdef HAVE_SYS_MMAN_H
+  b->data=mmap(NULL, b->size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  b->mapped= b->data!=MAP_FAILED;
+  if (!b->mapped)
+#endif
+    {
+      b->data=(char *)mem_malloc(b->size);
+      b->mapped=0;
+      rewind(f);
+      if (fread(b->data, 1, b->size, f)!=b->size)
+	{ error("can't read binary model\n"); }
+    }
+  h=b->h=(const metb_header_t *)b->data;
+  if (h->order!=0x01020304 || h->sizes!=METB_SIZES)
+    { error("binary model was written on an incompatible platform\n"); }
+  if (h->off[metb_strings]+h->strings_size>b->size)
+    { error("binary model is truncated\n"); }
+  b->pinfo=(const metb_pinfo_t *)(b->data+h->off[metb_pinfo]);
+  b->table=(const int32_t *)(b->data+h->off[metb_table]);
+  b->strings=b->data+h->off[metb_strings];
+
+  m->no_ocs=h->no_ocs;
+  m->max_pds=h->max_pds;
+  g->hash_bits=h->hash_bits;
+  m->inv_max_pds=1.0/(double)m->max_pds;
+  m->cf_alpha=h->cf_alpha;
+  m->no_fts=h->no_fts;
+  for (i=0; i<h->no_ocs; i++)
+    {
+      uint64_t o=((const uint64_t *)(b->data+h->off[metb_tags]))[i];
+      array_add(tgs, (void *)(b->strings+o));
+    }
+
+  /* the feature tables are used in place */
+  memset(cm, 0, sizeof(compiled_model_t));
+  cm->no_ocs=h->no_ocs;
+  cm->no_pds=h->no_pds;
+  cm->no_fts=h->no_fts;
+  cm->pd_begin=(size_t *)(b->data+h->off[metb_pd_begin]);
+  cm->oc=(int *)(b->data+h->off[metb_oc]);
+  if (h->alpha_bits)
+    {
+      const float *scale=(const float *)(b->data+h->off[metb_scale]);
+
+      cm->alpha=(double *)mem_malloc((h->no_fts+1)*sizeof(double));
+      for (i=0; i<h->no_pds; i++)
+	{
+	  size_t k;
+	  for (k=cm->pd_begin[i]; k<cm->pd_begin[i+1]; k++)
+	    {
+	      cm->alpha[k]=scale[i]*(h->alpha_bits==8
+				     ? ((const int8_t *)(b->data+h->off[metb_alpha]))[k]
+				     : ((const int16_t *)(b->data+h->off[metb_alpha]))[k]);
+	    }
+	}
+    }
+  else { cm->alpha=(double *)(b->data+h->off[metb_alpha]); }
+  cm->max_pds=h->max_pds;
+  cm->inv_max_pds=m->inv_max_pds;
+  cm->cf_alpha=h->cf_alpha;
+  m->compiled=cm;
+
+  /* predicates without string parameter go into the usual index */
+  b->pdtab=(predicate_t *)mem_malloc((h->no_pds+1)*sizeof(predicate_t));
+  idx=new_predindex(m);
+  idx->bin=b;
+  m->userdata=idx;
+  for (i=0; i<h->no_pds; i++)
+    {
+      const metb_pinfo_t *pi=b->pinfo+i;
+      predicate_pt pd=b->pdtab+i;
+
+      pd->count=0;
+      pd->features=NULL;
+      pd->data=NULL;
+      pd->id=i;
+      switch (pi->type)
+	{
+	case pt_wm1: if (pi->w==METB_NULL) { idx->wm1_null=pd; } break;
+	case pt_wm2: if (pi->w==METB_NULL) { idx->wm2_null=pd; } break;
+	case pt_wp1: if (pi->w==METB_NULL) { idx->wp1_null=pd; } break;
+	case pt_wp2: if (pi->w==METB_NULL) { idx->wp2_null=pd; } break;
+	case pt_tm1: array_set(idx->tm1, pi->t1+1, pd); break;
+	case pt_tm1tm2:
+	  array_set((array_pt)array_get(idx->tm1tm2, pi->t1+1), pi->t2+1, pd);
+	  break;
+	case pt_number: idx->number=pd; break;
+	case pt_uppercase: idx->uppercase=pd; break;
+	case pt_hyphen: idx->hyphen=pd; break;
+	case pt_default: idx->def=pd; break;
+	case pt_hashed: idx->hashed[pi->t1]=pd; break;
+	case pt_prefix: affix_trie_add(idx->prefix, b->strings+pi->w, pd); break;
+	case pt_suffix: affix_trie_add(idx->suffix, b->strings+pi->w, pd); break;
+	default: break;
+	}
+    }
+  affix_trie_build(idx->prefix);
+  affix_trie_build(idx->suffix);
+  report(1, "read binary model: %d tags, %lu predicates and %lu features%s\n",
+	 m->no_ocs, (unsigned long)h->no_pds, (unsigned long)h->no_fts,
+	 b->mapped ? " (mapped)" : "");
+  fclose(f);
+  return m;
+}
+
+/* ------------------------------------------------------------ */
+/* the lexicon stored in a binary model, or NULL */
+static hash_pt binary_dictionary(model_pt m, size_t cs)
+{
+  predindex_pt idx=(predindex_pt)m->userdata;
+  binmodel_pt b=idx->bin;
+  const metb_dic_t *dic;
+  const int32_t *dic_tags;
+  hash_pt d;
+  size_t i;
+
+  if (!b || b->h->no_dic==0) { return NULL; }
+  if ((b->h->dic_cs!=0)!=(cs!=0))
+    { error("lexicon in binary model is %scase sensitive\n", b->h->dic_cs ? "" : "not "); }
+  dic=(const metb_dic_t *)(b->data+b->h->off[metb_dic]);
+  dic_tags=(const int32_t *)(b->data+b->h->off[metb_dic_tags]);
+  d=hash_new(2*b->h->no_dic, .5, hash_string_hash, hash_string_equal);
+  for (i=0; i<b->h->no_dic; i++)
+    {
+      array_pt tgs=array_new(dic[i].n>0 ? dic[i].n : 1);
+      size_t j;
+
+      for (j=0; j<dic[i].n; j++)
+	{ array_add(tgs, (void *)(ptrdiff_t)dic_tags[dic[i].first+j]); }
+      hash_put(d, (void *)(b->strings+dic[i].w), tgs);
+    }
+  report(1, "read %d lexicon entries from binary model\n", hash_size(d));
+  return d;
+}
+
+/* ------------------------------------------------------------ */
+static predicate_pt index_lookup(predindex_pt idx, ptype_e type, hash_pt h, char *s)
+{
+  if (idx->hashed)
+    { return idx->hashed[predicate_hash(type, s)&(((size_t)1<<g->hash_bits)-1)]; }
+  if (idx->bin) { return binary_lookup(idx->bin, type, s); }
+  return (predicate_pt)hash_get(h, s);
+}
+
+/* ------------------------------------------------------------ */
+/* with keep, the features stay with the predicates besides being
+   compiled */
+static model_pt read_model_file(FILE *f, int keep)
+{
+  array_pt pds=array_new(64);
+  array_pt tgs=array_new(32);
+  model_pt m=new_model(tgs, pds);
+  predicate_pt pd=NULL;
+  char b[1024];
+  size_t lno=1;
+  unsigned long tmp;
+  
+  if (!fgets(b, 1024, f))
+    { error("can't read from model file\n"); }
+  if (!strncmp(b, METB_MAGIC_OLD, 8))
+    { error("binary model of an older format, export it again\n"); }
+  if (!strncmp(b, METB_MAGIC, 8))
+    {
+      array_free(pds);
+      array_free(tgs);
+      mem_free(m);
+      return read_binary_model(f);
+    }
+  g->hash_bits=0;
+  if (3>sscanf(b, "MET %lu %d %lf %u", &tmp, &m->max_pds, &m->cf_alpha, &g->hash_bits))
+    { error("can't read signature from model file\n"); }
+  if (g->hash_bits>=8*sizeof(int)-1)
+    { error("invalid number of hash bits %u in model file\n", g->hash_bits); }
+  m->no_ocs = tmp;
+  m->inv_max_pds=1.0/(double)m->max_pds;
+  while (fgets(b, 1024, f))
+    {
+      lno++;
+      if (b[0]=='\n') { continue; }
+      if (b[0]!=' ')
+	{
+	  pd=read_predicate(b, m);
+	  if (!pd) { error("can't read predicate in line %d\n", lno); }
+	  array_add(pds, pd);
+	}
+      else
+	{
+	  feature_pt ft;
+          // if for some reason the strtok and the sscanf don't fail, `alpha` might
+          // end up used uninitialized; there is no problem in setting its value here,
+          // as the program will exit (with error()) if some of them fail; this just
+          // guarantees the variable is not (eventually) used uninitalized; a negative
+          // alpha should guarantee, in these cases, that the tagging goes exceptionally
+          // wrong, thus making clear to the user that something wrong happened; the same
+          // is true for `c`
+	  double alpha = -1.0;
+          int c = -1;
+	  char *t=strtok(b, " \n");
+	  
+	  if (!t || 1!=sscanf(t, "%lf", &alpha))
+	    { error("can't read alpha in line %d\n", lno); }
+	  t=strtok(NULL, " \n");
+	  if (!t || 1!=sscanf(t, "%d", &c))
+	    { error("can't read count in line %d\n", lno); }
+	  t=strtok(NULL, " \n");
+	  if (!t || !*t)
+	    { error("can't read tag in line %d\n", lno); }
+	  ft=new_feature(c, array_add_unique(tgs, (char*)sregister_get(g->strings,t)), pd);
+	  m->no_fts++;
+	  t=strtok(NULL, " \n");
+	  if (t)
+	    { error("additional material in line %d\n", lno); }
+	  ft->alpha=alpha;
+	  /* insert ft in pd */
+	  array_set(pd->features, ft->outcome, ft);
+	}
+    }
+  if (array_count(tgs)!=m->no_ocs)
+    { error("no of outcomes: declared %d != found %d\n", m->no_ocs, array_count(tgs)); }
+  report(1, "read %d tags, %d predicates and %d features\n",
+	 m->no_ocs, array_count(pds), m->no_fts);
+
+  index_predicates(m);
+
+#define DEBUG_READ_MODEL_FILE 0
+#if DEBUG_READ_MODEL_FILE
+  {
+    FILE *f=fopen("M-TT", "w");
+    size_t i;
+    for (i=0; i<array_count(pds); i++)
+      {
+	size_t j;
+	pd=array_get(pds, i);
+	print_predinfo(pd->data, f, tgs);
 	fprintf(f, "\n");
 	for (j=0; 0 && j<array_count(pd->features); j++)
 	  {
@@ -789,6 +1554,10 @@ static model_pt read_model_file(FILE *f)
   }
 #endif
 
+  /* tag with the compact form, the features are not needed anymore */
+  m->compiled=compile_model(m, NULL);
+  if (!keep) { compiled_model_drop_features(m->compiled, m); }
+
   fclose(f);
   return m;
 }
@@ -931,7 +1700,322 @@ static void count_words(void *p, void *data)
 }
 
 /* ------------------------------------------------------------ */
-static void training(FILE *mf, FILE *df, FILE *rf, size_t mi, double dt, size_t fmin)
+/* the predicate of the old model om that is the same as pi of the
+   new model; tmap maps tags of the new model to those of om, and
+   only applies to the tags of tag predicates */
+static predicate_pt old_predicate(model_pt om, predinfo_pt pi, const int tmap[])
+{
+  predindex_pt idx=(predindex_pt)om->userdata;
+  int t1, t2;
+
+  switch (pi->type)
+    {
+    case pt_word: return index_lookup(idx, pt_word, idx->word, pi->w);
+    case pt_prefix:
+      return idx->hashed ? index_lookup(idx, pt_prefix, NULL, pi->w) : affix_trie_get(idx->prefix, pi->w);
+    case pt_suffix:
+      return idx->hashed ? index_lookup(idx, pt_suffix, NULL, pi->w) : affix_trie_get(idx->suffix, pi->w);
+    case pt_wm1: return pi->w ? index_lookup(idx, pt_wm1, idx->wm1, pi->w) : idx->wm1_null;
+    case pt_wm2: return pi->w ? index_lookup(idx, pt_wm2, idx->wm2, pi->w) : idx->wm2_null;
+    case pt_wp1: return pi->w ? index_lookup(idx, pt_wp1, idx->wp1, pi->w) : idx->wp1_null;
+    case pt_wp2: return pi->w ? index_lookup(idx, pt_wp2, idx->wp2, pi->w) : idx->wp2_null;
+    case pt_tm1:
+      t1= pi->t1<0 ? -1 : tmap[pi->t1];
+      if (pi->t1>=0 && t1<0) { return NULL; }
+      return array_get(idx->tm1, t1+1);
+    case pt_tm1tm2:
+      t1= pi->t1<0 ? -1 : tmap[pi->t1];
+      t2= pi->t2<0 ? -1 : tmap[pi->t2];
+      if ((pi->t1>=0 && t1<0) || (pi->t2>=0 && t2<0)) { return NULL; }
+      return array_get((array_pt)array_get(idx->tm1tm2, t1+1), t2+1);
+    case pt_number: return idx->number;
+    case pt_uppercase: return idx->uppercase;
+    case pt_hyphen: return idx->hyphen;
+    case pt_default: return idx->def;
+    case pt_hashed: return idx->hashed ? idx->hashed[pi->t1] : NULL;
+    }
+  return NULL;
+}
+
+/* ------------------------------------------------------------ */
+/* seed the weights of the compiled model cm of md with those of the
+   same features in the old model om; the others stay at zero */
+static void warm_start(compiled_model_pt cm, model_pt md, model_pt om)
+{
+  compiled_model_pt ocm=om->compiled;
+  int *tmap=(int *)mem_malloc((md->no_ocs+1)*sizeof(int));
+  size_t seeded=0, i;
+
+  for (i=0; i<md->no_ocs; i++)
+    { tmap[i]=find_tag((char *)array_get(md->outcomes, i), om->outcomes); }
+  for (i=0; i<cm->no_fts; i++)
+    {
+      feature_pt ft=cm->fts[i];
+      predicate_pt opd=old_predicate(om, ft->predicate->data, tmap);
+      size_t r;
+
+      if (!opd || tmap[ft->outcome]<0) { continue; }
+      for (r=ocm->pd_begin[opd->id]; r<ocm->pd_begin[opd->id+1]; r++)
+	{
+	  if (ocm->oc[r]!=tmap[ft->outcome]) { continue; }
+	  cm->alpha[i]=ocm->alpha[r];
+	  seeded++;
+	  break;
+	}
+    }
+  cm->cf_alpha=om->cf_alpha;
+  mem_free(tmap);
+  report(1, "%lu of %lu features seeded from the old model\n",
+	 (unsigned long)seeded, (unsigned long)cm->no_fts);
+}
+
+/* ------------------------------------------------------------ */
+/* samples per thread in a round of parallel feature extraction */
+#define EXTRACT_ROUND_SAMPLES 262144
+
+/* ------------------------------------------------------------ */
+/* make_event() registers the affixes of rare words; done beforehand
+   the string register is only read during parallel extraction */
+static void register_affixes(array_pt wds, array_pt wcs)
+{
+  char *tmp=NULL;
+  size_t tmp_n=0;
+  size_t i;
+
+  for (i=0; i<array_count(wds); i++)
+    {
+      char *w=(char *)array_get(wds, i);
+      size_t cl=strlen(w);
+      size_t j;
+
+      if ((size_t)array_get(wcs, i)>=g->rwt) { continue; }
+      for (j=1; j<5 && j<cl; j++)
+	{
+	  (void)sregister_get(g->strings, substr(w, 0, j, &tmp, &tmp_n));
+	  (void)sregister_get(g->strings, substr(w, cl-1, -j, &tmp, &tmp_n));
+	}
+    }
+  if (tmp) { free(tmp); }
+}
+
+/* ------------------------------------------------------------ */
+/* data shared by the threads of extract_events() */
+typedef struct extract_job_s
+{
+  array_pt sms;                 /* samples */
+  size_t *begin;                /* nt+1 shard boundaries */
+  array_pt wcs;                 /* word counts */
+  hash_pt wh;                   /* word -> index+1 */
+  model_pt *shard;              /* per thread: predicates and features */
+  array_pt *evs;                /* per thread: events */
+} extract_job_t;
+typedef extract_job_t *extract_job_pt;
+
+/* ------------------------------------------------------------ */
+static void extract_worker(size_t id, size_t n, void *data)
+{
+  extract_job_pt job=(extract_job_pt)data;
+  window_t win=WINDOW_INIT;
+  size_t i;
+
+  (void)n;
+  for (i=job->begin[id]; i<job->begin[id+1]; i++)
+    {
+      sample_pt s=(sample_pt)array_get(job->sms, i);
+      sample2event(g, &win, job->wcs, job->wh, s->word, s->tag,
+		   job->shard[id], job->evs[id]);
+    }
+}
+
+/* ------------------------------------------------------------ */
+/* index after the end of the sentence that sample i is in */
+static size_t sentence_end(array_pt sms, size_t i, size_t last)
+{
+  for (; i<last; i++)
+    { if (!((sample_pt)array_get(sms, i))->word) { return i+1; } }
+  return last;
+}
+
+/* ------------------------------------------------------------ */
+/* add the predicates and feature counts of shard sm to md, in the
+   order the shard found them, and the events in sevs, rewritten to
+   the predicates of md, to evs; empties the shard */
+static void merge_shard(model_pt md, model_pt sm, array_pt sevs, array_pt evs)
+{
+  hash_pt h=(hash_pt)md->userdata;
+  size_t i;
+
+  if (!h)
+    {
+      h=hash_new(4096, 0.7, predinfo_hash, predinfo_equal);
+      md->userdata=h;
+    }
+  for (i=0; i<array_count(sm->predicates); i++)
+    {
+      predicate_pt spd=(predicate_pt)array_get(sm->predicates, i);
+      predinfo_pt pi=(predinfo_pt)hash_get(h, spd->data);
+      size_t j;
+
+      if (!pi)
+	{
+	  pi=new_predinfo(spd->data, md->no_ocs);
+	  pi->predicate->id=array_add(md->predicates, pi->predicate);
+	  hash_put(h, pi, pi);
+	}
+      for (j=0; j<md->no_ocs; j++)
+	{
+	  feature_pt sft=(feature_pt)array_get(spd->features, j);
+	  feature_pt ft;
+
+	  if (!sft) { continue; }
+	  ft=(feature_pt)array_get(pi->predicate->features, j);
+	  if (!ft)
+	    {
+	      ft=new_feature(0, j, pi->predicate);
+	      array_set(pi->predicate->features, j, ft);
+	      md->no_fts++;
+	    }
+	  ft->count+=sft->count;
+	  ft->E=log((double)ft->count);
+	  delete_feature(sft);
+	}
+      spd->id=pi->predicate->id;
+    }
+  for (i=0; i<array_count(sevs); i++)
+    {
+      event_pt ev=(event_pt)array_get(sevs, i);
+      size_t j;
+
+      for (j=0; j<array_count(ev->predicates); j++)
+	{
+	  predicate_pt spd=(predicate_pt)array_get(ev->predicates, j);
+	  array_set(ev->predicates, j, array_get(md->predicates, spd->id));
+	}
+      array_add(evs, ev);
+    }
+  array_clear(sevs);
+  for (i=0; i<array_count(sm->predicates); i++)
+    { delete_predinfo(((predicate_pt)array_get(sm->predicates, i))->data); }
+  array_clear(sm->predicates);
+  unregister_predinfos(sm);
+  sm->no_fts=0;
+}
+
+/* ------------------------------------------------------------ */
+/* events of the samples [first, last), which end with a sentence,
+   extracted by nt threads on contiguous shards of whole sentences;
+   the shards are merged in order, so predicates and events come out
+   as if extracted one after the other */
+static void extract_events(model_pt md, array_pt sms, size_t first, size_t last,
+			   array_pt wcs, hash_pt wh, size_t nt,
+			   model_pt shard[], array_pt sevs[], array_pt evs)
+{
+  size_t begin[nt+1];
+  extract_job_t job={ sms, begin, wcs, wh, shard, sevs };
+  size_t i;
+
+  begin[0]=first;
+  for (i=1; i<nt; i++)
+    {
+      size_t b=first+parallel_shard_begin(last-first, i, nt);
+      begin[i]= b<=begin[i-1] ? begin[i-1] : sentence_end(sms, b-1, last);
+    }
+  begin[nt]=last;
+  parallel_run(nt, extract_worker, &job);
+  for (i=0; i<nt; i++) { merge_shard(md, shard[i], sevs[i], evs); }
+}
+
+/* ------------------------------------------------------------ */
+/* events during feature collection go to f as outcome, count,
+   number of predicates and predicate ids */
+static void write_raw_events(FILE *f, array_pt evs, size_t *np)
+{
+  size_t i;
+
+  for (i=0; i<array_count(evs); i++)
+    {
+      event_pt ev=(event_pt)array_get(evs, i);
+      int h[3]={ ev->outcome, ev->count, array_count(ev->predicates) };
+      size_t j;
+
+      if (fwrite(h, sizeof(int), 3, f)!=3) { error("can't write events\n"); }
+      for (j=0; j<array_count(ev->predicates); j++)
+	{
+	  predicate_pt pd=(predicate_pt)array_get(ev->predicates, j);
+	  if (fwrite(&pd->id, sizeof(int), 1, f)!=1) { error("can't write events\n"); }
+	}
+      *np+=array_count(ev->predicates);
+      delete_event(ev);
+    }
+  array_clear(evs);
+}
+
+/* ------------------------------------------------------------ */
+/* the raw events in f after feature selection, with the default
+   predicate added as in add_default_features(); no_pds is the
+   number of predicates before feature selection */
+static compiled_model_pt map_raw_events(model_pt md, FILE *f, size_t no_evs, size_t np, size_t no_pds)
+{
+  array_pt pds=md->predicates;
+  int *map=(int *)mem_malloc((no_pds+1)*sizeof(int));
+  event_file_pt efl=event_file_new(f, no_evs, np+no_evs);
+  event_pt ev=new_event(0, 0);
+  compiled_model_pt cm;
+  predinfo_pt p;
+  int minp=array_count(pds), maxp=0;
+  double no_etoken=0.0, no_ptoken=0.0;
+  size_t i;
+
+  for (i=0; i<no_pds; i++) { map[i]=-1; }
+  for (i=0; i<array_count(pds); i++)
+    {
+      predicate_pt pd=(predicate_pt)array_get(pds, i);
+      map[pd->id]=i;
+      pd->id=i;
+    }
+  p=new_predinfo(NULL, md->no_ocs);
+  p->type=pt_default;
+  p->predicate->id=array_add(pds, p->predicate);
+
+  rewind(f);
+  for (i=0; i<no_evs; i++)
+    {
+      int h[3];
+      int j;
+
+      if (fread(h, sizeof(int), 3, f)!=3) { error("can't read events\n"); }
+      ev->outcome=h[0];
+      ev->count=h[1];
+      array_clear(ev->predicates);
+      for (j=0; j<h[2]; j++)
+	{
+	  int id;
+	  if (fread(&id, sizeof(int), 1, f)!=1) { error("can't read events\n"); }
+	  if (map[id]>=0) { array_add(ev->predicates, array_get(pds, map[id])); }
+	}
+      add_feature(p, md, ev);
+      j=array_count(ev->predicates);
+      if (minp>j) { minp=j; }
+      if (maxp<j) { maxp=j; }
+      no_etoken+=ev->count;
+      no_ptoken+=(double)j*ev->count;
+      event_file_add(efl, ev);
+    }
+  delete_event(ev);
+  mem_free(map);
+  md->min_pds=minp;
+  md->max_pds=maxp;
+  md->cf_E=log(maxp*no_etoken-no_ptoken);
+  md->inv_max_pds=1.0/(double)md->max_pds;
+  report(2, "Ep~cf %f (%d-%d)\n", md->cf_E, md->min_pds, md->max_pds);
+
+  cm=compile_model(md, NULL);
+  compiled_model_use_events(cm, efl);
+  return cm;
+}
+
+/* ------------------------------------------------------------ */
+static void training(FILE *mf, FILE *df, FILE *rf, FILE *ef, model_pt om, size_t mi, double dt, size_t fmin, size_t nt, int lbfgs, double sigma2)
 {
   array_pt tgs=array_new(25);
   array_pt wds=array_new(1000);
@@ -942,10 +2026,15 @@ static void training(FILE *mf, FILE *df, FILE *rf, size_t mi, double dt, size_t
   array_pt pds=array_new(1000);
   array_pt sms=array_new(5000);
   model_pt md=new_model(tgs, pds);
-  size_t no_sts=read_samples(rf, sms, wds, wtgs, wcs, wh, tgs);
+  size_t no_sts;
+  compiled_model_pt cm;
   double a=0.0;
   int wc[4]={0, 0, 0, 0};
-  size_t i, no_sms=array_count(sms);
+  size_t i, no_sms;
+  size_t no_evs=0, np=0;
+
+  no_sts=read_samples(rf, sms, wds, wtgs, wcs, wh, tgs);
+  no_sms=array_count(sms);
   
   md->no_ocs=array_count(tgs);
   array_map_with(wcs, count_words, wc);
@@ -954,33 +2043,129 @@ static void training(FILE *mf, FILE *df, FILE *rf, size_t mi, double dt, size_t
 #if 0
   write_dictionary_file(df, wds, wcs, wtgs, tgs);
 #endif
+  if (g->sketch)
+    {
+      /* first pass: events are made and thrown away, only the
+	 feature counts go to the sketch */
+      array_pt cevs=array_new(8);
+      window_t win=WINDOW_INIT;
+
+      for (i=0; i<no_sms; i++)
+	{
+	  sample_pt s=array_get(sms, i);
+	  sample2event(g, &win, wcs, wh, s->word, s->tag, md, cevs);
+	  array_map(cevs, (void (*)(void *))delete_event);
+	  array_clear(cevs);
+	}
+      array_free(cevs);
+      g->sketch->counting=0;
+      report(1, "features counted in a sketch of %lu KB\n",
+	     (unsigned long)(SKETCH_DEPTH*(g->sketch->mask+1)*sizeof(unsigned int)/1024));
+    }
+  if (nt>1) { register_affixes(wds, wcs); }
   array_map(wtgs, (void (*)(void *))array_free);
   array_free(wtgs); array_free(wds); wtgs=wds=NULL;
-  for (i=0; i<no_sms; i++)
+  if (nt>1)
     {
-      sample_pt s=array_get(sms, i);
-      sample2event(g, wcs, wh, s->word, s->tag, md, evs);
-      delete_sample(s);
-      if (i%1000==0)
-	{ report(-3, "%3d%%: %10d features\r", i*100/no_sms, md->no_fts); }
+      /* in rounds, to bound the memory of the shards' events */
+      model_pt shard[nt];
+      array_pt sevs[nt];
+      size_t first, last;
+
+      for (i=0; i<nt; i++)
+	{
+	  shard[i]=new_model(tgs, array_new(1000));
+	  shard[i]->no_ocs=md->no_ocs;
+	  sevs[i]=array_new(5000);
+	}
+      report(1, "extracting with %lu threads%s\n", (unsigned long)nt, parallel_available() ? "" : " sequentially");
+      for (first=0; first<no_sms; first=last)
+	{
+	  last=sentence_end(sms, first+EXTRACT_ROUND_SAMPLES*nt < no_sms ? first+EXTRACT_ROUND_SAMPLES*nt : no_sms, no_sms);
+	  extract_events(md, sms, first, last, wcs, wh, nt, shard, sevs, evs);
+	  for (i=first; i<last; i++) { delete_sample(array_get(sms, i)); }
+	  if (ef)
+	    {
+	      no_evs+=array_count(evs);
+	      write_raw_events(ef, evs, &np);
+	    }
+	  report(-3, "%3d%%: %10d features\r", (int)(last*100/no_sms), md->no_fts);
+	}
+      for (i=0; i<nt; i++)
+	{
+	  array_free(shard[i]->predicates);
+	  mem_free(shard[i]);
+	  array_free(sevs[i]);
+	}
+    }
+  else
+    {
+      window_t win=WINDOW_INIT;
+
+      for (i=0; i<no_sms; i++)
+	{
+	  sample_pt s=array_get(sms, i);
+	  sample2event(g, &win, wcs, wh, s->word, s->tag, md, evs);
+	  delete_sample(s);
+	  if (ef)
+	    {
+	      no_evs+=array_count(evs);
+	      write_raw_events(ef, evs, &np);
+	    }
+	  if (i%1000==0)
+	    { report(-3, "%3d%%: %10d features\r", i*100/no_sms, md->no_fts); }
+	}
     }
   array_free(sms); array_free(wcs); hash_delete(wh);
   sms=wcs=NULL; wh=NULL;
   report(1, "%d features collected\n", md->no_fts);
-  select_features(md, evs, fmin);    
-  add_default_features(md, evs);
-  md->inv_max_pds=1.0/(double)md->max_pds;
+  unregister_predinfos(md);
+  if (g->sketch) { sketch_delete(g->sketch); g->sketch=NULL; }
+  if (ef)
+    {
+      /* the events stay in the file, they are not merged */
+      i=array_count(md->predicates);
+      select_features(md, evs, fmin);
+      cm=map_raw_events(md, ef, no_evs, np, i);
+      report(1, "%lu events mapped, %lu bytes\n",
+	     (unsigned long)cm->no_evs, (unsigned long)cm->ev_map_size);
+    }
+  else
+    {
+      i=array_count(evs);
+      report(1, "%d events merged into %d\n", (int)i, (int)merge_events(md, evs));
+      select_features(md, evs, fmin);    
+      report(1, "%d events left after feature selection\n", (int)merge_events(md, evs));
+      add_default_features(md, evs);
+      md->inv_max_pds=1.0/(double)md->max_pds;
+      cm=compile_model(md, evs);
+    }
   report(1, "%d events (%d-%d), %d predicates\n",
-	 array_count(evs), md->min_pds, md->max_pds, array_count(md->predicates));
+	 (int)cm->no_evs, md->min_pds, md->max_pds, (int)array_count(md->predicates));
+  if (nt>1)
+    { report(1, "using %lu threads%s\n", (unsigned long)nt, parallel_available() ? "" : " sequentially"); }
+  if (om) { warm_start(cm, md, om); }
 
-  for (i=1; i<=mi; i++)
+  if (lbfgs)
+    {
+      report(1, "training with L-BFGS, prior variance %g\n", sigma2);
+      a=train_lbfgs(cm, mi, sigma2, nt);
+      report(1, "accuracy %7.3f%%\n", a*100.0);
+    }
+  else
     {
-      double na=train_iteration(md, evs);
-      double delta=na-a;
-      report(2, "%4d: accuracy %7.3f%%, %+9.5f%%, cf %f\n", i, na*100.0, delta*100.0, md->cf_alpha);
-      a=na;
-      if (i!=1 && delta<dt) { report(1, "bailing out, delta<%f\n", dt*100.0); break; }
+      for (i=1; i<=mi; i++)
+	{
+	  double na=train_iteration_compiled(cm, nt);
+	  double delta=na-a;
+	  report(2, "%4d: accuracy %7.3f%%, %+9.5f%%, cf %f\n", i, na*100.0, delta*100.0, cm->cf_alpha);
+	  a=na;
+	  if (i!=1 && delta<dt) { report(1, "bailing out, delta<%f\n", dt*100.0); break; }
+	}
     }
+  compiled_model_update(cm, md);
+  delete_compiled_model(cm);
+  if (ef) { fclose(ef); }
 
   write_model_file(mf, md);  
 }
@@ -1032,28 +2217,54 @@ static int predicate_matches_context(hash_pt d, predicate_pt pd, int t[], char *
 #endif
 
 /* ------------------------------------------------------------ */
-static void add_matching_predicates(array_pt pds, model_pt m, hash_pt d, int t[], char *w[], size_t cs)
+/* predicates depending on the words only */
+static void add_context_predicates(array_pt pds, model_pt m, hash_pt d, char *w[], size_t cs)
 {
   predindex_pt idx=(predindex_pt)m->userdata;
   predicate_pt pd;
   char *buf2 = NULL;
   size_t n2 = 0;
-  char *s=cs ? w[2] : lowercase(w[2], &buf2, &n2);
+  size_t cl=strlen(w[2]);
+  char lw[64];
+  char *s=w[2];
 
-#define ARRAY_ADD_IF_NONNULL(a, p) if (p) { array_add(a, p); }
+  if (!cs && cl<sizeof(lw))
+    {
+      size_t i;
+      for (i=0; i<=cl; i++) { lw[i]=mytolower(w[2][i]); }
+      s=lw;
+    }
+  else if (!cs) { s=lowercase(w[2], &buf2, &n2); }
+
+  /* hashed predicates may collide, an event has each one only once */
+#define ARRAY_ADD_IF_NONNULL(a, p) \
+  if (p) { if (idx->hashed) { array_add_unique(a, p); } else { array_add(a, p); } }
 
   /* TODO: check for case sensivity */
   if (hash_get(d, s))
-    { pd=hash_get(idx->word, s); ARRAY_ADD_IF_NONNULL(pds, pd); }
+    { pd=index_lookup(idx, pt_word, idx->word, s); ARRAY_ADD_IF_NONNULL(pds, pd); }
   else
     {
-      size_t cl=strlen(w[2]);
+      /* affixes of length 1 to 4, but not the whole word */
+      size_t n= cl<5 ? (cl ? cl-1 : 0) : 4;
+      predicate_pt pp[4], sp[4];
       size_t i;
-      for (i=1; i<5 && i<cl; i++)
+
+      if (idx->hashed)
 	{
-	  pd=hash_get(idx->prefix, substr(w[2], 0, i, &buf2, &n2)); ARRAY_ADD_IF_NONNULL(pds, pd);
-	  pd=hash_get(idx->suffix, substr(w[2], cl-1, -i, &buf2, &n2)); ARRAY_ADD_IF_NONNULL(pds, pd);
+	  for (i=0; i<n; i++)
+	    {
+	      pp[i]=index_lookup(idx, pt_prefix, NULL, substr(w[2], 0, i+1, &buf2, &n2));
+	      sp[i]=index_lookup(idx, pt_suffix, NULL, substr(w[2], cl-1, -(ssize_t)(i+1), &buf2, &n2));
+	    }
 	}
+      else
+	{
+	  affix_trie_walk(idx->prefix, w[2], cl, n, pp);
+	  affix_trie_walk(idx->suffix, w[2], cl, n, sp);
+	}
+      for (i=0; i<n; i++)
+	{ ARRAY_ADD_IF_NONNULL(pds, pp[i]); ARRAY_ADD_IF_NONNULL(pds, sp[i]); }
       if (strpbrk(w[2], "0123456789"))
 	{ ARRAY_ADD_IF_NONNULL(pds, idx->number); }
       if (get_first_uppercase(w[2]))
@@ -1062,17 +2273,31 @@ static void add_matching_predicates(array_pt pds, model_pt m, hash_pt d, int t[]
 	{ ARRAY_ADD_IF_NONNULL(pds, idx->hyphen); }
     }
   if (!w[0]) { ARRAY_ADD_IF_NONNULL(pds, idx->wm2_null); }
-  else { pd=hash_get(idx->wm2, w[0]); ARRAY_ADD_IF_NONNULL(pds, pd); }
+  else { pd=index_lookup(idx, pt_wm2, idx->wm2, w[0]); ARRAY_ADD_IF_NONNULL(pds, pd); }
 
   if (!w[1]) { ARRAY_ADD_IF_NONNULL(pds, idx->wm1_null); }
-  else { pd=hash_get(idx->wm1, w[1]); ARRAY_ADD_IF_NONNULL(pds, pd); }
+  else { pd=index_lookup(idx, pt_wm1, idx->wm1, w[1]); ARRAY_ADD_IF_NONNULL(pds, pd); }
 
   if (!w[3]) { ARRAY_ADD_IF_NONNULL(pds, idx->wp1_null); }
-  else { pd=hash_get(idx->wp1, w[3]); ARRAY_ADD_IF_NONNULL(pds, pd); }
+  else { pd=index_lookup(idx, pt_wp1, idx->wp1, w[3]); ARRAY_ADD_IF_NONNULL(pds, pd); }
 
   if (!w[4]) { ARRAY_ADD_IF_NONNULL(pds, idx->wp2_null); }
-  else { pd=hash_get(idx->wp2, w[4]); ARRAY_ADD_IF_NONNULL(pds, pd); }
+  else { pd=index_lookup(idx, pt_wp2, idx->wp2, w[4]); ARRAY_ADD_IF_NONNULL(pds, pd); }
+#undef ARRAY_ADD_IF_NONNULL
+  if(buf2) {
+	  free(buf2);
+	  buf2 = NULL;
+  }
+}
 
+/* ------------------------------------------------------------ */
+/* predicates depending on the tag history, and the default one */
+static void add_history_predicates(array_pt pds, model_pt m, int t[])
+{
+  predindex_pt idx=(predindex_pt)m->userdata;
+  predicate_pt pd;
+
+#define ARRAY_ADD_IF_NONNULL(a, p) if (p) { array_add(a, p); }
   pd=array_get(idx->tm1, t[1]+1); ARRAY_ADD_IF_NONNULL(pds, pd);
 
   pd=array_get((array_pt)array_get(idx->tm1tm2, t[1]+1), t[0]+1);
@@ -1080,10 +2305,121 @@ static void add_matching_predicates(array_pt pds, model_pt m, hash_pt d, int t[]
   
   ARRAY_ADD_IF_NONNULL(pds, idx->def);
 #undef ARRAY_ADD_IF_NONNULL
-  if(buf2) {
+}
+
+#define USE_INDEXED_PREDICATES 1
+
+/* ------------------------------------------------------------ */
+/* maximum number of predicates in a memo key */
+#define MEMO_KEY_MAX 32
+
+/* what is the same for all tag histories at a position */
+typedef struct context_s
+{
+  double *sc;     /* scores of the word and context predicates */
+  int *n;         /* number of their features per outcome */
+  array_pt keep;  /* tags of the word in the lexicon, or NULL */
+  int pds[MEMO_KEY_MAX]; /* ids of the word and context predicates */
+  size_t no_pds;  /* their number, >MEMO_KEY_MAX if too many */
+  array_pt mypds; /* scratch for the matching predicates */
+  struct memo_s *memo; /* probability memo, or NULL */
+} context_t;
+typedef context_t *context_pt;
+
+/* ------------------------------------------------------------ */
+/* direct-mapped memo of probability vectors; p[] only depends on
+   the matching predicates and the lexicon entry of the word, so
+   their ids make up the key */
+typedef struct memo_s
+{
+  size_t size;     /* number of slots */
+  size_t no_ocs;
+  int *klen;       /* key length per slot, -1 for empty slots */
+  int *key;        /* MEMO_KEY_MAX predicate ids per slot */
+  array_pt *keep;  /* lexicon entry per slot */
+  size_t *k;       /* number of sorted indices per slot */
+  double *p;       /* no_ocs probabilities per slot */
+  int *s;          /* no_ocs indices per slot */
+  unsigned long hits;
+  unsigned long misses;
+} memo_t;
+typedef memo_t *memo_pt;
+
+/* ------------------------------------------------------------ */
+static memo_pt memo_new(size_t bytes, size_t no_ocs)
+{
+  memo_pt mm=(memo_pt)mem_malloc(sizeof(memo_t));
+  size_t slot=(1+MEMO_KEY_MAX)*sizeof(int)+sizeof(array_pt)+sizeof(size_t)
+    +no_ocs*(sizeof(double)+sizeof(int));
+  size_t i;
+
+  mm->size=bytes/slot>0 ? bytes/slot : 1;
+  mm->no_ocs=no_ocs;
+  mm->klen=(int *)mem_malloc(mm->size*sizeof(int));
+  mm->key=(int *)mem_malloc(mm->size*MEMO_KEY_MAX*sizeof(int));
+  mm->keep=(array_pt *)mem_malloc(mm->size*sizeof(array_pt));
+  mm->k=(size_t *)mem_malloc(mm->size*sizeof(size_t));
+  mm->p=(double *)mem_malloc(mm->size*no_ocs*sizeof(double));
+  mm->s=(int *)mem_malloc(mm->size*no_ocs*sizeof(int));
+  for (i=0; i<mm->size; i++) { mm->klen[i]=-1; }
+  mm->hits=mm->misses=0;
+  return mm;
+}
+
+/* ------------------------------------------------------------ */
+static void memo_delete(memo_pt mm)
+{
+  mem_free(mm->klen);
+  mem_free(mm->key);
+  mem_free(mm->keep);
+  mem_free(mm->k);
+  mem_free(mm->p);
+  mem_free(mm->s);
+  mem_free(mm);
+}
+
+/* ------------------------------------------------------------ */
+/* slot for the key; *hit tells whether it holds the key already */
+static size_t memo_slot(memo_pt mm, const int key[], size_t nk, array_pt keep, size_t k, int *hit)
+{
+  size_t h=2166136261u;
+  size_t i;
+
+  for (i=0; i<nk; i++) { h=(h^(size_t)key[i])*16777619u; }
+  h=(h^(size_t)(ptrdiff_t)keep)*16777619u;
+  h%=mm->size;
+  *hit= mm->klen[h]==(int)nk && mm->keep[h]==keep && mm->k[h]>=k
+    && !memcmp(mm->key+h*MEMO_KEY_MAX, key, nk*sizeof(int));
+  if (*hit) { mm->hits++; } else { mm->misses++; }
+  return h;
+}
+
+/* ------------------------------------------------------------ */
+static void setup_context(model_pt m, hash_pt d, int cs, char *w[], context_pt c)
+{
+  array_pt mypds=c->mypds;
+  size_t i;
+
+  for (i=0; i<m->no_ocs; i++) { c->sc[i]=0.0; c->n[i]=0; }
+#if USE_INDEXED_PREDICATES
+  array_clear(mypds);
+  add_context_predicates(mypds, m, d, w, cs);
+  add_feature_weights(m, mypds, c->sc, c->n);
+#endif
+  c->no_pds=array_count(mypds);
+  for (i=0; i<c->no_pds && i<MEMO_KEY_MAX; i++)
+    { c->pds[i]=((predicate_pt)array_get(mypds, i))->id; }
+  c->keep=NULL;
+  if (d)
+    {
+      char *buf2 = NULL;
+      size_t n2 = 0;
+      c->keep=hash_get(d, cs ? w[2] : lowercase(w[2], &buf2, &n2));
+      if(buf2) {
 	  free(buf2);
 	  buf2 = NULL;
-  }
+      }
+    }
 }
 
 /* ------------------------------------------------------------ */
@@ -1105,18 +2441,23 @@ static void print_context(FILE *f, int t[], char *w[], array_pt tgs)
 
 
 /* ------------------------------------------------------------ */
-static void tag_probabilities(model_pt m, hash_pt d, int cs, int t[], char *w[], double p[], int s[])
+/* probabilities of the tags in p; the indices of the k most
+   probable ones are sorted into the front of s (k=0: no sorting) */
+static void tag_probabilities(model_pt m, int t[], context_pt c, double p[], int s[], size_t k)
 {
-  /* ok, some memory is wasted, but we avoid repetitive allocation */
-  static array_pt mypds=NULL;
+  array_pt mypds=c->mypds;
   array_pt tgs=m->outcomes;
-  array_pt a;
   size_t no_ocs=array_count(tgs);
+  double sc[no_ocs];
+  int n[no_ocs];
+  memo_pt mm=NULL;
+  int key[MEMO_KEY_MAX];
+  size_t nk=0, slot=0;
   size_t i;
 
-  if (!mypds) { mypds=array_new(8); }
+  if (k>no_ocs) { k=no_ocs; }
 
-  for (i=0; i<m->no_ocs; i++) { s[i]=i; }
+  if (k>0) { for (i=0; i<m->no_ocs; i++) { s[i]=i; } }
 
 /* by Tiago Tresoldi - the code below will never be executed (as for the function itself);
  * I am temporarly commenting it out to keep gcc from complaining */
@@ -1129,10 +2470,29 @@ static void tag_probabilities(model_pt m, hash_pt d, int cs, int t[], char *w[],
 
   array_clear(mypds);
 
-#define USE_INDEXED_PREDICATES 1
 #if USE_INDEXED_PREDICATES
-  add_matching_predicates(mypds, m, d, t, w, cs);
+  /* the word and context part comes precomputed in c */
+  memcpy(sc, c->sc, no_ocs*sizeof(double));
+  memcpy(n, c->n, no_ocs*sizeof(int));
+  add_history_predicates(mypds, m, t);
+  if (c->memo && c->no_pds+array_count(mypds)<=MEMO_KEY_MAX)
+    {
+      int hit;
+
+      mm=c->memo;
+      memcpy(key, c->pds, c->no_pds*sizeof(int));
+      for (nk=c->no_pds, i=0; i<array_count(mypds); i++)
+	{ key[nk++]=((predicate_pt)array_get(mypds, i))->id; }
+      slot=memo_slot(mm, key, nk, c->keep, k, &hit);
+      if (hit)
+	{
+	  memcpy(p, mm->p+slot*no_ocs, no_ocs*sizeof(double));
+	  memcpy(s, mm->s+slot*no_ocs, k*sizeof(int));
+	  return;
+	}
+    }
 #else
+  for (i=0; i<no_ocs; i++) { sc[i]=0.0; n[i]=0; }
   {
     array_pt pds=m->predicates;
     for (i=0; i<array_count(pds); i++)
@@ -1154,7 +2514,8 @@ static void tag_probabilities(model_pt m, hash_pt d, int cs, int t[], char *w[],
   fprintf(stderr, "\n");
 #endif
   
-  assign_probabilities(m, mypds, p);
+  add_feature_weights(m, mypds, sc, n);
+  scores_to_probabilities(m, sc, n, p);
 #if DEBUG_TAG_PROBABILITIES
   eqsort((void *)s, no_ocs, sizeof(int), mycompare, p);
   report(-1, "BEFORE:");
@@ -1162,18 +2523,17 @@ static void tag_probabilities(model_pt m, hash_pt d, int cs, int t[], char *w[],
     { report(-1, " %f/%s", p[s[i]], (char *)array_get(m->outcomes, s[i])); }
   report(-1, "\nd=%p w[2]=%s dict(%s)=%p\n", d, w[2], w[2], hash_get(d, w[2]));
 #endif
-  if (d)
+  if (c->keep) { redistribute_probabilities(m, c->keep, p); }
+  if (k>0) { eqsort_top((void *)s, no_ocs, k, sizeof(int), mycompare, p); }
+  if (mm)
     {
-      char *buf2 = NULL;
-      size_t n2 = 0;
-      a=hash_get(d, cs ? w[2] : lowercase(w[2], &buf2, &n2));
-      if (a) { redistribute_probabilities(m, a, p); }
-      if(buf2) {
-	  free(buf2);
-	  buf2 = NULL;
-      }
+      mm->klen[slot]=nk;
+      memcpy(mm->key+slot*MEMO_KEY_MAX, key, nk*sizeof(int));
+      mm->keep[slot]=c->keep;
+      mm->k[slot]=k;
+      memcpy(mm->p+slot*no_ocs, p, no_ocs*sizeof(double));
+      memcpy(mm->s+slot*no_ocs, s, k*sizeof(int));
     }
-  eqsort((void *)s, no_ocs, sizeof(int), mycompare, p);
 #if DEBUG_TAG_PROBABILITIES
   report(-1, " AFTER:");
   for (i=0; i<5; i++)
@@ -1198,385 +2558,895 @@ static int tag_in_context(model_pt m, hash_pt d, int t[], char *w[], double pt,
   for (i=0; i<no_ocs; i++) { sorter[i]=i; }
   for (i=0; i<array_count(pds); i++)
     {
-      predicate_pt pd=array_get(pds, i);
-      if (predicate_matches_context(d, pd, t, w, cs)) { array_add(mypds, pd); }
+      predicate_pt pd=array_get(pds, i);
+      if (predicate_matches_context(d, pd, t, w, cs)) { array_add(mypds, pd); }
+    }
+  assign_probabilities(m, mypds, p);
+  array_free(mypds);
+  eqsort((void *)sorter, no_ocs, sizeof(int), mycompare, p);
+
+  fprintf(stdout, "%-30s", w[2]);
+  for (i=0; i==0 || (pt>0.0 && p[sorter[i]]>=pt); i++)
+    {
+      int si=sorter[i];
+      fprintf(stdout, " %8s %7.5f", (char *)array_get(tgs, si), p[si]);
+    }
+  fprintf(stdout, "\n");
+  
+  return sorter[0];
+}
+#endif
+
+/* ------------------------------------------------------------ */
+/* workspace of the decoders; allocated once per model and only
+   grown when a longer sentence comes along */
+typedef struct vstate_s
+{
+  int t1;                       /* previous tag+1, 0 for BOUNDARY */
+  int t2;                       /* current tag+1, 0 for BOUNDARY */
+  ptrdiff_t bp;                 /* predecessor in the previous column */
+  double la;                    /* log probability */
+} vstate_t;
+typedef vstate_t *vstate_pt;
+
+typedef struct decoder_s
+{
+  int not;                      /* number of tags */
+  double *p;                    /* tag probabilities */
+  int *s;                       /* tags sorted by probability */
+  double *sc;                   /* context scores */
+  int *n;                       /* context feature counts */
+  int *slot;                    /* viterbi: (not+1)^2 states -> index or -1 */
+  vstate_pt st;                 /* viterbi: states of all columns */
+  size_t st_size;
+  size_t *col;                  /* viterbi: wno+2 column offsets into st */
+  size_t col_size;
+  int bw;                       /* n-best width, 0 for none */
+  double *lseq;                 /* n-best: log probabilities */
+  double *lnew;
+  int *snew;                    /* n-best: predecessor sequence */
+  int *tnew;                    /* n-best: new tag */
+  int *bp;                      /* n-best: wno*bw backpointers */
+  int *tg;                      /* n-best: wno*bw tags */
+  size_t nb_size;
+  array_pt pds;                 /* matching predicates */
+  memo_pt memo;                 /* probability memo, or NULL */
+} decoder_t;
+typedef decoder_t *decoder_pt;
+
+/* ------------------------------------------------------------ */
+/* one per thread, with a memo of memo bytes unless 0 */
+static decoder_pt decoder_new(model_pt m, int bw, size_t memo)
+{
+  decoder_pt dc=(decoder_pt)mem_malloc(sizeof(decoder_t));
+  int not=m->no_ocs;
+  int i;
+
+  dc->not=not;
+  dc->p=(double *)mem_malloc(not*sizeof(double));
+  dc->s=(int *)mem_malloc(not*sizeof(int));
+  dc->sc=(double *)mem_malloc(not*sizeof(double));
+  dc->n=(int *)mem_malloc(not*sizeof(int));
+  for (i=0; i<not; i++) { dc->s[i]=i; }
+  dc->slot=(int *)mem_malloc((not+1)*(not+1)*sizeof(int));
+  for (i=0; i<(not+1)*(not+1); i++) { dc->slot[i]=-1; }
+  dc->st_size=1024;
+  dc->st=(vstate_pt)mem_malloc(dc->st_size*sizeof(vstate_t));
+  dc->col_size=64;
+  dc->col=(size_t *)mem_malloc(dc->col_size*sizeof(size_t));
+  dc->bw=bw;
+  dc->lseq=dc->lnew=NULL;
+  dc->snew=dc->tnew=dc->bp=dc->tg=NULL;
+  dc->nb_size=0;
+  if (bw>0)
+    {
+      dc->lseq=(double *)mem_malloc(bw*sizeof(double));
+      dc->lnew=(double *)mem_malloc(bw*sizeof(double));
+      dc->snew=(int *)mem_malloc(bw*sizeof(int));
+      dc->tnew=(int *)mem_malloc(bw*sizeof(int));
+      dc->nb_size=64*bw;
+      dc->bp=(int *)mem_malloc(dc->nb_size*sizeof(int));
+      dc->tg=(int *)mem_malloc(dc->nb_size*sizeof(int));
+    }
+  dc->pds=array_new(32);
+  dc->memo= memo>0 ? memo_new(memo, not) : NULL;
+  return dc;
+}
+
+/* ------------------------------------------------------------ */
+static void decoder_delete(decoder_pt dc)
+{
+  mem_free(dc->p);
+  mem_free(dc->s);
+  mem_free(dc->sc);
+  mem_free(dc->n);
+  mem_free(dc->slot);
+  mem_free(dc->st);
+  mem_free(dc->col);
+  if (dc->bw>0)
+    {
+      mem_free(dc->lseq);
+      mem_free(dc->lnew);
+      mem_free(dc->snew);
+      mem_free(dc->tnew);
+      mem_free(dc->bp);
+      mem_free(dc->tg);
+    }
+  array_free(dc->pds);
+  if (dc->memo) { memo_delete(dc->memo); }
+  mem_free(dc);
+}
+
+/* ------------------------------------------------------------ */
+/* deletes the n decoders of a run, reporting on their memos */
+static void decoders_delete(decoder_pt dc[], size_t n)
+{
+  unsigned long size=0, hits=0, misses=0;
+  size_t i;
+
+  for (i=0; i<n; i++)
+    {
+      if (dc[i]->memo)
+	{
+	  size+=dc[i]->memo->size;
+	  hits+=dc[i]->memo->hits;
+	  misses+=dc[i]->memo->misses;
+	}
+      decoder_delete(dc[i]);
+    }
+  if (size>0)
+    {
+      report(1, "probability memo: %lu slots, %lu hits, %lu misses (%.1f%% hits)\n",
+	     size, hits, misses, hits+misses>0 ? 100.0*hits/(hits+misses) : 0.0);
     }
-  assign_probabilities(m, mypds, p);
-  array_free(mypds);
-  eqsort((void *)sorter, no_ocs, sizeof(int), mycompare, p);
+}
 
-  fprintf(stdout, "%-30s", w[2]);
-  for (i=0; i==0 || (pt>0.0 && p[sorter[i]]>=pt); i++)
+/* ------------------------------------------------------------ */
+/* make room for a sentence of wno words */
+static void decoder_reserve(decoder_pt dc, int wno)
+{
+  if ((size_t)wno+2>dc->col_size)
     {
-      int si=sorter[i];
-      fprintf(stdout, " %8s %7.5f", (char *)array_get(tgs, si), p[si]);
+      while ((size_t)wno+2>dc->col_size) { dc->col_size*=2; }
+      dc->col=(size_t *)mem_realloc(dc->col, dc->col_size*sizeof(size_t));
+    }
+  if (dc->bw>0 && (size_t)wno*dc->bw>dc->nb_size)
+    {
+      while ((size_t)wno*dc->bw>dc->nb_size) { dc->nb_size*=2; }
+      dc->bp=(int *)mem_realloc(dc->bp, dc->nb_size*sizeof(int));
+      dc->tg=(int *)mem_realloc(dc->tg, dc->nb_size*sizeof(int));
     }
-  fprintf(stdout, "\n");
-  
-  return sorter[0];
 }
-#endif
 
 /* ------------------------------------------------------------ */
-static void viterbi(model_pt m, hash_pt d, int cs, int t[], char *w[], int wno, int beam)
+static void context_words(char *wds[], char *w[], int i, int wno)
+{
+  int j;
+
+  for (j=0; j<2; j++) { wds[j]= i+j-2>=0 ? w[i+j-2] : NULL; }
+  wds[2]=w[i];
+  for (j=3; j<5; j++) { wds[j]= i+j-2<wno ? w[i+j-2] : NULL; }
+}
+
+/* ------------------------------------------------------------ */
+static int compare_vstates(const void *a, const void *b)
+{
+  const vstate_t *u=(const vstate_t *)a;
+  const vstate_t *v=(const vstate_t *)b;
+
+  if (u->t1!=v->t1) { return u->t1-v->t1; }
+  return u->t2-v->t2;
+}
+
+/* ------------------------------------------------------------ */
+/* second order viterbi search in log space; a column only holds
+   the tag pairs reached from states within the beam */
+static void viterbi(model_pt m, decoder_pt dc, hash_pt d, int cs, int t[], char *w[], int wno, int beam)
 {
-  int not=array_count(m->outcomes);
+  int not=dc->not;
   int tgs[2]={-1, -1};
   char *wds[5]={0, 0, 0, 0, 0};
-  double p[not];
-  int s[not];
-  double *a = (double*) malloc(sizeof(double)*(wno+2)*(not+1)*(not+1));
-  int *b = (int*) malloc(sizeof(int)*(wno+2)*(not+1)*(not+1));
-  double max_a;
-  double b_a=-1.0;
-  int b_i=1, b_j=1;
+  double *p=dc->p;
+  context_t c={ dc->sc, dc->n, NULL, {0}, 0, dc->pds, dc->memo };
+  double lbeam= beam>0 ? log((double)beam) : HUGE_VAL;
+  double lmax=0.0;
+  double b_a=-HUGE_VAL;
+  size_t ns, q, b_q=0;
   int i;
 
-#define DEBUG_VITERBI 0
-  memset(a, 0, (wno+2)*(not+1)*(not+1)*sizeof(double));
-  *a=1.0;
-  max_a=1.0;
+  decoder_reserve(dc, wno);
+  /* column 0 is the state before the sentence */
+  dc->st[0].t1=dc->st[0].t2=0;
+  dc->st[0].bp=-1;
+  dc->st[0].la=0.0;
+  dc->col[0]=0;
+  dc->col[1]=ns=1;
   for (i=0; i<wno; i++)
     {
-      int j;
-      double max_a_new=0.0;
+      double lmin=lmax-lbeam;
+      double lmax_new=-HUGE_VAL;
 
-      if (beam==0) { max_a=0.0; } else { max_a/=(double)beam; }
-      for (j=0; j<2; j++) { wds[j]= i+j-2>=0 ? w[i+j-2] : NULL; }
-      wds[2]=w[i];
-      for (j=3; j<5; j++) { wds[j]= i+j-2<wno ? w[i+j-2] : NULL; }
-      for (j=0; j<=not; j++)
+      context_words(wds, w, i, wno);
+      setup_context(m, d, cs, wds, &c);
+      for (q=dc->col[i]; q<dc->col[i+1]; q++)
 	{
-	  ptrdiff_t tj=j-1;
-	  ptrdiff_t k;
-	  for (k=0; k<=not; k++)
+	  double la=dc->st[q].la;
+	  int *slot=dc->slot+dc->st[q].t2*(not+1)+1;
+	  int l;
+
+	  if (la<lmin) { continue; }
+	  tgs[0]=dc->st[q].t1-1;
+	  tgs[1]=dc->st[q].t2-1;
+	  tag_probabilities(m, tgs, &c, p, dc->s, 0);
+	  if (ns+not>dc->st_size)
 	    {
-	      ptrdiff_t tk=k-1;
-	      int l;
-	      if (*(a+i*(not+1)*(not+1)+j*(not+1)+k)<max_a) { continue; }
-	      tgs[0]=tj; 
-	      tgs[1]=tk; 
-	      tag_probabilities(m, d, cs, tgs, wds, p, s);
-#if DEBUG_VITERBI
-	      {
-		double sum=0.0;
-		int k;
-		report(-1, "[%8s %8s]",
-		       tgs[0]<0 ? "NULL" : (char *)array_get(m->outcomes, tgs[0]),
-		       tgs[1]<0 ? "NULL" : (char *)array_get(m->outcomes, tgs[1]));
-		for (k=0; k<5; k++)
-		  {
-		    int ti=s[k];
-		    report(-1, " %8s %f", (char *)array_get(m->outcomes, ti), p[ti]);
-		  }
-		for (k=0; k<m->no_ocs; k++) { sum+=p[s[k]]; }
-		report(-1, " --> %f\n", sum);
-	      }
-#endif
-	      for (l=0; l<not; l++)
+	      while (ns+not>dc->st_size) { dc->st_size*=2; }
+	      dc->st=(vstate_pt)mem_realloc(dc->st, dc->st_size*sizeof(vstate_t));
+	    }
+	  for (l=0; l<not; l++)
+	    {
+	      vstate_pt v;
+	      double new;
+
+	      if (p[l]==0.0) { continue; }
+	      new=la+log(p[l]);
+	      if (slot[l]<0)
 		{
-		  double new;
-		  if (p[l]==0.0) { continue; }
-		  new=*(a+i*(not+1)*(not+1)+j*(not+1)+k)*p[l];
-		  if (*(a+(i+1)*(not+1)*(not+1)+k*(not+1)+l+1)<new)
-		    {
-		      *(a+(i+1)*(not+1)*(not+1)+k*(not+1)+l+1)=new;
-		      *(b+(i+1)*(not+1)*(not+1)+k*(not+1)+l+1)=j;
-		      if (new>max_a_new) { max_a_new=new; }
-		    }
+		  slot[l]=ns;
+		  v=dc->st+ns++;
+		  v->t1=dc->st[q].t2;
+		  v->t2=l+1;
+		}
+	      else
+		{
+		  v=dc->st+slot[l];
+		  if (v->la>=new) { continue; }
 		}
+	      v->la=new;
+	      v->bp=q;
+	      if (new>lmax_new) { lmax_new=new; }
 	    }
 	}
-      max_a=max_a_new;
+      dc->col[i+2]=ns;
+      for (q=dc->col[i+1]; q<ns; q++)
+	{ dc->slot[dc->st[q].t1*(not+1)+dc->st[q].t2]=-1; }
+      /* predecessors are tried in tag order, as ties go to the first */
+      qsort(dc->st+dc->col[i+1], ns-dc->col[i+1], sizeof(vstate_t), compare_vstates);
+      lmax=lmax_new;
     }
   /* find highest prob in last column */
-  for (i=0; i<=not; i++)
-    {
-      int j;
-      for (j=0; j<=not; j++)
-	{ if (*(a+(wno)*(not+1)*(not+1)+i*(not+1)+j)>=b_a) { b_a=*(a+(wno)*(not+1)*(not+1)+i*(not+1)+j); b_i=i; b_j=j; } }
-    }
-#if DEBUG_VITERBI
-  report(-1, "best final state %s-%s\n",
-	 b_i<=0 ? "NULL" : (char *)array_get(m->outcomes, b_i-1),
-	 b_j<=0 ? "NULL" : (char *)array_get(m->outcomes, b_j-1));
-#endif
-  /* best final state is (b_i, b_j) */
+  for (q=dc->col[wno]; q<dc->col[wno+1]; q++)
+    { if (dc->st[q].la>=b_a) { b_a=dc->st[q].la; b_q=q; } }
   for (i=wno; i>0; i--)
     {
-      int tmp=*(b+(i)*(not+1)*(not+1)+b_i*(not+1)+b_j);
-      /* TODO: b_j==0 is an error (beam too small?) and should be handled differently */
-      t[i-1]= b_j==0 ? 0 : b_j-1;
-      b_j=b_i;
-      b_i=tmp;
+      /* TODO: BOUNDARY is an error (beam too small?) and should be handled differently */
+      t[i-1]= dc->st[b_q].t2==0 ? 0 : dc->st[b_q].t2-1;
+      b_q=dc->st[b_q].bp;
     }
-  if(a !=NULL) {
-	  free(a);
-	  a = NULL;
-  }
-  if(b !=NULL) {
-	  free(b);
-	  b = NULL;
-  }
 }
 
 /* ------------------------------------------------------------ */
-static void tag_sentence(model_pt m, hash_pt d, int cs, int t[], char *w[], int wno, int bw)
+/* n-best search in log space; the sequences are kept as
+   backpointers into the previous column */
+static void tag_sentence(model_pt m, decoder_pt dc, hash_pt d, int cs, int t[], char *w[], int wno, int bw)
 {
   int tgs[2]={-1, -1};
   char *wds[5]={0, 0, 0, 0, 0};
-  int *seq = (int*)malloc(sizeof(int)*(bw*wno));
-  double *pseq = (double*)malloc(sizeof(double)*bw);
-  double *pnew = (double*)malloc(sizeof(double)*bw);
-  int *snew = (int*)malloc(sizeof(int)*(bw));
-  int *tnew = (int*)malloc(sizeof(int)*(bw));
-  double *p = (double*)malloc(sizeof(double)*(m->no_ocs));
-  int *s = (int*)malloc(sizeof(int)*(m->no_ocs));
+  double *p=dc->p;
+  int *s=dc->s;
+  double *lseq=dc->lseq;
+  double *lnew=dc->lnew;
+  int *snew=dc->snew;
+  int *tnew=dc->tnew;
+  context_t c={ dc->sc, dc->n, NULL, {0}, 0, dc->pds, dc->memo };
+  int nseq=1;
   int i;
 
-#define DEBUG_TAG_SENTENCE 0
-#if DEBUG_TAG_SENTENCE
-  report(-1, "wno=%d, bw=%d, m->no_ocs=%d p=%p s=%p\n", wno, bw, m->no_ocs, p, s);
-  report(-1, "tgs=%p, wds=%p, seq=%p, pseq=%p, pnew=%p, snew=%p, tnew=%p\n",
-	 tgs, wds, seq, pseq, pnew, snew, tnew);
-#endif
-  for (i=0; i < (ssize_t)m->no_ocs; i++) { s[i]=i; }
-  for (i=0; i<bw; i++) { pseq[i]=1.0; }
+  if (bw>dc->bw) { error("n-best width %d exceeds decoder width %d\n", bw, dc->bw); }
+  decoder_reserve(dc, wno);
+  lseq[0]=0.0;
   for (i=0; i<wno; i++)
     {
+      int nnew=0;
       int j;
-      int tmp[bw][wno];
-      for (j=0; j<2; j++) { wds[j]= i+j-2 >= 0 ? w[i+j-2] : NULL; }
-      wds[2]=w[i];
-      for (j=3; j<5; j++) { wds[j]= i+j-2 < wno ? w[i+j-2] : NULL; }
-
-#if DEBUG_TAG_SENTENCE
-      for (j=0; j<5; j++) { report(-1, "%s ", wds[j] ? wds[j] : "NULL"); }
-      report(-1, "\n");
-#endif
-      
-      for (j=0; j<bw; j++) { pnew[j]=0.0; snew[j]=0; tnew[j]=0; }
-      for (j=0; j<bw; j++)
+
+      context_words(wds, w, i, wno);
+      setup_context(m, d, cs, wds, &c);
+      for (j=0; j<nseq; j++)
 	{
 	  int k;
 
-	  /* if pseq[j]<pnew[bw-1] the jth sequence is already worse
+	  /* if lseq[j]<=lnew[bw-1] the jth sequence is already worse
 	     (before adding this tag) than the worst in our n-best
-	     list, so we can immediately ignore it */	     
-	  if (pseq[j]<=pnew[bw-1]) { continue; }
-	  
-	  /* if pseq[j]==1.0 the seq is new and one run is sufficient */
-	  if (j>0 && pseq[j]==1.0) { continue; }
-	  
-	  tgs[0]= i-2>=0 ? *(seq + j + (i-2)*wno) : -1;
-	  tgs[1]= i-1>=0 ? *(seq + j + (i-1)*wno) : -1;
-	  tag_probabilities(m, d, cs, tgs, wds, p, s);
-#if DEBUG_TAG_SENTENCE
-	  {
-	    double sum=0.0;
-	    report(-1, "[%8s %8s]",
-		   tgs[0]<0 ? "NULL" : (char *)array_get(m->outcomes, tgs[0]),
-		   tgs[1]<0 ? "NULL" : (char *)array_get(m->outcomes, tgs[1]));
-	    for (k=0; k<5; k++)
-	      {
-		int ti=s[k];
-		report(-1, " %8s %f", (char *)array_get(m->outcomes, ti), p[ti]);
-	      }
-	    for (k=0; k<m->no_ocs; k++) { sum+=p[s[k]]; }
-	    report(-1, " --> %f\n", sum);
-	  }
-#endif
-	  for (k=0; k < bw && k < (ssize_t)m->no_ocs; k++)
+	     list, so we can immediately ignore it */
+	  if (nnew==bw && lseq[j]<=lnew[bw-1]) { continue; }
+
+	  tgs[1]= i-1>=0 ? dc->tg[(i-1)*bw+j] : -1;
+	  tgs[0]= i-2>=0 ? dc->tg[(i-2)*bw+dc->bp[(i-1)*bw+j]] : -1;
+	  tag_probabilities(m, tgs, &c, p, s, bw);
+	  for (k=0; k<bw && k<dc->not; k++)
 	    {
 	      int ti=s[k];
-	      double pcombined=pseq[j]*p[ti];
-	      ptrdiff_t l;
-	      if (pcombined<=pnew[bw-1]) { continue; }
-	      for (l=bw-2; l>=0 && pcombined>pnew[l]; l--)
-		{ pnew[l+1]=pnew[l]; snew[l+1]=snew[l]; tnew[l+1]=tnew[l]; }
+	      double lc;
+	      int l;
+
+	      if (p[ti]==0.0) { continue; }
+	      lc=lseq[j]+log(p[ti]);
+	      if (nnew==bw && lc<=lnew[bw-1]) { continue; }
+	      for (l=(nnew<bw ? nnew : bw-1)-1; l>=0 && lc>lnew[l]; l--)
+		{ lnew[l+1]=lnew[l]; snew[l+1]=snew[l]; tnew[l+1]=tnew[l]; }
 	      l++;
-	      pnew[l]=pcombined; snew[l]=j; tnew[l]=ti;
-#if DEBUG_TAG_SENTENCE
-	      report(-1, "pnew[%d]=%e, snew[%d]=%d, tnew[%d]=%d\n", l, pnew[l], l, snew[l], l, tnew[l]);
-#endif
+	      lnew[l]=lc; snew[l]=j; tnew[l]=ti;
+	      if (nnew<bw) { nnew++; }
 	    }
 	}
-      for (j=0; j<bw; j++)
+      for (j=0; j<nnew; j++)
 	{
-	  int k;
-	  for (k=0; k<i; k++) { tmp[j][k]=*(seq + snew[j] + (k*wno)); }
-	  tmp[j][i]=tnew[j];
-	  pseq[j]=pnew[j];
+	  lseq[j]=lnew[j];
+	  dc->bp[i*bw+j]=snew[j];
+	  dc->tg[i*bw+j]=tnew[j];
 	}
-      memcpy(seq, tmp, sizeof(int)*bw*wno);
-#if DEBUG_TAG_SENTENCE
-      for (j=0; j<bw && pseq[j]>0.0; j++)
-	{
-	  size_t k;
-	  report(-1, "%d: %9.8e ", j, pseq[j]);
-	  for (k=0; k<=i; k++)
-	    { report(-1, " %8s", (char *)array_get(m->outcomes, *(seq + j + (k*wno) ));}
-	  report(-1, "\n");
-	}      
-#endif
+      if (nnew==0)
+	{ dc->bp[i*bw]=0; dc->tg[i*bw]=0; lseq[0]=-HUGE_VAL; nnew=1; }
+      nseq=nnew;
     }
 
-  for (i=0; i<wno; i++) { t[i]=*(seq + 0 + (i*wno) ); }
-  if(seq != NULL) {
-	  free(seq);
-	  seq = NULL;
-  }
-  if(pseq != NULL) {
-	  free(pseq);
-	  pseq = NULL;
-  }
-  if(pnew != NULL) {
-	  free(pnew);
-	  pnew = NULL;
-  }
-  if(snew != NULL) {
-	  free(snew);
-	  snew = NULL;
-  }
-  if(tnew != NULL) {
-	  free(tnew);
-	  tnew = NULL;
-  }
-  if(p != NULL) {
-	  free(p);
-	  p = NULL;
-  }
-  if(s != NULL) {
-	  free(s);
-	  s = NULL;
-  }
+  /* follow the best sequence back */
+  for (i=wno-1, nseq=0; i>=0; i--)
+    {
+      t[i]=dc->tg[i*bw+nseq];
+      nseq=dc->bp[i*bw+nseq];
+    }
 }
 
 /* ------------------------------------------------------------ */
-static void tagging(FILE *mf, FILE *df, FILE *rf, double pt, size_t bw, size_t cs, size_t nbest)
+/* sentences per thread in a round of tagging */
+#define TAG_ROUND_SENTENCES 1024
+
+/* ------------------------------------------------------------ */
+/* sentences held in memory: a tagged corpus for compressing, or a
+   round of the input for tagging and testing */
+typedef struct corpus_s
+{
+  char **ws;                    /* words */
+  int *ts;                      /* their tags */
+  size_t *st;                   /* no_sts+1 sentence starts */
+  size_t no_sts, no_ws, size, st_size;
+} corpus_t;
+typedef corpus_t *corpus_pt;
+
+/* ------------------------------------------------------------ */
+static void corpus_init(corpus_pt c)
+{
+  memset(c, 0, sizeof(corpus_t));
+  c->st_size=1024;
+  c->st=(size_t *)mem_malloc(c->st_size*sizeof(size_t));
+  c->st[0]=0;
+}
+
+/* ------------------------------------------------------------ */
+static void corpus_free(corpus_pt c)
+{
+  mem_free(c->ws);
+  mem_free(c->ts);
+  mem_free(c->st);
+}
+
+/* ------------------------------------------------------------ */
+static void corpus_add_word(corpus_pt c, char *w, int t)
+{
+  if (c->no_ws==c->size)
+    {
+      c->size= c->size ? 2*c->size : 4096;
+      c->ws=(char **)mem_realloc(c->ws, c->size*sizeof(char *));
+      c->ts=(int *)mem_realloc(c->ts, c->size*sizeof(int));
+    }
+  c->ws[c->no_ws]=w;
+  c->ts[c->no_ws++]=t;
+}
+
+/* ------------------------------------------------------------ */
+/* the words added since the last sentence make up the next one */
+static void corpus_end_sentence(corpus_pt c)
+{
+  if (c->no_ws==c->st[c->no_sts]) { return; }
+  if (c->no_sts+2>c->st_size)
+    {
+      c->st_size*=2;
+      c->st=(size_t *)mem_realloc(c->st, c->st_size*sizeof(size_t));
+    }
+  c->st[++c->no_sts]=c->no_ws;
+}
+
+/* ------------------------------------------------------------ */
+/* reads the next round of at most max sentences into c, with their
+   tags if tagged; sentence i is read into the buffer ls[i] of size
+   ln[i], which its words point into until the next round */
+static size_t read_round(FILE *f, model_pt m, corpus_pt c, char *ls[], size_t ln[],
+			 size_t max, int tagged, size_t *lno)
 {
-  model_pt m=read_model_file(mf);
-  hash_pt dic=read_dictionary_file(m, df, cs);
-  char *w;
-  size_t wcount=32;
-  char **ws=mem_malloc(sizeof(char *)*wcount);
-  int *ts=mem_malloc(sizeof(int)*wcount);
   ssize_t r;
-  char *s;
-  char *buf = NULL;
-  size_t n = 0;
 
-  memset(ws, 0, sizeof(char *)*wcount);
-  while ((r = readline(&buf,&n,rf)) != -1)
+  c->no_sts=c->no_ws=0;
+  while (c->no_sts<max && (r=readline(&ls[c->no_sts], &ln[c->no_sts], f))!=-1)
     {
-      s = buf;
-      if (r>0 && s[r-1]=='\n') s[r-1] = '\0';
-      if(r == 0) { continue; }
-      size_t i, wdc;
+      char *s=ls[c->no_sts];
+      char *w, *t=NULL;
+      size_t wdc;
 
+      (*lno)++;
+      if (r>0 && s[r-1]=='\n') { s[r-1]='\0'; }
       for (wdc=0, w=strtok(s, " \t"); w; wdc++, w=strtok(NULL, " \t"))
 	{
-	  if (wdc>=wcount)
+	  if (tagged && !(t=strtok(NULL, " \t")))
 	    {
-	      size_t oldcount=wcount;
-	      wcount*=2;
-	      ws=mem_realloc(ws, sizeof(char *)*wcount);
-	      memset(&ws[oldcount], 0, sizeof(char *)*(wcount-oldcount));
-	      ts=mem_realloc(ts, sizeof(int)*wcount);
+	      report(0, "can't read tag %lu in line %lu\n", (unsigned long)wdc, (unsigned long)*lno);
+	      break;
 	    }
-	  ws[wdc]=w;
+	  corpus_add_word(c, w, tagged ? (int)find_tag(t, m->outcomes) : -1);
+	}
+      corpus_end_sentence(c);
+    }
+  return c->no_sts;
+}
+
+/* ------------------------------------------------------------ */
+/* data shared by the threads tagging a corpus */
+typedef struct tag_job_s
+{
+  model_pt m;
+  hash_pt d;                    /* lexicon, read only like m */
+  int cs;
+  int bw;                       /* beam factor or n-best width */
+  int nbest;                    /* n-best instead of viterbi */
+  decoder_pt *dc;               /* per thread */
+  corpus_pt c;                  /* the sentences */
+  int *ts;                      /* the tags found for c->ws */
+  const char *done;             /* sentences tagged already, or NULL */
+} tag_job_t;
+typedef tag_job_t *tag_job_pt;
+
+/* ------------------------------------------------------------ */
+/* first sentence of shard id of n, all with about as many words */
+static size_t sentence_shard(corpus_pt c, size_t id, size_t n)
+{
+  size_t b=parallel_shard_begin(c->no_ws, id, n);
+  size_t lo=0, hi=c->no_sts;
+
+  while (lo<hi)
+    {
+      size_t mid=lo+(hi-lo)/2;
+
+      if (c->st[mid]<b) { lo=mid+1; } else { hi=mid; }
+    }
+  return lo;
+}
+
+/* ------------------------------------------------------------ */
+static void tag_worker(size_t id, size_t n, void *data)
+{
+  tag_job_pt job=(tag_job_pt)data;
+  corpus_pt c=job->c;
+  size_t last=sentence_shard(c, id+1, n);
+  size_t i;
+
+  for (i=sentence_shard(c, id, n); i<last; i++)
+    {
+      size_t b=c->st[i];
+      int wno=c->st[i+1]-b;
+
+      if (job->done && job->done[i]) { continue; }
+      if (job->nbest)
+	{ tag_sentence(job->m, job->dc[id], job->d, job->cs, job->ts+b, c->ws+b, wno, job->bw); }
+      else
+	{ viterbi(job->m, job->dc[id], job->d, job->cs, job->ts+b, c->ws+b, wno, job->bw); }
+    }
+}
+
+/* ------------------------------------------------------------ */
+/* the input is read in rounds, whose sentences nt threads tag with
+   a decoder each; they are written in input order */
+static void tagging(FILE *mf, FILE *df, FILE *rf, double pt, size_t bw, size_t cs, size_t nbest,
+		    size_t cache, size_t nt)
+{
+  model_pt m=read_model_file(mf, 0);
+  hash_pt dic=df ? read_dictionary_file(m, df, cs) : binary_dictionary(m, cs);
+  sentcache_pt sc= cache>0 ? sentcache_new(cache*1024*1024) : NULL;
+  size_t max=TAG_ROUND_SENTENCES*nt;
+  char **ls=(char **)mem_malloc(max*sizeof(char *));
+  size_t *ln=(size_t *)mem_malloc(max*sizeof(size_t));
+  char *done=(char *)mem_malloc(max);
+  decoder_pt dc[nt];
+  size_t lno=0, i;
+  corpus_t c;
+  tag_job_t job={ m, dic, cs, bw, nbest, dc, &c, NULL, sc ? done : NULL };
+
+  for (i=0; i<nt; i++) { dc[i]=decoder_new(m, nbest ? bw : 0, g->memo_size/nt); }
+  memset(ls, 0, max*sizeof(char *));
+  memset(ln, 0, max*sizeof(size_t));
+  corpus_init(&c);
+  while (read_round(rf, m, &c, ls, ln, max, 0, &lno)>0)
+    {
+      /* the tags go where the input has none */
+      job.ts=c.ts;
+      for (i=0; sc && i<c.no_sts; i++)
+	{
+	  size_t b=c.st[i];
+	  const int *ct=sentcache_get(sc, c.ws+b, c.st[i+1]-b);
+
+	  done[i]= ct!=NULL;
+	  if (ct) { memcpy(c.ts+b, ct, (c.st[i+1]-b)*sizeof(int)); }
 	}
-      if (wdc<=0) { continue; }
+      parallel_run(nt, tag_worker, &job);
+      for (i=0; i<c.no_sts; i++)
+	{
+	  size_t b=c.st[i], j;
 
-      if (nbest) { tag_sentence(m, dic, cs, ts, ws, wdc, bw); }
-      else { viterbi(m, dic, cs, ts, ws, wdc, bw); }
+	  if (sc && !done[i]) { sentcache_put(sc, c.ws+b, c.st[i+1]-b, c.ts+b, c.st[i+1]-b); }
+	  for (j=b; j<c.st[i+1]; j++)
+	    {
+	      if (j!=b) { fprintf(stdout, " "); }
+	      fprintf(stdout, "%s %s", c.ws[j], (char *)array_get(m->outcomes, c.ts[j]));
+	    }
+	  fprintf(stdout, "\n");
+	}
+    }
+  if (sc)
+    {
+      sentcache_report(sc, 1);
+      sentcache_delete(sc);
+    }
+  decoders_delete(dc, nt);
+  for (i=0; i<max; i++) { if (ls[i]) { free(ls[i]); } }
+  mem_free(ls);
+  mem_free(ln);
+  mem_free(done);
+  corpus_free(&c);
+}
 
-      for (i=0; i<wdc; i++)
+/* ------------------------------------------------------------ */
+static void testing(FILE *mf, FILE *df, FILE *rf, double pt, size_t bw, size_t cs, size_t nbest,
+		    size_t nt)
+{
+  model_pt m=read_model_file(mf, 0);
+  hash_pt dic=df ? read_dictionary_file(m, df, cs) : binary_dictionary(m, cs);
+  size_t max=TAG_ROUND_SENTENCES*nt;
+  char **ls=(char **)mem_malloc(max*sizeof(char *));
+  size_t *ln=(size_t *)mem_malloc(max*sizeof(size_t));
+  decoder_pt dc[nt];
+  int *ts=NULL;
+  size_t ts_size=0, pos=0, neg=0, lno=0, no_sts=0, i;
+  corpus_t c;
+  tag_job_t job={ m, dic, cs, bw, nbest, dc, &c, NULL, NULL };
+
+  for (i=0; i<nt; i++) { dc[i]=decoder_new(m, nbest ? bw : 0, g->memo_size/nt); }
+  memset(ls, 0, max*sizeof(char *));
+  memset(ln, 0, max*sizeof(size_t));
+  corpus_init(&c);
+  while (read_round(rf, m, &c, ls, ln, max, 1, &lno)>0)
+    {
+      if (c.size>ts_size)
+	{
+	  ts_size=c.size;
+	  ts=(int *)mem_realloc(ts, ts_size*sizeof(int));
+	}
+      job.ts=ts;
+      parallel_run(nt, tag_worker, &job);
+      for (i=0; i<c.no_sts; i++)
 	{
-	  if (i!=0) { fprintf(stdout, " "); }
-	  fprintf(stdout, "%s %s", ws[i], (char *)array_get(m->outcomes, ts[i]));
+	  size_t j;
+
+	  no_sts++;
+	  report(-3, "%8d sentences\r", no_sts);
+	  for (j=c.st[i]; j<c.st[i+1]; j++)
+	    {
+	      if (ts[j]==c.ts[j]) { pos++; }
+	      else
+		{
+		  report(4, "ERROR: %s ref %s guess %s\n", c.ws[j],
+			 (char *)array_get(m->outcomes, c.ts[j]),
+			 (char *)array_get(m->outcomes, ts[j]));
+		  neg++;
+		}
+	    }
 	}
-      fprintf(stdout, "\n");
     }
-  if(buf) {
-	  free(buf);
-	  buf = NULL;
-  }
-  mem_free(ws);
+  decoders_delete(dc, nt);
+  for (i=0; i<max; i++) { if (ls[i]) { free(ls[i]); } }
+  mem_free(ls);
+  mem_free(ln);
   mem_free(ts);
+  corpus_free(&c);
+
+  report(0, "%d (%d pos %d neg) words tagged, accuracy %7.3lf%%\n",
+ 	 pos+neg, pos, neg, 100.0*(double)pos/(double)(pos+neg));
 }
 
 /* ------------------------------------------------------------ */
-static void testing(FILE *mf, FILE *df, FILE *rf, double pt, size_t bw, size_t cs, size_t nbest)
+static void exporting(FILE *mf, FILE *df, FILE *xf, size_t cs)
 {
-  model_pt m=read_model_file(mf);
+  model_pt m=read_model_file(mf, 0);
   hash_pt dic=read_dictionary_file(m, df, cs);
-  size_t wcount=32, pos=0, neg=0, lno, no_sts=0;
-  char **ws=mem_malloc(sizeof(char *)*wcount);
-  int *ts=mem_malloc(sizeof(int)*wcount);
-  int *tref=mem_malloc(sizeof(int)*wcount);
+
+  if (((predindex_pt)m->userdata)->bin)
+    { error("model is already in binary format\n"); }
+  write_binary_model(xf, m, dic, cs, 0, NULL);
+  fclose(xf);
+}
+
+/* ------------------------------------------------------------ */
+static void read_corpus(FILE *f, model_pt m, corpus_pt c)
+{
+  char *buf=NULL;
+  size_t n=0, lno=0, unknown=0;
   ssize_t r;
-  char *s;
-  char *buf = NULL;
-  size_t n = 0;
 
-  memset(ws, 0, sizeof(char *)*wcount);
-  lno = 0;
-  while ((r = readline(&buf,&n,rf)) != -1)
+  corpus_init(c);
+  while ((r=readline(&buf, &n, f))!=-1)
     {
-      s = buf;
-      lno++;
-      if (r>0 && s[r-1]=='\n') s[r-1] = '\0';
-      if(r == 0) { continue; }
       char *w, *t;
-      size_t wdc, i;
-      
-      for (wdc=0, w=strtok(s, " \t"); w; wdc++, w=strtok(NULL, " \t"))
+
+      lno++;
+      if (r>0 && buf[r-1]=='\n') { buf[r-1]='\0'; }
+      for (w=strtok(buf, " \t"); w; w=strtok(NULL, " \t"))
 	{
-	  if (wdc>=wcount)
-	    {
-	      size_t oldcount=wcount;
-	      wcount*=2;
-	      ws=mem_realloc(ws, sizeof(char *)*wcount);
-	      memset(&ws[oldcount], 0, sizeof(char *)*(wcount-oldcount));
-	      ts=mem_realloc(ts, sizeof(int)*wcount);
-	      tref=mem_realloc(tref, sizeof(int)*wcount);
-	    }
+	  ptrdiff_t tg;
+
 	  t=strtok(NULL, " \t");
-	  if (!t)
-	    { report(0, "can't read tag %d in line %d\n", wdc, lno); break; }
-	  ws[wdc]=w;
-	  tref[wdc]=find_tag(t, m->outcomes);
+	  if (!t) { error("can't read tag in line %d\n", lno); }
+	  /* a tag the model never saw is -1, an error when tagging and a
+	     BOUNDARY in the history, as in read_round() */
+	  if ((tg=find_tag(t, m->outcomes))<0) { unknown++; }
+	  corpus_add_word(c, (char *)sregister_get(g->strings, w), tg);
 	}
-      if (wdc<=0) { continue; }
-	  
-      if (nbest) { tag_sentence(m, dic, cs, ts, ws, wdc, bw); }
-      else { viterbi(m, dic, cs, ts, ws, wdc, bw); }
+      corpus_end_sentence(c);
+    }
+  if (buf) { free(buf); }
+  report(1, "read %lu sentences, %lu words, %lu with unknown tags\n",
+	 (unsigned long)c->no_sts, (unsigned long)c->no_ws, (unsigned long)unknown);
+}
+
+/* ------------------------------------------------------------ */
+static double corpus_accuracy(model_pt m, hash_pt dic, size_t cs, corpus_pt c, int bw, size_t nt)
+{
+  decoder_pt dc[nt];
+  int *ts=(int *)mem_malloc((c->no_ws+1)*sizeof(int));
+  tag_job_t job={ m, dic, cs, bw, 0, dc, c, ts, NULL };
+  size_t pos=0, i;
+
+  for (i=0; i<nt; i++) { dc[i]=decoder_new(m, 0, g->memo_size/nt); }
+  parallel_run(nt, tag_worker, &job);
+  for (i=0; i<c->no_ws; i++) { if (ts[i]==c->ts[i]) { pos++; } }
+  decoders_delete(dc, nt);
+  mem_free(ts);
+  return c->no_ws ? (double)pos/(double)c->no_ws : 0.0;
+}
+
+/* ------------------------------------------------------------ */
+/* the alphas of the compressed model: keep[k] for the features with
+   |alpha|>=th, alpha[k] their value, rounded to multiples of a scale
+   per predicate so that they fit bits bit signed codes unless bits is
+   0; scale, if not NULL, gets the scales, which are floats as in the
+   binary model */
+static void compress_alphas(compiled_model_pt cm, double th, int bits,
+			    double alpha[], char keep[], float scale[])
+{
+  double levels= bits ? (double)((1<<(bits-1))-1) : 0.0;
+  size_t i;
+
+  for (i=0; i<cm->no_pds; i++)
+    {
+      double max=0.0, sc;
+      size_t k;
+
+      for (k=cm->pd_begin[i]; k<cm->pd_begin[i+1]; k++)
+	{
+	  keep[k]= fabs(cm->alpha[k])>=th;
+	  alpha[k]= keep[k] ? cm->alpha[k] : 0.0;
+	  if (fabs(alpha[k])>max) { max=fabs(alpha[k]); }
+	}
+      sc= bits ? (float)(max/levels) : 0.0;
+      if (scale) { scale[i]=sc; }
+      if (!bits || max==0.0) { continue; }
+      for (k=cm->pd_begin[i]; k<cm->pd_begin[i+1]; k++)
+	{ alpha[k]=sc*lrint(alpha[k]/sc); }
+    }
+}
+
+/* ------------------------------------------------------------ */
+/* cf_alpha of the compressed model, the one that minimizes the
+   cross entropy of its tag distributions relative to those of the
+   original model m in the contexts of the corpus, with the true tag
+   history; Newton's method, the objective is convex in cf_alpha and
+   it is unchanged for an unchanged model */
+#define CF_ITERATIONS 20
+
+static double estimate_cf_alpha(model_pt m, hash_pt dic, size_t cs, corpus_pt c,
+				const double alpha[], const char keep[])
+{
+  compiled_model_pt cm=m->compiled;
+  array_pt pds=array_new(32);
+  double *sc=(double *)mem_malloc(2*m->no_ocs*sizeof(double));
+  double *p=(double *)mem_malloc(2*m->no_ocs*sizeof(double));
+  int *n=(int *)mem_malloc(2*m->no_ocs*sizeof(int));
+  double *scn=sc+m->no_ocs, *pn=p+m->no_ocs;
+  int *nn=n+m->no_ocs;
+  double cf=m->cf_alpha;
+  int it;
+
+  for (it=0; it<CF_ITERATIONS; it++)
+    {
+      double d1=0.0, d2=0.0, step;
+      size_t i;
 
-      no_sts++;
-      report(-3, "%8d sentences\r", no_sts);
-      for (i=0; i<wdc; i++)
+      for (i=0; i<c->no_sts; i++)
 	{
-	  if (ts[i]==tref[i]) { pos++; }
-	  else
+	  size_t b=c->st[i], wno=c->st[i+1]-b;
+	  size_t k;
+
+	  for (k=0; k<wno; k++)
 	    {
-	      report(4, "ERROR: %s ref %s guess %s\n", ws[i], 
-		     (char *)array_get(m->outcomes, tref[i]),
-		     (char *)array_get(m->outcomes, ts[i])); 
-	      neg++;
+	      char *w[5];
+	      int t[2];
+	      double eo=0.0, en=0.0, en2=0.0;
+	      size_t j, r;
+
+	      context_words(w, c->ws+b, k, wno);
+	      t[0]= k>=2 ? c->ts[b+k-2] : -1;
+	      t[1]= k>=1 ? c->ts[b+k-1] : -1;
+	      array_clear(pds);
+	      add_context_predicates(pds, m, dic, w, cs);
+	      add_history_predicates(pds, m, t);
+	      for (j=0; j<2*m->no_ocs; j++) { sc[j]=0.0; n[j]=0; }
+	      for (j=0; j<array_count(pds); j++)
+		{
+		  predicate_pt pd=(predicate_pt)array_get(pds, j);
+
+		  for (r=cm->pd_begin[pd->id]; r<cm->pd_begin[pd->id+1]; r++)
+		    {
+		      int o=cm->oc[r];
+
+		      sc[o]+=cm->alpha[r]; n[o]++;
+		      if (keep[r]) { scn[o]+=alpha[r]; nn[o]++; }
+		    }
+		}
+	      (void)gis_softmax(p, sc, n, m->cf_alpha, m->max_pds, 0, m->no_ocs);
+	      (void)gis_softmax(pn, scn, nn, cf, m->max_pds, 0, m->no_ocs);
+	      for (j=0; j<m->no_ocs; j++)
+		{
+		  double f=m->max_pds-nn[j];
+		  eo+=p[j]*f; en+=pn[j]*f; en2+=pn[j]*f*f;
+		}
+	      d1+=eo-en;
+	      d2+=en2-en*en;
 	    }
 	}
+      if (d2<=0.0) { break; }
+      step=d1/d2;
+      cf+=step;
+      report(2, "%4d: cf_alpha %f\n", it+1, cf);
+      if (fabs(step)<1e-9) { break; }
     }
-  if(buf) {
-	  free(buf);
-	  buf = NULL;
-  }
-  mem_free(ws);
-  mem_free(ts);
-  mem_free(tref);
+  array_free(pds);
+  mem_free(sc);
+  mem_free(p);
+  mem_free(n);
+  return cf;
+}
 
-  report(0, "%d (%d pos %d neg) words tagged, accuracy %7.3lf%%\n",
- 	 pos+neg, pos, neg, 100.0*(double)pos/(double)(pos+neg));
+/* ------------------------------------------------------------ */
+/* sets the alphas of the features, drops those not kept and the
+   predicates left without any, and recompiles m */
+static void apply_alphas(model_pt m, const double alpha[], const char keep[])
+{
+  compiled_model_pt cm=m->compiled;
+  size_t k;
+
+  for (k=0; k<cm->no_fts; k++)
+    {
+      feature_pt ft=cm->fts[k];
+
+      if (keep[k]) { ft->alpha=alpha[k]; continue; }
+      array_set(ft->predicate->features, ft->outcome, NULL);
+      delete_feature(ft);
+      m->no_fts--;
+    }
+  for (k=0; k<array_count(m->predicates); k++)
+    {
+      predicate_pt pd=(predicate_pt)array_get(m->predicates, k);
+      size_t j;
+
+      for (j=0; j<m->no_ocs && !array_get(pd->features, j); j++) { /* nothing */ }
+      if (j==m->no_ocs) { array_free(pd->features); pd->features=NULL; }
+    }
+  array_filter(m->predicates, filter_and_delete_predicates);
+  delete_compiled_model(cm);
+  index_predicates(m);
+  m->compiled=compile_model(m, NULL);
+}
+
+/* ------------------------------------------------------------ */
+static double seconds(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+/* ------------------------------------------------------------ */
+/* writes m, pruned of features with |alpha|<th, with the alphas
+   quantized to bits bits unless 0, and cf_alpha re-estimated on the
+   tagged corpus rf, as binary model zfn, lexicon df included; nt
+   threads tag rf with it and with the binary model that exporting()
+   would write */
+static void compressing(FILE *mf, FILE *df, FILE *rf, const char *zfn, size_t cs, size_t bw,
+			double th, int bits, size_t nt)
+{
+  size_t size0, size1;
+  double t0, t1, a0, a1;
+  model_pt m, xm;
+  hash_pt dic=NULL;
+  corpus_t c;
+  double *alpha, cf;
+  float *scale=NULL;
+  char *keep;
+  FILE *xf, *zf;
+  size_t i;
+
+  m=read_model_file(mf, 1);
+  if (((predindex_pt)m->userdata)->bin)
+    { error("can't compress a binary model\n"); }
+  if (df) { dic=read_dictionary_file(m, df, cs); }
+  read_corpus(rf, m, &c);
+
+  /* the baseline is the model as -x exports it */
+  if (!(xf=tmpfile()))
+    { error("can't create temporary file: %s\n", strerror(errno)); }
+  size0=write_binary_model(xf, m, dic, cs, 0, NULL);
+  rewind(xf);
+  t0=seconds();
+  xm=read_model_file(xf, 0);
+  t0=seconds()-t0;
+  a0=corpus_accuracy(xm, binary_dictionary(xm, cs), cs, &c, bw, nt);
+  alpha=(double *)mem_malloc((m->compiled->no_fts+1)*sizeof(double));
+  keep=(char *)mem_malloc(m->compiled->no_fts+1);
+  compress_alphas(m->compiled, th, bits, alpha, keep, NULL);
+  cf=estimate_cf_alpha(m, dic, cs, &c, alpha, keep);
+  report(1, "cf_alpha re-estimated: %f, was %f\n", cf, m->cf_alpha);
+  i=m->no_fts;
+  apply_alphas(m, alpha, keep);
+  m->cf_alpha=m->compiled->cf_alpha=cf;
+  report(1, "%lu features with |alpha|<%g dropped, %d features and %lu predicates left\n",
+	 (unsigned long)(i-m->no_fts), th, m->no_fts, (unsigned long)array_count(m->predicates));
+  mem_free(alpha);
+  mem_free(keep);
+  if (bits)
+    {
+      /* the scales of the compiled model, the codes are the same */
+      scale=(float *)mem_malloc((m->compiled->no_pds+1)*sizeof(float));
+      alpha=(double *)mem_malloc((m->compiled->no_fts+1)*sizeof(double));
+      keep=(char *)mem_malloc(m->compiled->no_fts+1);
+      compress_alphas(m->compiled, 0.0, bits, alpha, keep, scale);
+      memcpy(m->compiled->alpha, alpha, m->compiled->no_fts*sizeof(double));
+      mem_free(alpha);
+      mem_free(keep);
+    }
+  zf=try_to_open((char *)zfn, "w");
+  size1=write_binary_model(zf, m, dic, cs, bits, scale);
+  fclose(zf);
+
+  /* what the compressed model does when it is used */
+  t1=seconds();
+  m=read_model_file(try_to_open((char *)zfn, "r"), 0);
+  t1=seconds()-t1;
+  a1=corpus_accuracy(m, binary_dictionary(m, cs), cs, &c, bw, nt);
+  report(0, "before: %10lu bytes, loaded in %8.3fs, accuracy %7.3f%%\n",
+	 (unsigned long)size0, t0, a0*100.0);
+  report(0, "after:  %10lu bytes, loaded in %8.3fs, accuracy %7.3f%%\n",
+	 (unsigned long)size1, t1, a1*100.0);
+  if (scale) { mem_free(scale); }
+  corpus_free(&c);
 }
 
 /* ------------------------------------------------------------ */
@@ -1593,7 +3463,20 @@ int main(int argc, char **argv)
   double P = -1.0;
   long K = 19;
   double M = 0.0;
+  unsigned long c = 0;
+  unsigned long mm = 0;
+  unsigned long j = 1;
+  int L = 0;
+  double G = 0.0;
   char *l = NULL;
+  char *x = NULL;
+  unsigned long H = 0;
+  char *E = NULL;
+  char *W = NULL;
+  unsigned long S = 0;
+  char *z = NULL;
+  double a = 0.0;
+  unsigned long q = 0;
   enum OPTION_OPERATION_MODE o = OPTION_OPERATION_TAG;
   option_callback_data_t cd = {
     &o,
@@ -1619,6 +3502,19 @@ int main(int argc, char **argv)
 		  { 'P', OPTION_DOUBLE, (void*)&P, "probability threshold [-1.0]" },
 		  { 'K', OPTION_SIGNED_LONG, (void*)&K, "priority class [19]" },
 		  { 'M', OPTION_DOUBLE, (void*)&M, "minimum improvement between iterations [0.0]" },
+		  { 'c', OPTION_UNSIGNED_LONG, (void*)&c, "sentence cache size in MB for tag mode [0, no cache]" },
+		  { 'm', OPTION_UNSIGNED_LONG, (void*)&mm, "probability memo size in MB for tag and test mode [0, no memo]" },
+		  { 'j', OPTION_UNSIGNED_LONG, (void*)&j, "number of threads [1]" },
+		  { 'L', OPTION_NONE, (void*)&L, "train with L-BFGS instead of GIS" },
+		  { 'G', OPTION_DOUBLE, (void*)&G, "variance of Gaussian prior for L-BFGS [0.0, no prior]" },
+		  { 'H', OPTION_UNSIGNED_LONG, (void*)&H, "hash word, prefix and suffix predicates into 2^H buckets, train mode [0, no hashing]" },
+		  { 'E', OPTION_STRING, (void*)&E, "keep the training events in this (temporary) file, train mode [none]" },
+		  { 'S', OPTION_UNSIGNED_LONG, (void*)&S, "count features in a sketch of 2^S counters per row first, train mode [0, no sketch]" },
+		  { 'W', OPTION_STRING, (void*)&W, "model to start training from, train mode [none]" },
+		  { 'x', OPTION_STRING, (void*)&x, "write model and lexicon in binary format to file and exit" },
+		  { 'z', OPTION_STRING, (void*)&z, "compress model and lexicon into binary file, tested on the input, and exit" },
+		  { 'a', OPTION_DOUBLE, (void*)&a, "drop features with smaller |alpha| when compressing [0.0]" },
+		  { 'q', OPTION_UNSIGNED_LONG, (void*)&q, "quantize alphas to 8 or 16 bits when compressing [0, no quantization]" },
 		  { '\0', OPTION_NONE, NULL, NULL }
 	  }
   };
@@ -1667,30 +3563,60 @@ int main(int argc, char **argv)
   g=new_globals(NULL);
   g->rwt = r;
   g->strings = sregister_new(500);
+  g->memo_size = mm*1024*1024;
 
   FILE *mf=NULL;
   FILE *df=NULL;
+  FILE *ef=NULL;
+  model_pt om=NULL;
   FILE *ipf=stdin;
 
+  if (z && !l) { error("can't compress without a lexicon (-l)\n"); }
   if (ipfn) { ipf=try_to_open(ipfn, "r"); }
+  if (x || z) { o=OPTION_OPERATION_DUMP; }
+  if (q!=0 && q!=8 && q!=16) { error("can't quantize to %lu bits\n", q); }
+  if (j==0) { j=1; }
 
   switch (o)
     {
+    case OPTION_OPERATION_DUMP:
+      mf=try_to_open(mfn, "r");
+      if (l) { df=try_to_open(l, "r"); }
+      if (z) { compressing(mf, df, ipf, z, C, b, a, q, j); }
+      else { exporting(mf, df, try_to_open(x, "w"), C); }
+      break;
     case OPTION_OPERATION_TAG:
       mf=try_to_open(mfn, "r");
       if (l) { df=try_to_open(l, "r"); }
-      tagging(mf, df, ipf, P, b, C, n);
+      tagging(mf, df, ipf, P, b, C, n, c, j);
       break;
     case OPTION_OPERATION_TEST:
       mf=try_to_open(mfn, "r");
       if (l) { df=try_to_open(l, "r"); }
-      testing(mf, df, ipf, P, b, C, n);
+      testing(mf, df, ipf, P, b, C, n, j);
       break;
     case OPTION_OPERATION_TRAIN:
       if (g->rwt == 0) { g->rwt=5; }
+      if (H>=8*sizeof(int)-1) { error("too many hash bits %lu\n", H); }
+      g->hash_bits = H;
+      /* before the model file is truncated, it may be the same */
+      if (W)
+	{
+	  om=read_model_file(try_to_open(W, "r"), 0);
+	  if (g->hash_bits!=H)
+	    { error("model to start from has %u hash bits, not %lu\n", g->hash_bits, H); }
+	}
+      if (S>=8*sizeof(int)-1) { error("too many sketch bits %lu\n", S); }
+      if (S>0 && f>1) { g->sketch=sketch_new(S, f); }
       mf=try_to_open(mfn, "w");
       if (l) { df=try_to_open(l, "w"); }
-      training(mf, df, ipf, i, M, f);
+      if (E)
+	{
+	  /* the file only lives as long as it is open */
+	  ef=try_to_open(E, "w+");
+	  if (unlink(E)<0) { report(0, "can't remove \"%s\": %s\n", E, strerror(errno)); }
+	}
+      training(mf, df, ipf, ef, om, i, M, f, j, L, G);
       break;
     default:
       report(0, "unknown mode of operation %d\n", o);
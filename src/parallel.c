@@ -0,0 +1,127 @@
+/*
+  Minimal helpers for running work on several threads
+
+  Copyright (c) 2007-2016, ACOPOST Developers Team
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in
+     the documentation and/or other materials provided with the
+     distribution.
+   * Neither the name of the ACOPOST Developers Team nor the names of
+     its contributors may be used to endorse or promote products
+     derived from this software without specific prior written
+     permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "config-common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "mem.h"
+#include "util.h"
+#include "parallel.h"
+
+/* ------------------------------------------------------------ */
+size_t parallel_shard_begin(size_t m, size_t id, size_t n)
+{
+  if (n==0) { return 0; }
+  /* avoid overflow of m*id for large inputs */
+  return (m/n)*id + ((m%n)*id)/n;
+}
+
+/* ------------------------------------------------------------ */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+
+typedef struct parallel_job_s
+{
+  size_t id;
+  size_t n;
+  parallel_worker_t worker;
+  void *data;
+} parallel_job_t;
+typedef parallel_job_t *parallel_job_pt;
+
+static void *parallel_trampoline(void *arg)
+{
+  parallel_job_pt job=(parallel_job_pt)arg;
+  job->worker(job->id, job->n, job->data);
+  return NULL;
+}
+
+int parallel_available(void)
+{
+  return 1;
+}
+
+void parallel_run(size_t n, parallel_worker_t worker, void *data)
+{
+  pthread_t *threads;
+  parallel_job_pt jobs;
+  size_t i;
+  int e;
+
+  if (n<=1) { worker(0, 1, data); return; }
+  threads=(pthread_t *)mem_malloc(n*sizeof(pthread_t));
+  jobs=(parallel_job_pt)mem_malloc(n*sizeof(parallel_job_t));
+  /* thread 0 is the calling thread */
+  for (i=0; i<n; i++)
+    {
+      jobs[i].id=i; jobs[i].n=n; jobs[i].worker=worker; jobs[i].data=data;
+      if (i==0) { continue; }
+      /* pthreads return the error instead of setting errno */
+      if ((e=pthread_create(&threads[i], NULL, parallel_trampoline, &jobs[i])))
+	{ error("can't create thread: %s\n", strerror(e)); }
+    }
+  worker(0, n, data);
+  for (i=1; i<n; i++)
+    {
+      if ((e=pthread_join(threads[i], NULL)))
+	{ error("can't join thread: %s\n", strerror(e)); }
+    }
+  mem_free(jobs);
+  mem_free(threads);
+}
+
+#else
+
+int parallel_available(void)
+{
+  return 0;
+}
+
+void parallel_run(size_t n, parallel_worker_t worker, void *data)
+{
+  size_t i;
+
+  if (n==0) { n=1; }
+  for (i=0; i<n; i++) { worker(i, n, data); }
+}
+
+#endif
+
+/* ------------------------------------------------------------ */
@@ -0,0 +1,61 @@
+/*
+  Minimal helpers for running work on several threads
+
+  Copyright (c) 2007-2016, ACOPOST Developers Team
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in
+     the documentation and/or other materials provided with the
+     distribution.
+   * Neither the name of the ACOPOST Developers Team nor the names of
+     its contributors may be used to endorse or promote products
+     derived from this software without specific prior written
+     permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h> /* for size_t. */
+
+/* ------------------------------------------------------------ */
+/* worker function: called once per thread with the thread id
+   (0..n-1), the total number of threads n and the shared data */
+typedef void (*parallel_worker_t)(size_t id, size_t n, void *data);
+
+/* ------------------------------------------------------------ */
+/* runs worker(id, n, data) for id=0..n-1 concurrently and waits
+   for all of them to finish; falls back to running them one after
+   the other if threads are not available. n==0 is treated as 1. */
+void parallel_run(size_t n, parallel_worker_t worker, void *data);
+
+/* returns the first index of shard id when splitting m items into
+   n contiguous shards of (almost) equal size */
+size_t parallel_shard_begin(size_t m, size_t id, size_t n);
+
+/* returns TRUE if parallel_run() really uses threads */
+int parallel_available(void);
+
+/* ------------------------------------------------------------ */
+#endif
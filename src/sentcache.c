@@ -0,0 +1,256 @@
+/*
+  Bounded cache of tag sequences for whole sentences
+
+  Copyright (c) 2007-2016, ACOPOST Developers Team
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in
+     the documentation and/or other materials provided with the
+     distribution.
+   * Neither the name of the ACOPOST Developers Team nor the names of
+     its contributors may be used to endorse or promote products
+     derived from this software without specific prior written
+     permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "config-common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mem.h"
+#include "util.h"
+#include "sentcache.h"
+
+/* ------------------------------------------------------------ */
+/*
+  Sentences are keyed by their tokens joined with single blanks,
+  so differences in white space don't matter. The full key is
+  stored with the tags, so a hash collision can't return the tags
+  of another sentence. Entries are kept in a hash table with
+  chaining and in a doubly linked list in order of last use.
+*/
+typedef struct sentcache_entry_s
+{
+  size_t hash;
+  struct sentcache_entry_s *chain;  /* next entry in bucket */
+  struct sentcache_entry_s *newer;  /* LRU list */
+  struct sentcache_entry_s *older;
+  size_t bytes;  /* memory used by this entry */
+  size_t nv;     /* number of tags */
+  size_t kl;     /* key length */
+  int *tags;
+  char *key;
+} sentcache_entry_t;
+typedef sentcache_entry_t *sentcache_entry_pt;
+
+struct sentcache_s
+{
+  size_t max;    /* maximum number of bytes */
+  size_t bytes;  /* number of bytes used */
+  size_t size;   /* number of buckets */
+  size_t count;  /* number of entries */
+  sentcache_entry_pt *buckets;
+  sentcache_entry_pt newest;
+  sentcache_entry_pt oldest;
+  size_t lookups, hits, evictions;
+};
+
+/* ------------------------------------------------------------ */
+/* FNV-1a over the tokens and the separating blanks */
+static size_t sentcache_hash(char **tokens, size_t nk, size_t *kl)
+{
+  size_t h=(size_t)14695981039346656037ULL;
+  size_t i, l=0;
+
+  for (i=0; i<nk; i++)
+    {
+      const unsigned char *s=(const unsigned char *)tokens[i];
+      if (i>0) { h^=' '; h*=(size_t)1099511628211ULL; l++; }
+      for (; *s; s++, l++) { h^=*s; h*=(size_t)1099511628211ULL; }
+    }
+  *kl=l;
+  return h;
+}
+
+/* ------------------------------------------------------------ */
+static int sentcache_key_equal(sentcache_entry_pt e, char **tokens, size_t nk)
+{
+  const char *k=e->key;
+  size_t i;
+
+  for (i=0; i<nk; i++)
+    {
+      size_t l=strlen(tokens[i]);
+      if (i>0) { if (*k!=' ') { return 0; } k++; }
+      if (strncmp(k, tokens[i], l)) { return 0; }
+      k+=l;
+    }
+  return *k=='\0';
+}
+
+/* ------------------------------------------------------------ */
+static void sentcache_unlink(sentcache_pt c, sentcache_entry_pt e)
+{
+  if (e->newer) { e->newer->older=e->older; } else { c->newest=e->older; }
+  if (e->older) { e->older->newer=e->newer; } else { c->oldest=e->newer; }
+  e->newer=e->older=NULL;
+}
+
+/* ------------------------------------------------------------ */
+static void sentcache_link(sentcache_pt c, sentcache_entry_pt e)
+{
+  e->older=c->newest;
+  e->newer=NULL;
+  if (c->newest) { c->newest->newer=e; } else { c->oldest=e; }
+  c->newest=e;
+}
+
+/* ------------------------------------------------------------ */
+static void sentcache_remove_oldest(sentcache_pt c)
+{
+  sentcache_entry_pt e=c->oldest, *p;
+
+  for (p=&c->buckets[e->hash%c->size]; *p!=e; p=&(*p)->chain) { /* nada */ }
+  *p=e->chain;
+  sentcache_unlink(c, e);
+  c->bytes-=e->bytes;
+  c->count--;
+  c->evictions++;
+  mem_free(e);
+}
+
+/* ------------------------------------------------------------ */
+static void sentcache_grow(sentcache_pt c)
+{
+  size_t size=2*c->size, i;
+  sentcache_entry_pt *buckets=(sentcache_entry_pt *)mem_malloc(size*sizeof(sentcache_entry_pt));
+
+  memset(buckets, 0, size*sizeof(sentcache_entry_pt));
+  for (i=0; i<c->size; i++)
+    {
+      sentcache_entry_pt e, next;
+      for (e=c->buckets[i]; e; e=next)
+	{
+	  next=e->chain;
+	  e->chain=buckets[e->hash%size];
+	  buckets[e->hash%size]=e;
+	}
+    }
+  c->bytes+=(size-c->size)*sizeof(sentcache_entry_pt);
+  mem_free(c->buckets);
+  c->buckets=buckets;
+  c->size=size;
+}
+
+/* ------------------------------------------------------------ */
+sentcache_pt sentcache_new(size_t bytes)
+{
+  sentcache_pt c=(sentcache_pt)mem_malloc(sizeof(sentcache_s));
+
+  memset(c, 0, sizeof(sentcache_s));
+  c->max=bytes;
+  c->size=1024;
+  c->buckets=(sentcache_entry_pt *)mem_malloc(c->size*sizeof(sentcache_entry_pt));
+  memset(c->buckets, 0, c->size*sizeof(sentcache_entry_pt));
+  c->bytes=sizeof(sentcache_s)+c->size*sizeof(sentcache_entry_pt);
+  return c;
+}
+
+/* ------------------------------------------------------------ */
+const int *sentcache_get(sentcache_pt c, char **tokens, size_t nk)
+{
+  size_t kl;
+  size_t h=sentcache_hash(tokens, nk, &kl);
+  sentcache_entry_pt e;
+
+  c->lookups++;
+  for (e=c->buckets[h%c->size]; e; e=e->chain)
+    {
+      if (e->hash!=h || e->kl!=kl || !sentcache_key_equal(e, tokens, nk)) { continue; }
+      c->hits++;
+      sentcache_unlink(c, e);
+      sentcache_link(c, e);
+      return e->tags;
+    }
+  return NULL;
+}
+
+/* ------------------------------------------------------------ */
+void sentcache_put(sentcache_pt c, char **tokens, size_t nk, const int *tags, size_t nv)
+{
+  size_t kl, i;
+  size_t h=sentcache_hash(tokens, nk, &kl);
+  size_t bytes=sizeof(sentcache_entry_t)+nv*sizeof(int)+kl+1;
+  sentcache_entry_pt e;
+  char *k;
+
+  if (c->bytes+bytes>c->max && c->count==0) { return; }
+  while (c->count>0 && c->bytes+bytes>c->max) { sentcache_remove_oldest(c); }
+  if (c->bytes+bytes>c->max) { return; }
+
+  e=(sentcache_entry_pt)mem_malloc(bytes);
+  e->hash=h;
+  e->bytes=bytes;
+  e->nv=nv;
+  e->kl=kl;
+  e->tags=(int *)(e+1);
+  memcpy(e->tags, tags, nv*sizeof(int));
+  e->key=(char *)(e->tags+nv);
+  for (k=e->key, i=0; i<nk; i++)
+    {
+      size_t l=strlen(tokens[i]);
+      if (i>0) { *k++=' '; }
+      memcpy(k, tokens[i], l);
+      k+=l;
+    }
+  *k='\0';
+
+  e->chain=c->buckets[h%c->size];
+  c->buckets[h%c->size]=e;
+  sentcache_link(c, e);
+  c->bytes+=bytes;
+  c->count++;
+  if (c->count>c->size && c->bytes+c->size*sizeof(sentcache_entry_pt)<=c->max)
+    { sentcache_grow(c); }
+}
+
+/* ------------------------------------------------------------ */
+void sentcache_report(sentcache_pt c, int mode)
+{
+  report(mode, "sentence cache: %lu of %lu sentences found (%.1f%%), %lu entries, %lu dropped, %lu bytes\n",
+	 (unsigned long)c->hits, (unsigned long)c->lookups,
+	 c->lookups>0 ? 100.0*(double)c->hits/(double)c->lookups : 0.0,
+	 (unsigned long)c->count, (unsigned long)c->evictions, (unsigned long)c->bytes);
+}
+
+/* ------------------------------------------------------------ */
+void sentcache_delete(sentcache_pt c)
+{
+  while (c->count>0) { sentcache_remove_oldest(c); }
+  mem_free(c->buckets);
+  mem_free(c);
+}
+
+/* ------------------------------------------------------------ */
@@ -0,0 +1,69 @@
+/*
+  Bounded cache of tag sequences for whole sentences
+
+  Copyright (c) 2007-2016, ACOPOST Developers Team
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in
+     the documentation and/or other materials provided with the
+     distribution.
+   * Neither the name of the ACOPOST Developers Team nor the names of
+     its contributors may be used to endorse or promote products
+     derived from this software without specific prior written
+     permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef SENTCACHE_H
+#define SENTCACHE_H
+
+#include <stddef.h> /* for size_t. */
+
+/* ------------------------------------------------------------ */
+struct sentcache_s;
+typedef struct sentcache_s sentcache_s, *sentcache_pt;
+
+/* ------------------------------------------------------------ */
+/* creates a new sentence cache that uses at most (approximately)
+   the given number of bytes; the least recently used sentences
+   are dropped when it is full
+   - maximum size in bytes
+*/
+sentcache_pt sentcache_new(size_t bytes);
+
+/* returns the tags stored for the sentence made of the nk tokens
+   (words, and for cooked input also their tags) or NULL; the
+   result is valid until the next call of sentcache_put() */
+const int *sentcache_get(sentcache_pt c, char **tokens, size_t nk);
+
+/* stores nv tags for the sentence made of the nk tokens */
+void sentcache_put(sentcache_pt c, char **tokens, size_t nk, const int *tags, size_t nv);
+
+/* reports hit rate and size */
+void sentcache_report(sentcache_pt c, int mode);
+
+/* deletes the cache */
+void sentcache_delete(sentcache_pt c);
+
+/* ------------------------------------------------------------ */
+#endif
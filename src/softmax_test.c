@@ -0,0 +1,181 @@
+/*
+  Accuracy and speed of the softmax kernel of acopost-met against libm
+
+  Copyright (c) 2007-2016, ACOPOST Developers Team
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in
+     the documentation and/or other materials provided with the
+     distribution.
+   * Neither the name of the ACOPOST Developers Team nor the names of
+     its contributors may be used to endorse or promote products
+     derived from this software without specific prior written
+     permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "array.h"
+#include "gis.h"
+#define N_SAMPLES 1000000
+#define N_OCS 300
+#define MAX_ULPS 2
+
+static double uniform(double lo, double hi)
+{
+	return lo + (hi - lo) * (rand() / (double)RAND_MAX);
+}
+
+// distance of a and b in units in the last place of b
+static double ulps(double a, double b)
+{
+	int e;
+	if (a == b) return 0.0;
+	frexp(b, &e);
+	return fabs(a - b) / ldexp(1.0, e - 53);
+}
+
+static int test_exp()
+{
+	double specials[] = { 0.0, -0.0, 1.0, -1.0, 1e-300, -1e-300,
+			      -708.0, 709.0, -708.5, 709.5, -745.2, 709.8,
+			      -1000.0, 1000.0, HUGE_VAL, -HUGE_VAL };
+	double max = 0.0, at = 0.0;
+	size_t i;
+	int res = 0;
+
+	for (i = 0; i < sizeof(specials)/sizeof(specials[0]); i++)
+	{
+		double x = specials[i];
+		if (gis_exp(x) != exp(x) && ulps(gis_exp(x), exp(x)) > MAX_ULPS)
+		{
+			printf("not ok: exp(%g) = %.17g, libm %.17g\n", x, gis_exp(x), exp(x));
+			res = 1;
+		}
+	}
+	if (!isnan(gis_exp(NAN)))
+	{
+		printf("not ok: exp(nan) is not nan\n");
+		res = 1;
+	}
+	for (i = 0; i < N_SAMPLES; i++)
+	{
+		double x = i % 2 ? uniform(-50.0, 50.0) : uniform(-708.0, 709.0);
+		double u = ulps(gis_exp(x), exp(x));
+		if (u > max) { max = u; at = x; }
+	}
+	printf("exp: at most %.2f ulps from libm (at %.17g)\n", max, at);
+	if (max > MAX_ULPS)
+	{
+		printf("not ok: more than %d ulps\n", MAX_ULPS);
+		res = 1;
+	}
+	if (!res) printf("ok\n");
+	return res;
+}
+
+static int test_softmax()
+{
+	double sc[N_OCS], p[N_OCS], q[N_OCS];
+	int n[N_OCS];
+	size_t no, j, r;
+	double max = 0.0;
+	int res = 0;
+
+	srand(2007);
+	for (r = 0; r < 1000; r++)
+	{
+		for (no = 1; no <= 7; no++)
+		{
+			double cf = uniform(-1.0, 1.0), psum = 0.0, s[2] = { 0.0, 0.0 }, ps;
+			int seen_only = r % 2;
+
+			for (j = 0; j < no; j++) { sc[j] = uniform(-30.0, 30.0); n[j] = rand() % 4; }
+			ps = gis_softmax(p, sc, n, cf, 20, seen_only, no);
+			for (j = 0; j < no; j++)
+			{
+				// the scalar path, summed like the kernel
+				q[j] = seen_only && !n[j] ? 0.0 : gis_exp(sc[j] + cf * (20 - n[j]));
+				s[j & 1] += q[j];
+			}
+			psum = s[0] + s[1];
+			if (ps != psum) res = 1;
+			for (j = 0; j < no; j++)
+			{
+				double l = seen_only && !n[j] ? 0.0 : exp(sc[j] + cf * (20 - n[j]));
+				if (psum > 0.0 && p[j] != q[j] * (1.0 / psum)) res = 1;
+				if (l > 0.0) { l = fabs(p[j] * psum - l) / l; if (l > max) max = l; }
+			}
+		}
+	}
+	printf("softmax: relative error at most %g\n", max);
+	if (res) printf("not ok: vector and scalar results differ\n");
+	if (max > 1e-14)
+	{
+		printf("not ok: relative error too large\n");
+		res = 1;
+	}
+	if (!res) printf("ok\n");
+	return res;
+}
+
+static void benchmark()
+{
+	static double sc[N_OCS], p[N_OCS];
+	static int n[N_OCS];
+	size_t rounds = N_SAMPLES / 10, i, j;
+	double sum = 0.0;
+	clock_t a, b, c;
+
+	for (j = 0; j < N_OCS; j++) { sc[j] = uniform(-30.0, 0.0); n[j] = j % 5; }
+	a = clock();
+	for (i = 0; i < rounds; i++)
+	{
+		double psum = 0.0;
+		sc[i % N_OCS] += 1e-9;
+		for (j = 0; j < N_OCS; j++) { p[j] = exp(sc[j] + 0.1 * (20 - n[j])); psum += p[j]; }
+		for (j = 0; j < N_OCS; j++) { p[j] /= psum; }
+		sum += p[0];
+	}
+	b = clock();
+	for (i = 0; i < rounds; i++)
+	{
+		sc[i % N_OCS] += 1e-9;
+		gis_softmax(p, sc, n, 0.1, 20, 0, N_OCS);
+		sum += p[0];
+	}
+	c = clock();
+	printf("%d outcomes: libm %.3fs, kernel %.3fs (%g)\n", N_OCS,
+	       (b - a) / (double)CLOCKS_PER_SEC, (c - b) / (double)CLOCKS_PER_SEC, sum);
+}
+
+int main(void)
+{
+	int res = test_exp() | test_softmax();
+	benchmark();
+	return res;
+}
@@ -75,6 +75,8 @@
 #include "mem.h"
 #include "sregister.h"
 #include "iregister.h"
+#include "parallel.h"
+#include "sentcache.h"
 
 /* on 64-bit systems, sizeof(void*) is different from
  * sizeof(int) so to make it compile silently we need to
@@ -882,120 +884,96 @@ prob_t *get_lexical_probs(model_pt m, char *s)
     }
 }
 
+/* ------------------------------------------------------------ */
+#define DEBUG_VITERBI 0
+
 /* ------------------------------------------------------------ */
 /*
-  Extend viterbi() so that it can also work in multiple-tags
-  mode.
-  - Add parameter ``prob_t probs[]''.
-  - if probs==NULL we are in best-sequence mode.
-  - if probs!=NULL we are in multi-tag mode
-    Probs is then a pre-allocated C-array of size not*wno.
-  - The probability that word w_i has tag t_j is stored in
-    probs[i*not+j].
-  - Change declaration of a to ``prob_t a[wno][not][not]''
-  - Adapt updating of nai and cai.
-  - When finished, the traverse b[][][] and a[][][] and enter
-    infos in probs.
+  One step of viterbi(): computes column cur (not*not states
+  <t_{i-1}, t_i>) from column prev and the lexical probs lp of
+  word i, bp receives the best t_{i-2} for every state. Columns
+  are normalized so that the best state is 0, so a column only
+  depends on the previous column and the word, not on the
+  absolute probability of the sentence prefix.
 */
-void viterbi(model_pt m, array_pt words, array_pt tags)
+static void viterbi_column(model_pt m, const prob_t *prev, const prob_t *lp,
+			   prob_t *cur, int *bp)
 {
-  size_t i, j, k, l, cai, nai=0;
   size_t not=iregister_get_length(m->tags);
-  size_t wno=array_count(words);
-  prob_t a[2][not][not];
-  array_pt b = array_new(wno);
+  size_t nn=not*not;
+  size_t j, k, l, s;
   prob_t max_a;
-  prob_t b_a=-MAXPROB;
-  ptrdiff_t b_i=1, b_j=1;
-  array_pt arr_b_i;
-  int *arr_b_k;
-  int *intarrs = calloc(wno*not*not, sizeof(int));
-
-  for (i = 0; i < wno; ++i) {
-	  array_pt b2 = array_new(not);
-	  array_set(b, i, (void*) b2);
-	  for (k = 0; k < not; ++k) {
-		  int *arr = intarrs + i*not + k*wno*not;
-		  array_set(b2, k, (void*) arr);
-	  }
-  }
+  prob_t max_a_new=-MAXPROB;
 
-#define DEBUG_VITERBI 0
-  for (j=0; j<not; j++)
-    { for (k=0; k<not; k++) { a[0][j][k]=-MAXPROB; } }
+  for (s=0; s<nn; s++) { cur[s]=-MAXPROB; bp[s]=0; }
 
-  a[0][0][0]=0.0;
-  max_a=0.0;
-  for (i=0; i<wno; i++)
+  /* TODO: precompute log(m->bw) */
+  if (m->bw==0) { max_a=-MAXPROB; } else { max_a=0.0; max_a-=log((prob_t)m->bw); }
+  for (l=0; l<not; l++)
     {
-      prob_t max_a_new=-MAXPROB;
-      char *w=(char *)array_get(words, i);
-      prob_t *lp=get_lexical_probs(m, w);
-
-      cai=i%2; nai= cai==0 ? 1 : 0;
-
-      /* clear next a column */
+      if (lp[l]==-MAXPROB) { continue; }
       for (j=0; j<not; j++)
-	{ for (k=0; k<not; k++) { a[nai][j][k]=-MAXPROB; } }
-
-      /* TODO: precompute log(m->bw) */
-      if (m->bw==0) { max_a=-MAXPROB; } else { max_a-=log((prob_t)m->bw); }
-      for (l=0; l<not; l++)
 	{
-	  if (lp[l]==-MAXPROB) { continue; }
-	  for (j=0; j<not; j++)
+	  for (k=0; k<not; k++)
 	    {
-	      for (k=0; k<not; k++)
-		{
-		  prob_t new;
-		  if (a[cai][j][k]<max_a) { continue; }
-		  new=a[cai][j][k] + m->tp[ ngram_index(2, not, j, k, l) ] + lp[l];
+	      prob_t new;
+	      if (prev[j*not+k]<max_a) { continue; }
+	      new=prev[j*not+k] + m->tp[ ngram_index(2, not, j, k, l) ] + lp[l];
 #if DEBUG_VITERBI
 #define TN(x) iregister_get_name(m->tags, x)
-		  report(-1, "Considering <%s-%s> --> <%s-%s> for %s\n",
-			 TN(j), TN(k), TN(k), TN(l), w);
-		  report(-1, "\ta(%s-%s)==%5.4e\n", TN(j), TN(k), a[cai][j][k]);
-		  report(-1, "\tlp(%s|%s)==%5.4e\n", TN(l), w, lp[l]);
-		  report(-1, "\ttp(%s-%s --> %s-%s)==%5.4e\n",
-			 TN(j), TN(k), TN(k), TN(l),
-			 m->tp[ ngram_index(2, not, j, k, l) ]);
-		  report(-1, "\t---> %5.4e\n", new);
+	      report(-1, "Considering <%s-%s> --> <%s-%s>\n",
+		     TN(j), TN(k), TN(k), TN(l));
+	      report(-1, "\ta(%s-%s)==%5.4e\n", TN(j), TN(k), prev[j*not+k]);
+	      report(-1, "\tlp(%s)==%5.4e\n", TN(l), lp[l]);
+	      report(-1, "\ttp(%s-%s --> %s-%s)==%5.4e\n",
+		     TN(j), TN(k), TN(k), TN(l),
+		     m->tp[ ngram_index(2, not, j, k, l) ]);
+	      report(-1, "\t---> %5.4e\n", new);
 #endif
-		  if (new>a[nai][k][l])
-		    {
-		      a[nai][k][l]=new;
-		      arr_b_i = (array_pt) array_get(b, i);
-		      arr_b_k = (int*) array_get(arr_b_i, k);
-		      arr_b_k[l]=j;
-		      if (new>max_a_new) { max_a_new=new; }
-		    }
+	      if (new>cur[k*not+l])
+		{
+		  cur[k*not+l]=new;
+		  bp[k*not+l]=j;
+		  if (new>max_a_new) { max_a_new=new; }
 		}
 	    }
 	}
-      max_a=max_a_new;
     }
+  if (max_a_new==-MAXPROB) { return; }
+  for (s=0; s<nn; s++)
+    { if (cur[s]>-MAXPROB) { cur[s]-=max_a_new; } }
+}
+
+/* ------------------------------------------------------------ */
+/* finds the best final state in column last and follows the
+   backpointers bp (wno columns of not*not) to fill tags */
+static void viterbi_backtrace(model_pt m, const prob_t *last, const int *bp,
+			      size_t wno, array_pt tags)
+{
+  size_t not=iregister_get_length(m->tags);
+  prob_t b_a=-MAXPROB;
+  ptrdiff_t b_i=1, b_j=1;
+  size_t i, j;
 
   /* find highest prob in last column */
   for (i=0; i<not; i++)
     {
-      size_t j;
       for (j=0; j<not; j++)
 	{
 	  /*
 	    FIXME:
 	    Should we use bigrams here? Cf. Brants (2000) page 1.
-	    prob_t new=a[nai][i][j] + m->tp[ ngram_index(1, not, j, 0, -1) ];	  
+	    prob_t new=last[i*not+j] + m->tp[ ngram_index(1, not, j, 0, -1) ];
 	  */
-	  prob_t new=a[nai][i][j] + m->tp[ ngram_index(2, not, i, j, 0) ];
+	  prob_t new=last[i*not+j] + m->tp[ ngram_index(2, not, i, j, 0) ];
 #if DEBUG_VITERBI
-	  if (a[nai][i][j]>-MAXPROB)
+	  if (last[i*not+j]>-MAXPROB)
 	    {
 	      report(-1, "Considering <%s-%s> as best final state\n", TN(i), TN(j));
-	      report(-1, "\ta(%s-%s)==%5.4e\n", TN(i), TN(j), a[nai][i][j]);
+	      report(-1, "\ta(%s-%s)==%5.4e\n", TN(i), TN(j), last[i*not+j]);
 	      report(-1, "\ttp(%s-%s --> %s-%s)==%5.4e\n",
 		     TN(i), TN(j), TN(j), "NULL", m->tp[ ngram_index(2, not, i, j, 0) ]);
-	      report(-1, "\t---> %5.4e\n",
-		     a[nai][i][j] * m->tp[ ngram_index(2, not, i, j, 0) ]);
+	      report(-1, "\t---> %5.4e\n", new);
 	    }
 #endif
 	  if (new>b_a) { b_a=new; b_i=i; b_j=j; }
@@ -1011,102 +989,617 @@ void viterbi(model_pt m, array_pt words, array_pt tags)
   /* best final state is (b_i, b_j) */
   for (i=wno; i>0; )
     {
-            i--;
-	    arr_b_i = (array_pt) array_get(b, i);
-	    arr_b_k = (int*) array_get(arr_b_i, b_i);
-	    size_t tmp=arr_b_k[b_j];
+      size_t tmp;
+      i--;
+      tmp=bp[i*not*not + b_i*not + b_j];
       array_set(tags, i, (void *)b_j);
       b_j=b_i;
       b_i=tmp;
     }
+}
 
-  for (i = 0; i < wno; ++i) {
-	  array_pt b2 = array_get(b, i);
-	  array_free(b2);
-  }
+/* ------------------------------------------------------------ */
+/*
+  Extend viterbi() so that it can also work in multiple-tags
+  mode.
+  - Add parameter ``prob_t probs[]''.
+  - if probs==NULL we are in best-sequence mode.
+  - if probs!=NULL we are in multi-tag mode
+    Probs is then a pre-allocated C-array of size not*wno.
+  - The probability that word w_i has tag t_j is stored in
+    probs[i*not+j].
+  - Keep all columns like viterbi_retag() does.
+  - When finished, traverse the backpointers and columns and
+    enter infos in probs.
+*/
+void viterbi(model_pt m, array_pt words, array_pt tags)
+{
+  size_t i, s;
+  size_t not=iregister_get_length(m->tags);
+  size_t nn=not*not;
+  size_t wno=array_count(words);
+  prob_t a[2][nn];
+  int *bp;
+
+  if (wno==0) { return; }
+  bp=(int *)mem_malloc(wno*nn*sizeof(int));
+  for (s=0; s<nn; s++) { a[1][s]=-MAXPROB; }
+  a[1][0]=0.0;
+  for (i=0; i<wno; i++)
+    {
+      char *w=(char *)array_get(words, i);
+      viterbi_column(m, a[(i+1)%2], get_lexical_probs(m, w), a[i%2], bp+i*nn);
+    }
+  viterbi_backtrace(m, a[(wno-1)%2], bp, wno, tags);
+  mem_free(bp);
+}
+
+/* ------------------------------------------------------------ */
+typedef struct viterbi_state_s
+{
+  size_t size;      /* number of columns allocated */
+  size_t wno;       /* length of the previous sentence */
+  prob_t **lps;     /* lexical probs of its words */
+  prob_t *a;        /* all its columns, size*not*not */
+  int *bp;          /* all its backpointers, size*not*not */
+  prob_t *init;     /* column before the first word */
+  prob_t *tmp_a;    /* scratch column */
+  int *tmp_bp;      /* scratch backpointers */
+  size_t computed;  /* number of columns computed */
+  size_t total;     /* number of columns asked for */
+} viterbi_state_t;
+typedef viterbi_state_t *viterbi_state_pt;
+
+/* ------------------------------------------------------------ */
+static viterbi_state_pt viterbi_state_new(model_pt m)
+{
+  size_t nn=iregister_get_length(m->tags)*iregister_get_length(m->tags);
+  viterbi_state_pt st=(viterbi_state_pt)mem_malloc(sizeof(viterbi_state_t));
+  size_t s;
+
+  memset(st, 0, sizeof(viterbi_state_t));
+  st->init=(prob_t *)mem_malloc(nn*sizeof(prob_t));
+  for (s=0; s<nn; s++) { st->init[s]=-MAXPROB; }
+  st->init[0]=0.0;
+  st->tmp_a=(prob_t *)mem_malloc(nn*sizeof(prob_t));
+  st->tmp_bp=(int *)mem_malloc(nn*sizeof(int));
+  return st;
+}
+
+/* ------------------------------------------------------------ */
+static void viterbi_state_delete(viterbi_state_pt st)
+{
+  mem_free(st->lps);
+  mem_free(st->a);
+  mem_free(st->bp);
+  mem_free(st->init);
+  mem_free(st->tmp_a);
+  mem_free(st->tmp_bp);
+  mem_free(st);
+}
+
+/* ------------------------------------------------------------ */
+/*
+  Same result as viterbi(), but for a sentence that is an edited
+  version of the one from the previous call with the same st.
+  A column only depends on the previous column and the lexical
+  probs of its word (see viterbi_column()), so columns are only
+  recomputed from the first word with different lexical probs.
+  Once the remaining words are the old ones, a recomputed column
+  that is equal to the old one means that all following columns
+  are the old ones as well.
+*/
+void viterbi_retag(model_pt m, viterbi_state_pt st, array_pt words, array_pt tags)
+{
+  size_t not=iregister_get_length(m->tags);
+  size_t nn=not*not;
+  size_t wno=array_count(words), owno=st->wno;
+  size_t p, q, i, from, to;
+  prob_t **lps;
+
+  if (wno>st->size)
+    {
+      size_t size=wno+wno/2;
+      st->lps=(prob_t **)mem_realloc(st->lps, size*sizeof(prob_t *));
+      st->a=(prob_t *)mem_realloc(st->a, size*nn*sizeof(prob_t));
+      st->bp=(int *)mem_realloc(st->bp, size*nn*sizeof(int));
+      st->size=size;
+    }
+  lps=(prob_t **)mem_malloc((wno+1)*sizeof(prob_t *));
+  for (i=0; i<wno; i++) { lps[i]=get_lexical_probs(m, (char *)array_get(words, i)); }
+
+  /* common prefix and suffix with the previous sentence */
+  for (p=0; p<wno && p<owno && lps[p]==st->lps[p]; p++) { /* nada */ }
+  for (q=0; q<wno-p && q<owno-p && lps[wno-1-q]==st->lps[owno-1-q]; q++) { /* nada */ }
+
+  /* move the old columns after the prefix where the new ones
+     for the same words will be, i.e. by wno-owno */
+  from= wno>=owno ? p : p+owno-wno;
+  to=from+wno-owno;
+  if (from<owno)
+    {
+      memmove(st->a+to*nn, st->a+from*nn, (owno-from)*nn*sizeof(prob_t));
+      memmove(st->bp+to*nn, st->bp+from*nn, (owno-from)*nn*sizeof(int));
+    }
+
+  for (i=p; i<wno; i++)
+    {
+      const prob_t *prev= i==0 ? st->init : st->a+(i-1)*nn;
+      int same;
+
+      viterbi_column(m, prev, lps[i], st->tmp_a, st->tmp_bp);
+      st->computed++;
+      same= i+q+1>=wno && i>=to && i<owno+to-from &&
+	!memcmp(st->tmp_a, st->a+i*nn, nn*sizeof(prob_t));
+      memcpy(st->a+i*nn, st->tmp_a, nn*sizeof(prob_t));
+      memcpy(st->bp+i*nn, st->tmp_bp, nn*sizeof(int));
+      if (same) { break; }
+    }
+  st->total+=wno;
+
+  mem_free(st->lps);
+  st->lps=lps;
+  st->wno=wno;
+  if (wno>0) { viterbi_backtrace(m, st->a+(wno-1)*nn, st->bp, wno, tags); }
+}
+
+/* ------------------------------------------------------------ */
+/* expected counts collected by one thread during the E-step */
+typedef struct em_counts_s
+{
+  double *uni;     /* expected unigram counts */
+  double *bi;      /* expected bigram counts */
+  double *tri;     /* expected trigram counts */
+  hash_pt lex;     /* word -> expected tag counts (double[not]) */
+  double ll;       /* log-likelihood */
+  size_t words;    /* number of words seen */
+  size_t skipped;  /* number of sentences with zero probability */
+} em_counts_t;
+typedef em_counts_t *em_counts_pt;
+
+/* per-thread scratch memory for forward_backward() */
+typedef struct em_workspace_s
+{
+  double *init;    /* start column, only <0, 0> is set */
+  double *alpha;   /* scaled forward probs, wno*not*not */
+  double *beta;    /* scaled backward probs, wno*not*not */
+  double *emit;    /* lexical probs, wno*not */
+  double *scale;   /* forward scaling factors, wno */
+} em_workspace_t;
+typedef em_workspace_t *em_workspace_pt;
+
+/* data shared by all threads during the E-step */
+typedef struct em_job_s
+{
+  model_pt m;
+  double *tpe;          /* exp() of the transition probs */
+  array_pt sentences;   /* arrays of words */
+  em_counts_pt counts;  /* one set of counts per thread */
+} em_job_t;
+typedef em_job_t *em_job_pt;
+
+/* ------------------------------------------------------------ */
+static void em_counts_init(em_counts_pt c, size_t not)
+{
+  c->uni=(double *)mem_malloc(not*sizeof(double));
+  memset(c->uni, 0, not*sizeof(double));
+  c->bi=(double *)mem_malloc(not*not*sizeof(double));
+  memset(c->bi, 0, not*not*sizeof(double));
+  c->tri=(double *)mem_malloc(not*not*not*sizeof(double));
+  memset(c->tri, 0, not*not*not*sizeof(double));
+  c->lex=hash_new(5000, .5, hash_string_hash, hash_string_equal);
+  c->ll=0.0;
+  c->words=0;
+  c->skipped=0;
+}
+
+/* ------------------------------------------------------------ */
+static void em_free_lex_entry(void *key, void *value)
+{
+  (void)key;
+  mem_free(value);
+}
 
-  free(intarrs);
-  array_free(b);
+/* ------------------------------------------------------------ */
+static void em_counts_free(em_counts_pt c)
+{
+  mem_free(c->uni);
+  mem_free(c->bi);
+  mem_free(c->tri);
+  hash_map(c->lex, em_free_lex_entry);
+  hash_delete(c->lex);
 }
 
+/* ------------------------------------------------------------ */
+static double *em_lex_counts(em_counts_pt c, char *w, size_t not)
+{
+  double *e=(double *)hash_get(c->lex, w);
+
+  if (!e)
+    {
+      e=(double *)mem_malloc(not*sizeof(double));
+      memset(e, 0, not*sizeof(double));
+      hash_put(c->lex, w, e);
+    }
+  return e;
+}
 
-#if 0
 /* ------------------------------------------------------------ */
-void forward_backward(model_pt m, array_pt words, array_pt tags)
+/*
+  E-step for one sentence: forward and backward probabilities
+  over states <t_{i-1}, t_i> like in viterbi(), but summing
+  instead of maximizing. Each column is rescaled to avoid
+  underflows. The posteriors are added to the expected counts
+  in c: unigrams for every position, bigrams from the second
+  and trigrams from the third word on, i.e. without the
+  boundary tag, just like acopost-cooked2ngram counts them.
+
+  Only reads from the model, so it can run on several threads
+  as long as each thread has its own c and ws.
+*/
+static void forward_backward(model_pt m, const double *tpe, array_pt words,
+			     em_counts_pt c, em_workspace_pt ws)
 {
   size_t not=iregister_get_length(m->tags);
+  size_t nn=not*not;
   size_t wno=array_count(words);
-  /* forward probs alpha */
-  prob_t a[wno+2][not][not];
-  /* backward probs beta */
-  prob_t b[wno+2][not][not];
-  prob_t max_a;
-  prob_t b_a=-MAXPROB;
-  ptrdiff_t i, j, k, l;
+  double *alpha=ws->alpha, *beta=ws->beta, *emit=ws->emit, *scale=ws->scale;
+  double ll=0.0, z;
+  size_t i, j, k, l, s;
 
-#define DEBUG_ML 0
-  /* forward variables */
-  for (j=0; j<not; j++)
-    { for (k=0; k<not; k++) { a[0][j][k]=-MAXPROB; } }
-  a[0][0][0]=0.0;
+  if (wno==0) { return; }
   for (i=0; i<wno; i++)
     {
-      size_t ip=i+1;
-      char *w=(char *)array_get(words, i);
-      prob_t *lp=get_lexical_probs(m, w);
+      prob_t *lp=get_lexical_probs(m, (char *)array_get(words, i));
+      double *e=emit+i*not;
+
+      e[0]=0.0;
+      for (l=1; l<not; l++) { e[l]= lp[l]==-MAXPROB ? 0.0 : exp(lp[l]); }
+    }
 
-      /* clear next a column */
-      for (k=0; k<not; k++)
-	{ for (l=0; l<not; l++) { a[ip][k][l]=-MAXPROB; } }
+  /* forward variables */
+  for (i=0; i<wno; i++)
+    {
+      const double *prev= i==0 ? ws->init : alpha+(i-1)*nn;
+      const double *e=emit+i*not;
+      double *cur=alpha+i*nn;
+      double sum=0.0;
 
-      for (l=0; l<not; l++)
+      memset(cur, 0, nn*sizeof(double));
+      for (j=0; j<not; j++)
 	{
-	  if (lp[l]==-MAXPROB) { continue; }
 	  for (k=0; k<not; k++)
 	    {
-	      prob_t new=-MAXPROB;
-	      for (j=0; j<not; j++)
-		{
-		  prob_t a_ijk=a[i][j][k];
-		  prob_t tp=m->tp[ ngram_index(2, not, j, k, l) ];
-		  new=log_prob_add(new, a_ijk+tp);
-		}
-	      a[ip][k][l]=new + lp[l];
+	      double p=prev[j*not+k];
+	      const double *row=tpe+(j*not+k)*not;
+	      double *out=cur+k*not;
+
+	      if (p==0.0) { continue; }
+	      for (l=1; l<not; l++) { out[l]+=p*row[l]; }
 	    }
 	}
+      for (s=0; s<nn; s++) { cur[s]*=e[s%not]; sum+=cur[s]; }
+      if (sum<=0.0) { c->skipped++; return; }
+      for (s=0; s<nn; s++) { cur[s]/=sum; }
+      scale[i]=sum;
+      ll+=log(sum);
     }
-  /* backward variables */
-  for (j=0; j<not; j++)
-    { for (k=0; k<not; k++) { b[wno+1][j][k]=-MAXPROB; } }
-  b[wno+1][0][0]=0.0;
-  for (i=wno-1; i>=0; i--)
+
+  /* backward variables, starting with the final boundary tag */
+  z=0.0;
+  for (s=0; s<nn; s++)
     {
-      size_t ip=i+1;
-      char *w=(char *)array_get(words, i);
-      prob_t *lp=get_lexical_probs(m, w);
+      double a=alpha[(wno-1)*nn+s];
+      beta[(wno-1)*nn+s]= a>0.0 ? tpe[s*not] : 0.0;
+      z+=a*beta[(wno-1)*nn+s];
+    }
+  if (z<=0.0) { c->skipped++; return; }
+  ll+=log(z);
+  for (i=wno-1; i>0; i--)
+    {
+      const double *next=beta+i*nn, *e=emit+i*not, *a=alpha+(i-1)*nn;
+      double *cur=beta+(i-1)*nn;
+      double sum=0.0;
 
-      /* clear next a column */
-      for (k=0; k<not; k++)
-	{ for (l=0; l<not; l++) { b[ip][k][l]=-MAXPROB; } }
+      for (s=0; s<nn; s++)
+	{
+	  double b=0.0;
+	  if (a[s]>0.0)
+	    {
+	      const double *row=tpe+s*not, *nb=next+(s%not)*not;
+	      for (l=1; l<not; l++) { b+=row[l]*e[l]*nb[l]; }
+	    }
+	  cur[s]=b;
+	  sum+=b;
+	}
+      if (sum>0.0) { for (s=0; s<nn; s++) { cur[s]/=sum; } }
+    }
+
+  /* posteriors */
+  for (i=0; i<wno; i++)
+    {
+      const double *a=alpha+i*nn, *b=beta+i*nn;
+      double *lex=em_lex_counts(c, (char *)array_get(words, i), not);
+      double g=0.0;
 
-      for (l=0; l<not; l++)
+      for (s=0; s<nn; s++) { g+=a[s]*b[s]; }
+      if (g<=0.0) { continue; }
+      for (s=0; s<nn; s++)
 	{
-	  if (lp[l]==-MAXPROB) { continue; }
-	  for (k=0; k<not; k++)
+	  double p=a[s]*b[s]/g;
+	  if (p==0.0) { continue; }
+	  c->uni[s%not]+=p;
+	  lex[s%not]+=p;
+	  if (i>0) { c->bi[s]+=p; }
+	}
+      if (i>1)
+	{
+	  const double *pa=alpha+(i-1)*nn, *e=emit+i*not;
+	  double norm=scale[i]*g;
+
+	  for (s=0; s<nn; s++)
 	    {
-	      prob_t new=-MAXPROB;
-	      for (j=0; j<not; j++)
-		{
-		  prob_t a_ijk=a[i][j][k];
-		  prob_t tp=m->tp[ ngram_index(2, not, j, k, l) ];
-		  new=log_prob_add(new, a_ijk+tp);
-		}
-	      a[ip][k][l]=new + lp[l];
+	      double p=pa[s];
+	      const double *row=tpe+s*not, *bk=b+(s%not)*not;
+	      double *out=c->tri+s*not;
+
+	      if (p==0.0) { continue; }
+	      p/=norm;
+	      for (l=1; l<not; l++) { out[l]+=p*row[l]*e[l]*bk[l]; }
 	    }
 	}
     }
+  c->ll+=ll;
+  c->words+=wno;
+}
+
+/* ------------------------------------------------------------ */
+static void em_worker(size_t id, size_t n, void *data)
+{
+  em_job_pt job=(em_job_pt)data;
+  size_t not=iregister_get_length(job->m->tags);
+  size_t no=array_count(job->sentences);
+  size_t from=parallel_shard_begin(no, id, n);
+  size_t to=parallel_shard_begin(no, id+1, n);
+  size_t i, max=1;
+  em_workspace_t ws;
+
+  for (i=from; i<to; i++)
+    {
+      size_t wno=array_count((array_pt)array_get(job->sentences, i));
+      if (wno>max) { max=wno; }
+    }
+  ws.init=(double *)mem_malloc(not*not*sizeof(double));
+  memset(ws.init, 0, not*not*sizeof(double));
+  ws.init[0]=1.0;
+  ws.alpha=(double *)mem_malloc(max*not*not*sizeof(double));
+  ws.beta=(double *)mem_malloc(max*not*not*sizeof(double));
+  ws.emit=(double *)mem_malloc(max*not*sizeof(double));
+  ws.scale=(double *)mem_malloc(max*sizeof(double));
+
+  for (i=from; i<to; i++)
+    {
+      array_pt words=(array_pt)array_get(job->sentences, i);
+      forward_backward(job->m, job->tpe, words, &job->counts[id], &ws);
+    }
+
+  mem_free(ws.init);
+  mem_free(ws.alpha);
+  mem_free(ws.beta);
+  mem_free(ws.emit);
+  mem_free(ws.scale);
+}
+
+/* ------------------------------------------------------------ */
+static void em_merge_lex_entry(void *key, void *value, void *d1, void *d2)
+{
+  em_counts_pt c=(em_counts_pt)d1;
+  size_t not=*(size_t *)d2;
+  double *from=(double *)value;
+  double *to=em_lex_counts(c, (char *)key, not);
+  size_t i;
+
+  for (i=0; i<not; i++) { to[i]+=from[i]; }
+}
+
+/* ------------------------------------------------------------ */
+/* adds the counts of all threads to the first one, in thread order */
+static void em_reduce(em_counts_pt counts, size_t n, size_t not)
+{
+  em_counts_pt c=&counts[0];
+  size_t t, i;
+
+  for (t=1; t<n; t++)
+    {
+      em_counts_pt o=&counts[t];
+      for (i=0; i<not; i++) { c->uni[i]+=o->uni[i]; }
+      for (i=0; i<not*not; i++) { c->bi[i]+=o->bi[i]; }
+      for (i=0; i<not*not*not; i++) { c->tri[i]+=o->tri[i]; }
+      hash_map2(o->lex, em_merge_lex_entry, c, &not);
+      c->ll+=o->ll;
+      c->words+=o->words;
+      c->skipped+=o->skipped;
+    }
+}
+
+/* ------------------------------------------------------------ */
+static int em_round(double x)
+{
+  return (int)floor(x+0.5);
+}
+
+/* ------------------------------------------------------------ */
+static int em_strcmp(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* ------------------------------------------------------------ */
+/*
+  M-step: supervised counts of the base model plus the rounded
+  expected counts c (indexed by the tags of model cur) are
+  written as new n-gram and lexicon files in the formats of
+  acopost-cooked2ngram and acopost-cooked2lex. Counts are
+  raised where needed to keep uni-, bi- and trigrams
+  consistent, otherwise compute_counts_for_boundary() would
+  produce negative counts.
+*/
+static void em_write_model(model_pt base, model_pt cur, em_counts_pt c,
+			   const char *nf, const char *lf)
+{
+  size_t not=iregister_get_length(base->tags);
+  size_t nn=not*not;
+  int *uni=(int *)mem_malloc(not*sizeof(int));
+  int *bi=(int *)mem_malloc(nn*sizeof(int));
+  int *tri=(int *)mem_malloc(nn*not*sizeof(int));
+  int *tc=(int *)mem_malloc(not*sizeof(int));
+  size_t *map=(size_t *)mem_malloc(not*sizeof(size_t));
+  size_t *order=(size_t *)mem_malloc(not*sizeof(size_t));
+  size_t *sel=(size_t *)mem_malloc(not*sizeof(size_t));
+  const char **names=(const char **)mem_malloc(not*sizeof(char *));
+  array_pt ws=array_new(hash_size(base->dictionary)+hash_size(c->lex)+1);
+  hash_iterator_pt hi;
+  char *key;
+  FILE *f;
+  size_t i, j, k, no;
+
+  /* tag indices of cur -> tag indices of base */
+  for (i=0; i<not; i++)
+    {
+      ptrdiff_t ti=iregister_get_index(base->tags, iregister_get_name(cur->tags, i));
+      if (i==0) { ti=0; }
+      if (ti<0) { error("tag \"%s\" is not in the base model\n", iregister_get_name(cur->tags, i)); }
+      map[i]=ti;
+    }
+  /* output order of tags, like Perl's sort */
+  for (i=1; i<not; i++) { names[i-1]=iregister_get_name(base->tags, i); }
+  qsort(names, not-1, sizeof(char *), em_strcmp);
+  for (i=1; i<not; i++) { order[i]=iregister_get_index(base->tags, names[i-1]); }
+
+  memset(uni, 0, not*sizeof(int));
+  memset(bi, 0, nn*sizeof(int));
+  memset(tri, 0, nn*not*sizeof(int));
+  for (i=1; i<not; i++)
+    {
+      uni[map[i]]=base->count[0][map[i]];
+      for (j=1; j<not; j++)
+	{
+	  int bij=ngram_index(1, not, map[i], map[j], -1);
+	  bi[bij]=base->count[1][bij]+em_round(c->bi[ngram_index(1, not, i, j, -1)]);
+	  for (k=1; k<not; k++)
+	    {
+	      int tijk=ngram_index(2, not, map[i], map[j], map[k]);
+	      tri[tijk]=base->count[2][tijk]+em_round(c->tri[ngram_index(2, not, i, j, k)]);
+	    }
+	}
+    }
+
+  /* lexicon, adding the expected unigram counts on the way */
+  hi=hash_iterator_new(base->dictionary);
+  while ((key=(char *)hash_iterator_next_key(hi))) { array_add(ws, key); }
+  hash_iterator_delete(hi);
+  hi=hash_iterator_new(c->lex);
+  while ((key=(char *)hash_iterator_next_key(hi)))
+    { if (!hash_get(base->dictionary, key)) { array_add(ws, key); } }
+  hash_iterator_delete(hi);
+  qsort(ws->v, array_count(ws), sizeof(void *), em_strcmp);
+
+  f=try_to_open(lf, "w");
+  for (i=0; i<array_count(ws); i++)
+    {
+      char *w=(char *)array_get(ws, i);
+      word_pt wd=(word_pt)hash_get(base->dictionary, w);
+      double *e=(double *)hash_get(c->lex, w);
+
+      for (j=0; j<not; j++) { tc[j]= wd ? wd->tagcount[j] : 0; }
+      if (e)
+	{
+	  for (j=1; j<not; j++)
+	    {
+	      int x=em_round(e[j]);
+	      tc[map[j]]+=x;
+	      uni[map[j]]+=x;
+	    }
+	}
+      /* decreasing count, ties stay in name order */
+      for (no=0, j=1; j<not; j++)
+	{
+	  size_t t=order[j];
+	  if (tc[t]<=0) { continue; }
+	  for (k=no; k>0 && tc[sel[k-1]]<tc[t]; k--) { sel[k]=sel[k-1]; }
+	  sel[k]=t;
+	  no++;
+	}
+      if (no==0) { continue; }
+      fprintf(f, "%s", w);
+      for (j=0; j<no; j++)
+	{ fprintf(f, " %s %d", iregister_get_name(base->tags, sel[j]), tc[sel[j]]); }
+      fprintf(f, "\n");
+    }
+  fclose(f);
+  report(2, "wrote %d lexicon entries to \"%s\"\n", array_count(ws), lf);
+
+  /* keep the counts consistent, see compute_counts_for_boundary() */
+  for (i=1; i<not; i++)
+    {
+      for (j=1; j<not; j++)
+	{
+	  int *b=&bi[ngram_index(1, not, i, j, -1)];
+	  int s1=0, s2=0;
+	  for (k=1; k<not; k++)
+	    {
+	      s1+=tri[ngram_index(2, not, i, j, k)];
+	      s2+=tri[ngram_index(2, not, k, i, j)];
+	    }
+	  if (*b<s1) { *b=s1; }
+	  if (*b<s2) { *b=s2; }
+	}
+    }
+  for (i=1; i<not; i++)
+    {
+      int in=0, out=0, start=0;
+      for (j=1; j<not; j++)
+	{
+	  in+=bi[ngram_index(1, not, j, i, -1)];
+	  out+=bi[ngram_index(1, not, i, j, -1)];
+	  start+=bi[ngram_index(1, not, i, j, -1)];
+	  for (k=1; k<not; k++) { start-=tri[ngram_index(2, not, k, i, j)]; }
+	}
+      if (uni[i]<out) { uni[i]=out; }
+      if (uni[i]<in+start) { uni[i]=in+start; }
+    }
+
+  f=try_to_open(nf, "w");
+  for (i=1; i<not; i++)
+    {
+      size_t ti=order[i];
+      fprintf(f, "%s %d\n", iregister_get_name(base->tags, ti), uni[ti]);
+      for (j=1; j<not; j++)
+	{
+	  size_t tj=order[j];
+	  int b=bi[ngram_index(1, not, ti, tj, -1)];
+	  if (b>0) { fprintf(f, "\t%s %d\n", iregister_get_name(base->tags, tj), b); }
+	  for (k=1; k<not; k++)
+	    {
+	      size_t tk=order[k];
+	      int t=tri[ngram_index(2, not, ti, tj, tk)];
+	      if (t>0) { fprintf(f, "\t\t%s %d\n", iregister_get_name(base->tags, tk), t); }
+	    }
+	}
+    }
+  fclose(f);
+  report(2, "wrote n-gram counts to \"%s\"\n", nf);
+
+  array_free(ws);
+  mem_free(names);
+  mem_free(sel);
+  mem_free(order);
+  mem_free(map);
+  mem_free(tc);
+  mem_free(tri);
+  mem_free(bi);
+  mem_free(uni);
 }
-#endif
 
 /* ------------------------------------------------------------ */
 void debugging(model_pt m)
@@ -1240,14 +1733,32 @@ void dump_transition_probs(model_pt m)
 }
 
 /* ------------------------------------------------------------ */
-void tag_sentence(model_pt m, array_pt words, array_pt tags, char *l)
+void tag_sentence(model_pt m, viterbi_state_pt st, sentcache_pt c, array_pt words, array_pt tags, char *l)
 {
   char *t;
   size_t i;
+  const int *ct=NULL;
   array_clear(words); array_clear(tags);
   for (t=strtok(l, " \t"); t; t=strtok(NULL, " \t"))
     { array_add(words, t); }
-  viterbi(m, words, tags);
+  if (c && array_count(words)>0)
+    { ct=sentcache_get(c, (char **)words->v, array_count(words)); }
+  if (ct)
+    {
+      for (i=0; i<array_count(words); i++)
+	{ array_set(tags, i, (void *)(size_t)ct[i]); }
+    }
+  else
+    {
+      if (st) { viterbi_retag(m, st, words, tags); }
+      else { viterbi(m, words, tags); }
+      if (c && array_count(words)>0)
+	{
+	  int ts[array_count(words)];
+	  for (i=0; i<array_count(words); i++) { ts[i]=(int)(size_t)array_get(tags, i); }
+	  sentcache_put(c, (char **)words->v, array_count(words), ts, array_count(words));
+	}
+    }
   for (i=0; i<array_count(words); i++)
     {
       size_t ti=(size_t)array_get(tags, i);
@@ -1260,10 +1771,12 @@ void tag_sentence(model_pt m, array_pt words, array_pt tags, char *l)
 }
 
 /* ------------------------------------------------------------ */
-static void tagging(const char* fn, int bmode, model_pt m)
+static void tagging(const char* fn, int bmode, int incremental, size_t cache, model_pt m)
 {
   FILE *f= fn ? try_to_open(fn, "r") : stdin;
   array_pt words=array_new(128), tags=array_new(128);
+  viterbi_state_pt st= incremental ? viterbi_state_new(m) : NULL;
+  sentcache_pt c= cache>0 ? sentcache_new(cache*1024*1024) : NULL;
   char *s;
   ssize_t r;
   char *buf = NULL;
@@ -1276,9 +1789,20 @@ static void tagging(const char* fn, int bmode, model_pt m)
       s = buf;
       if (r>0 && s[r-1]=='\n') s[r-1] = '\0';
       if(r == 0) { continue; }
-      tag_sentence(m, words, tags, s);
+      tag_sentence(m, st, c, words, tags, s);
     }
   array_free(words); array_free(tags);
+  if (st)
+    {
+      report(1, "incremental mode: computed %lu of %lu columns\n",
+	     (unsigned long)st->computed, (unsigned long)st->total);
+      viterbi_state_delete(st);
+    }
+  if (c)
+    {
+      sentcache_report(c, 1);
+      sentcache_delete(c);
+    }
   if(buf!=NULL){
     free(buf);
     buf = NULL;
@@ -1399,6 +1923,131 @@ void delete_model(model_pt m)
   mem_free(m);
 }
 
+/* ------------------------------------------------------------ */
+static void build_model(model_pt m, const char *mf, const char *lf,
+			double a[3], int z, double s, int debugmode)
+{
+  read_ngram_file(mf, m);
+  compute_counts_for_boundary(m);
+
+  if (a[0]<0.0) { compute_lambdas(m); }
+  else { int i; for (i=0; i<3; i++) { m->lambda[i]=a[i]; } }
+  compute_transition_probs(m, z, debugmode);
+
+  read_dictionary_file(lf, m);
+  if (s<0.0) { compute_theta(m); }
+  else { m->theta=s; }
+  build_suffix_trie(m);
+  compute_unknown_word_probs(m, debugmode);
+}
+
+/* ------------------------------------------------------------ */
+/* reads raw sentences, one per line, as arrays of words; the
+   words point into the line copies collected in buffers */
+static array_pt read_raw_sentences(const char *fn, array_pt buffers)
+{
+  FILE *f= fn ? try_to_open(fn, "r") : stdin;
+  array_pt sentences=array_new(1024);
+  ssize_t r;
+  char *buf = NULL;
+  size_t n = 0;
+
+  while ((r = readline(&buf,&n,f)) != -1)
+    {
+      char *l, *t;
+      array_pt words;
+
+      if (r>0 && buf[r-1]=='\n') buf[r-1] = '\0';
+      if (r == 0) { continue; }
+      l=strdup(buf);
+      words=array_new(32);
+      for (t=strtok(l, " \t"); t; t=strtok(NULL, " \t")) { array_add(words, t); }
+      if (array_count(words)==0) { array_free(words); free(l); continue; }
+      array_add(sentences, words);
+      array_add(buffers, l);
+    }
+  if(buf!=NULL){
+    free(buf);
+    buf = NULL;
+    n = 0;
+  }
+  if (fn) {
+    fclose(f);
+  }
+  return sentences;
+}
+
+/* ------------------------------------------------------------ */
+/*
+  Baum-Welch re-estimation on raw text, starting from the
+  supervised model m. Every iteration runs forward_backward()
+  over all sentences, split into contiguous shards for nt
+  threads, and writes m's counts plus the expected counts to
+  the n-gram file nf and the lexicon file lf. Further iterations
+  start from the model just written, but always add to the
+  supervised counts of m.
+*/
+static void training(const char *fn, model_pt m, const char *nf, const char *lf,
+		     size_t mi, size_t nt, double a[3], int z, double s)
+{
+  array_pt buffers=array_new(1024);
+  array_pt sentences=read_raw_sentences(fn, buffers);
+  size_t not=iregister_get_length(m->tags);
+  size_t nc=not*not*not;
+  model_pt cur=m;
+  size_t it, i;
+
+  if (nt==0) { nt=1; }
+  report(1, "read %lu raw sentences, using %lu thread(s)%s\n",
+	 (unsigned long)array_count(sentences), (unsigned long)nt,
+	 nt>1 && !parallel_available() ? " sequentially" : "");
+  for (it=1; it<=mi; it++)
+    {
+      em_job_t job;
+      em_counts_pt c;
+
+      job.m=cur;
+      job.sentences=sentences;
+      job.tpe=(double *)mem_malloc(nc*sizeof(double));
+      for (i=0; i<nc; i++) { job.tpe[i]=exp(cur->tp[i]); }
+      job.counts=(em_counts_pt)mem_malloc(nt*sizeof(em_counts_t));
+      for (i=0; i<nt; i++) { em_counts_init(&job.counts[i], not); }
+
+      parallel_run(nt, em_worker, &job);
+      em_reduce(job.counts, nt, not);
+      c=&job.counts[0];
+      report(1, "EM iteration %lu: log-likelihood %+12.11e (%+6.5e per word), %lu sentences skipped\n",
+	     (unsigned long)it, c->ll, c->words>0 ? c->ll/(double)c->words : 0.0,
+	     (unsigned long)c->skipped);
+      em_write_model(m, cur, c, nf, lf);
+
+      for (i=0; i<nt; i++) { em_counts_free(&job.counts[i]); }
+      mem_free(job.counts);
+      mem_free(job.tpe);
+      if (cur!=m) { delete_model(cur); }
+      cur=m;
+      if (it<mi)
+	{
+	  cur=new_model();
+	  cur->rwt=m->rwt;
+	  cur->msl=m->msl;
+	  cur->stcs=m->stcs;
+	  cur->stics=m->stics;
+	  cur->bw=m->bw;
+	  cur->strings=sregister_new(500);
+	  build_model(cur, nf, lf, a, z, s, 0);
+	  if (iregister_get_length(cur->tags)!=not)
+	    { error("number of tags changed while training\n"); }
+	}
+    }
+
+  for (i=0; i<array_count(sentences); i++)
+    { array_free((array_pt)array_get(sentences, i)); }
+  array_free(sentences);
+  for (i=0; i<array_count(buffers); i++) { free(array_get(buffers, i)); }
+  array_free(buffers);
+}
+
 static int lambdas_parser(char* arg, void* lambdas) {
 	double* l = (double*) lambdas;
 	if (3!=sscanf(arg, "%lf %lf %lf", l, l+1, l+2))
@@ -1426,10 +2075,16 @@ int main(int argc, char **argv)
   long L = 10;
   long b = 0;
   int Z = 0;
+  int I = 0;
   int x = 0;
   int y = 0;
   int z = 0;
   char *l = NULL;
+  char *n = NULL;
+  char *w = NULL;
+  unsigned long i = 1;
+  unsigned long j = 1;
+  unsigned long c = 0;
   double a[3];
   a[0] = -1.0;
   a[1] = -1.0;
@@ -1456,10 +2111,16 @@ int main(int argc, char **argv)
 		  { 'r', OPTION_SIGNED_LONG, (void*)&r, "rare word threshold [0]" },
 		  { 'l', OPTION_STRING, (void*)&l, "lexicon file [none]" },
 		  { 'Z', OPTION_NONE, (void*)&Z, "use line-buffered IO for input" },
+		  { 'I', OPTION_NONE, (void*)&I, "incremental mode: each line is an edit of the previous one" },
+		  { 'c', OPTION_UNSIGNED_LONG, (void*)&c, "sentence cache size in MB for tag mode [0, no cache]" },
 		  { 'x', OPTION_NONE, (void*)&x, "case-insensitive suffix tries [sensitive]" },
 		  { 'y', OPTION_NONE, (void*)&y, "case-insensitive when branching in suffix trie [sensitive]" },
 		  { 'z', OPTION_NONE, (void*)&z, "zero empirical transition probs if undefined [1/#tags]" },
-		  { 'o', OPTION_CALLBACK, (void*)&cd, "mode of operation 0/tag, 1/test, 7/dump, 8/debug [tag]" },
+		  { 'o', OPTION_CALLBACK, (void*)&cd, "mode of operation 0/tag, 1/test, 2/train, 7/dump, 8/debug [tag]" },
+		  { 'n', OPTION_STRING, (void*)&n, "n-gram output file for train mode [none]" },
+		  { 'w', OPTION_STRING, (void*)&w, "lexicon output file for train mode [none]" },
+		  { 'i', OPTION_UNSIGNED_LONG, (void*)&i, "number of EM iterations for train mode [1]" },
+		  { 'j', OPTION_UNSIGNED_LONG, (void*)&j, "number of threads for train mode [1]" },
 
 		  { 'a', OPTION_CALLBACK, (void*)&cdlambdas, "transition smoothing lambdas" },
 		  { 'b', OPTION_SIGNED_LONG, (void*)&b, "beam factor [1000]" },
@@ -1491,10 +2152,15 @@ int main(int argc, char **argv)
   {
 	  ipf=argv[idx];
   }
-  if(o!=OPTION_OPERATION_TAG && o!=OPTION_OPERATION_TEST && o!=OPTION_OPERATION_DUMP && o!=OPTION_OPERATION_DEBUG)
+  if(o!=OPTION_OPERATION_TAG && o!=OPTION_OPERATION_TEST && o!=OPTION_OPERATION_TRAIN && o!=OPTION_OPERATION_DUMP && o!=OPTION_OPERATION_DEBUG)
   {
 	  error("invalid mode of operation \"%d\"\n", o);
   }
+  if(o==OPTION_OPERATION_TRAIN && (n == NULL || w == NULL))
+  {
+	  options_print_usage(&options, stderr);
+	  error("train mode needs n-gram and lexicon output files\n");
+  }
   if(v >= 1) {
 	  options_print_configuration(&options, stderr);
   }
@@ -1505,28 +2171,18 @@ int main(int argc, char **argv)
   model->strings = sregister_new(500);
 
 
-  read_ngram_file(mf, model);
-  compute_counts_for_boundary(model);
-
   model->bw = b;
-  if (a[0]<0.0) { compute_lambdas(model); }
-  else { int i; for (i=0; i<3; i++) { model->lambda[i]=a[i]; } }
-  compute_transition_probs(model, z, (o == OPTION_OPERATION_DEBUG));
-
-
-  read_dictionary_file(l, model);
-  if (s<0.0) { compute_theta(model); }
-  else { model->theta=s; }
-  build_suffix_trie(model);
-  compute_unknown_word_probs(model, (o == OPTION_OPERATION_DEBUG));
+  build_model(model, mf, l, a, z, s, (o == OPTION_OPERATION_DEBUG));
 
   switch (o)
     {
     case OPTION_OPERATION_TAG:
       /* _IOFBF fully buffered; _IOLBF line buffered; _IONBF not buffered */
-      tagging(ipf, Z ? _IOLBF : -1, model); break;
+      tagging(ipf, Z ? _IOLBF : -1, I, c, model); break;
     case OPTION_OPERATION_TEST:
       testing(ipf, model); break;
+    case OPTION_OPERATION_TRAIN:
+      training(ipf, model, n, w, i, j, a, z, s); break;
     case OPTION_OPERATION_DUMP:
       dump_transition_probs(model); break; 
     case OPTION_OPERATION_DEBUG:
@@ -50,6 +50,7 @@
 #include <ctype.h> /* islower */
 #include <math.h> /* sqrt */
 #include <errno.h>
+#include <limits.h>
 #include <getopt.h>
 #include "hash.h"
 #include "array.h"
@@ -57,6 +58,8 @@
 #include "mem.h"
 #include "sregister.h"
 #include "iregister.h"
+#include "sentcache.h"
+#include "parallel.h"
 
 /* ------------------------------------------------------------ */
 #ifndef MIN
@@ -81,6 +84,8 @@ typedef struct globals_s
   char *ipf;    /* input file name */
   char *plf;    /* preload file name */
   char *tf;     /* template file name */
+  size_t cache; /* sentence cache size in MB */
+  size_t threads; /* number of threads in train mode */
 } globals_t;
 typedef globals_t *globals_pt;
 #define PRE_TAG 1
@@ -137,6 +142,9 @@ typedef struct rule_s
   int good;
   int bad;
   int delta;            /* good - bad */
+  int counted;          /* bad is known, not only good */
+  int hi;               /* index in the heap of rules, -1 if none */
+  int id;               /* index in the counts of the training threads */
 } rule_t;
 typedef rule_t *rule_pt;
 
@@ -170,6 +178,8 @@ typedef struct model_s
   int defaulttag;     /* most probable tag (unigram) */
   array_pt rules;     /* learned rules, either from file or selected */
   hash_pt rulehash;   /* lookup table for *all* rules generated */
+  rule_pt *heap;      /* rules of rulehash, best first, while training */
+  size_t heap_size, heap_cap;
   sregister_pt strings;
 } model_t;
 typedef model_t *model_pt;
@@ -254,10 +264,12 @@ static void free_rule(rule_pt r)
 { mem_free(r); }
 
 /* ------------------------------------------------------------ */
-static char *precondition2string(model_pt m, precondition_pt pc)
-{
 #define BSIZE 4096
-  static char b[BSIZE];
+
+/* ------------------------------------------------------------ */
+/* formats pc into b, which has room for BSIZE bytes */
+static char *precondition2string(model_pt m, precondition_pt pc, char *b)
+{
   int l;
   
   switch (pc->type)
@@ -331,14 +343,14 @@ static char *precondition2string(model_pt m, precondition_pt pc)
     if (l>BSIZE)
       { error("internal error: precondition too long to format\n"); }
   return b;
-#undef BSIZE
 }
 
 /* ------------------------------------------------------------ */
-static char *rule2string(model_pt m, rule_pt r)
+/* formats r into b, which has room for BSIZE bytes; unlike
+   rule2string() safe to call from several threads */
+static char *format_rule(model_pt m, rule_pt r, char *b)
 {
-#define BSIZE 4096
-  static char b[BSIZE];
+  char pb[BSIZE];
   const char *ts=r->tag<0 ? jokerstring : (char*)iregister_get_name(m->tags, r->tag);
   int tsl=(ssize_t) strlen(ts);
   ptrdiff_t i, bl=BSIZE-1;
@@ -350,7 +362,7 @@ static char *rule2string(model_pt m, rule_pt r)
   bl-=tsl;
   for (i=0; i<r->nop; i++)
     {
-      char *ps=precondition2string(m, &r->pc[i]);
+      char *ps=precondition2string(m, &r->pc[i], pb);
       int l = (int) strlen(ps);
       if (bl<=l+1)
 	{ error("internal error: rule too long to format\n"); }
@@ -359,7 +371,14 @@ static char *rule2string(model_pt m, rule_pt r)
       bl-=l+1;
     }
   return b;
-#undef BSIZE
+}
+
+/* ------------------------------------------------------------ */
+static char *rule2string(model_pt m, rule_pt r)
+{
+  static char b[BSIZE];
+
+  return format_rule(m, r, b);
 }
 
 /* ------------------------------------------------------------ */
@@ -433,6 +452,75 @@ static void read_precondition_into_rule(model_pt m, rule_pt r, int n, char *s, i
     { error("can't parse precondition \"%s\"\n", s); }
 }
 
+/* ------------------------------------------------------------ */
+/* previously inlined */
+static int rule_score(rule_pt r)
+{ return !r ? -1000 : r->delta*10 - r->nop; }
+
+/* ------------------------------------------------------------ */
+/* rules that correct nothing come last; rules with bad not known
+   yet are ranked by what good alone allows, as bad>=0 */
+static int rule_key(rule_pt r)
+{
+  if (r->good<=0) { return INT_MIN; }
+  return r->counted ? rule_score(r) : r->good*10 - r->nop;
+}
+
+/* ------------------------------------------------------------ */
+/* order of the heap; ties go to the rule first in alphabetical
+   order, whatever the order the rules were registered in */
+static int rule_before(rule_pt a, rule_pt b)
+{
+  int ka=rule_key(a), kb=rule_key(b);
+
+  return ka>kb || (ka==kb && ka!=INT_MIN && strcmp(a->string, b->string)<0);
+}
+
+/* ------------------------------------------------------------ */
+static void rule_heap_swap(model_pt m, size_t i, size_t j)
+{
+  rule_pt r=m->heap[i];
+
+  m->heap[i]=m->heap[j];
+  m->heap[j]=r;
+  m->heap[i]->hi=i;
+  m->heap[j]->hi=j;
+}
+
+/* ------------------------------------------------------------ */
+/* restores the order of the heap after the counts of r changed */
+static void rule_heap_update(model_pt m, rule_pt r)
+{
+  size_t i;
+
+  if (r->hi<0) { return; }
+  for (i=r->hi; i>0 && rule_before(m->heap[i], m->heap[(i-1)/2]); i=(i-1)/2)
+    { rule_heap_swap(m, i, (i-1)/2); }
+  for (;;)
+    {
+      size_t l=2*i+1, b=i;
+
+      if (l<m->heap_size && rule_before(m->heap[l], m->heap[b])) { b=l; }
+      if (l+1<m->heap_size && rule_before(m->heap[l+1], m->heap[b])) { b=l+1; }
+      if (b==i) { break; }
+      rule_heap_swap(m, i, b);
+      i=b;
+    }
+}
+
+/* ------------------------------------------------------------ */
+static void rule_heap_push(model_pt m, rule_pt r)
+{
+  if (m->heap_size==m->heap_cap)
+    {
+      m->heap_cap= m->heap_cap ? 2*m->heap_cap : 1024;
+      m->heap=(rule_pt *)mem_realloc(m->heap, m->heap_cap*sizeof(rule_pt));
+    }
+  r->hi=m->heap_size;
+  m->heap[m->heap_size++]=r;
+  rule_heap_update(m, r);
+}
+
 /* ------------------------------------------------------------ */
 /* previously inlined */
 static rule_pt find_rule(model_pt m, char *rs)
@@ -449,6 +537,8 @@ static rule_pt register_rule(model_pt m, rule_pt r)
       hr=new_rule(r);
       hr->string=REGISTER_STRING(rs);
       hash_put(m->rulehash, hr->string, hr);
+      hr->hi=-1;
+      if (m->heap) { rule_heap_push(m, hr); }
     }
   return hr;
 }
@@ -738,11 +828,9 @@ static int precondition_satisfied(model_pt m, array_pt sps, int pos, rule_pt r,
 static int rule_matches_sample(model_pt m, array_pt sps, int pos, rule_pt r)
 {
   sample_pt sp=(sample_pt)array_get(sps, pos);
-  word_pt w=get_word(m, sp->word);
+  word_pt w;
   int i;
 
-  /* Only allow lexical tags for frequent words. */
-  if (!is_rare(m, sp->word) && (0==w->tagcount[r->tag])) { return 0; }
   for (i=0; i<r->nop; i++)
     {
 #if 0
@@ -757,6 +845,10 @@ static int rule_matches_sample(model_pt m, array_pt sps, int pos, rule_pt r)
       if (!precondition_satisfied(m, sps, pos, r, i)) { return 0; }
     }
 
+  /* Only allow lexical tags for frequent words; checked last, as the
+     preconditions rule out most samples without a lookup. */
+  w=get_word(m, sp->word);
+  if (!is_rare(m, sp->word) && (0==w->tagcount[r->tag])) { return 0; }
   return 1;
 }
 
@@ -1044,19 +1136,22 @@ precondition_from_template(model_pt m, array_pt sps, int pos, rule_pt t, rule_pt
 }
 
 /* ------------------------------------------------------------ */
+/* fills rt with the rule template t makes at pos, NULL if none */
 static rule_pt
-make_rule(model_pt m, array_pt sps, int pos, rule_pt t)
+make_rule(model_pt m, array_pt sps, int pos, rule_pt t, rule_pt rt)
 {
-  static rule_t rt;
   sample_pt sp=(sample_pt)array_get(sps, pos);
 
-  rt.tag=sp->reference;
-  rt.string=NULL;
-  rt.lic=-1;
+  rt->tag=sp->reference;
+  rt->string=NULL;
+  rt->lic=-1;
+  rt->good=rt->bad=rt->delta=0;
+  rt->counted=0;
+  rt->hi=rt->id=-1;
   
-  for (rt.nop=0; rt.nop<t->nop; rt.nop++)
-    { if (!precondition_from_template(m, sps, pos, t, &rt)) { return NULL; } }
-  return (rule_pt)&rt;
+  for (rt->nop=0; rt->nop<t->nop; rt->nop++)
+    { if (!precondition_from_template(m, sps, pos, t, rt)) { return NULL; } }
+  return rt;
 }
 
 /* ------------------------------------------------------------ */
@@ -1072,11 +1167,12 @@ make_rules(model_pt m, array_pt sps, int pos, array_pt rs, int goodonly)
   for (i=0; i<array_count(m->templates); i++)
     {
       rule_pt r, t=(rule_pt)array_get(m->templates, i);
+      rule_t rt;
 
       /* If template specifies a tag, it must match the reference. */
       if (goodonly && t->tag>=0 && t->tag!=sp->reference) { continue; }
 
-      r=make_rule(m, sps, pos, t);
+      r=make_rule(m, sps, pos, t, &rt);
       if (!r) { continue; }
       /* single correcting rule */
       if (goodonly)
@@ -1101,50 +1197,162 @@ make_rules(model_pt m, array_pt sps, int pos, array_pt rs, int goodonly)
 }
 
 /* ------------------------------------------------------------ */
-/* previously inlined */
-static int rule_score(rule_pt r)
-{ return !r ? -1000 : r->delta*10 - r->nop; }
+/* data shared by the threads of training, each of which works on a
+   shard of the sentences */
+typedef struct train_job_s
+{
+  model_pt m;
+  array_pt sts;                 /* sentences */
+  rule_pt r;                    /* count_rule(): the rule */
+  array_pt ts;                  /* count_rule(): templates that can make it */
+  int *good, *bad;              /* count_rule(): per thread */
+  array_pt *found;              /* per thread: correcting rules in the order found */
+  int **counts;                 /* per thread: good and bad per rule id */
+} train_job_t;
+typedef train_job_t *train_job_pt;
 
 /* ------------------------------------------------------------ */
-static rule_pt find_best_rule(model_pt m)
+static void count_rule_worker(size_t id, size_t n, void *data)
 {
-  rule_pt r, br=NULL;
-  int brs=rule_score(br);
-  hash_iterator_pt hi=hash_iterator_new(m->rulehash);
+  train_job_pt job=(train_job_pt)data;
+  model_pt m=job->m;
+  rule_pt r=job->r;
+  size_t last=parallel_shard_begin(array_count(job->sts), id+1, n);
+  char b[BSIZE];
+  size_t i, j, k;
+  int p;
+
+  job->good[id]=job->bad[id]=0;
+  for (i=parallel_shard_begin(array_count(job->sts), id, n); i<last; i++)
+    {
+      array_pt sps=(array_pt)array_get(job->sts, i);
 
-  for (r=(rule_pt)hash_iterator_next_value(hi);
-       r;
-       r=(rule_pt)hash_iterator_next_value(hi))
-    { int rs=rule_score(r); if (rs>brs) { br=r; brs=rs; } }
-  hash_iterator_delete(hi);
-  return br;
+      for (j=0; j<array_count(sps); j++)
+	{
+	  sample_pt sp=(sample_pt)array_get(sps, j);
+
+	  if (r->tag==sp->tag) { continue; }
+	  if (r->tag!=sp->reference && sp->tag!=sp->reference) { continue; }
+	  if (!is_rare(m, sp->word) && get_word(m, sp->word)->tagcount[r->tag]==0) { continue; }
+	  for (p=0; p<r->nop; p++)
+	    {
+	      if (r->pc[p].type!=PRE_TAG && r->pc[p].type!=PRE_WORD) { continue; }
+	      if (!precondition_satisfied(m, sps, j, r, p)) { break; }
+	    }
+	  if (p<r->nop) { continue; }
+	  for (k=0; k<array_count(job->ts); k++)
+	    {
+	      rule_t rt;
+	      rule_pt nr=make_rule(m, sps, j, (rule_pt)array_get(job->ts, k), &rt);
+
+	      if (!nr) { continue; }
+	      nr->tag=r->tag;
+	      if (strcmp(format_rule(m, nr, b), r->string)) { continue; }
+	      if (r->tag==sp->reference) { job->good[id]++; } else { job->bad[id]++; }
+	    }
+	}
+    }
 }
 
 /* ------------------------------------------------------------ */
-static void register_correcting_rules(void *a, void *b)
+/* good and bad of r on the whole corpus, counted by nt threads; only
+   templates of the same shape can make r, and only where its tag and
+   word preconditions hold */
+static void count_rule(model_pt m, array_pt sts, rule_pt r, size_t nt)
 {
-  array_pt sps=(array_pt)a, rs=array_new(8);
-  model_pt m=(model_pt)b;
-  size_t i;
-  
-  for (i=0; i<array_count(sps); i++)
+  array_pt ts=array_new(8);
+  int good[nt], bad[nt];
+  train_job_t job={ m, sts, r, ts, good, bad, NULL, NULL };
+  size_t i, k;
+  int p;
+
+  for (k=0; k<array_count(m->templates); k++)
     {
-      sample_pt sp=(sample_pt)array_get(sps, i);
-      int nor, l;
+      rule_pt t=(rule_pt)array_get(m->templates, k);
+
+      if (t->nop!=r->nop || (t->tag>=0 && t->tag!=r->tag)) { continue; }
+      for (p=0; p<t->nop && t->pc[p].type==r->pc[p].type && t->pc[p].pos==r->pc[p].pos; p++)
+	{ /* nothing */ }
+      if (p==t->nop) { array_add(ts, t); }
+    }
+  parallel_run(nt, count_rule_worker, &job);
+  r->good=r->bad=0;
+  for (i=0; i<nt; i++) { r->good+=good[i]; r->bad+=bad[i]; }
+  r->delta=r->good-r->bad;
+  r->counted=1;
+  array_free(ts);
+}
+
+/* ------------------------------------------------------------ */
+/* the rule on top of the heap, once its bad is known */
+static rule_pt find_best_rule(model_pt m, array_pt sts, size_t nt)
+{
+  while (m->heap_size>0)
+    {
+      rule_pt br=m->heap[0];
+
+      if (br->good<=0) { return NULL; }
+      if (br->counted) { return rule_score(br)>rule_score(NULL) ? br : NULL; }
+      count_rule(m, sts, br, nt);
+      rule_heap_update(m, br);
+    }
+  return NULL;
+}
+
+/* ------------------------------------------------------------ */
+/* registers the rules that would correct sample i */
+static void register_correcting_rules_at(model_pt m, array_pt sps, size_t i, array_pt rs)
+{
+  sample_pt sp=(sample_pt)array_get(sps, i);
+  size_t l;
+
+  if (sp->reference==sp->tag) { return; }
+  make_rules(m, sps, i, rs, 1);
+  for (l=0; l<array_count(rs); l++)
+    {
+      rule_pt r=(rule_pt)array_get(rs, l);
+      (void)register_rule(m, r);
+      free_rule(r);
+    }
+  array_clear(rs);
+}
 
-      if (sp->reference==sp->tag) { continue; }
-      make_rules(m, sps, i, rs, 1);
-      nor=array_count(rs);
-      for (l=0; l<nor; l++)
+/* ------------------------------------------------------------ */
+/* the rules that would correct the samples of the shard, each once,
+   in the order they are found */
+static void find_correcting_rules_worker(size_t id, size_t n, void *data)
+{
+  train_job_pt job=(train_job_pt)data;
+  model_pt m=job->m;
+  hash_pt h=hash_new(1024, .5, hash_string_hash, hash_string_equal);
+  array_pt rs=array_new(8);
+  size_t last=parallel_shard_begin(array_count(job->sts), id+1, n);
+  char b[BSIZE];
+  size_t i, j, l;
+
+  for (i=parallel_shard_begin(array_count(job->sts), id, n); i<last; i++)
+    {
+      array_pt sps=(array_pt)array_get(job->sts, i);
+
+      for (j=0; j<array_count(sps); j++)
 	{
-	  rule_pt r=(rule_pt)array_get(rs, l);
-	  (void)register_rule(m, r);
-	  /* 	      report(-1, "%s\n", rule2string(m, r)); */
-	  free_rule(r);
-	  /* print_rule(hr, m); */
+	  sample_pt sp=(sample_pt)array_get(sps, j);
+
+	  if (sp->reference==sp->tag) { continue; }
+	  make_rules(m, sps, j, rs, 1);
+	  for (l=0; l<array_count(rs); l++)
+	    {
+	      rule_pt r=(rule_pt)array_get(rs, l);
+
+	      if (hash_get(h, format_rule(m, r, b))) { free_rule(r); continue; }
+	      r->string=strdup(b);
+	      hash_put(h, r->string, r);
+	      array_add(job->found[id], r);
+	    }
+	  array_clear(rs);
 	}
-      array_clear(rs);
     }
+  hash_delete(h);
   array_free(rs);
 }
 
@@ -1153,74 +1361,232 @@ static void free_rule_key_value(void *k, void *v)
 { free_rule((rule_pt)v); }
 
 /* ------------------------------------------------------------ */
-static void make_deltas(void *a, void *b)
+static void collect_rule(void *k, void *v, void *data)
 {
-  array_pt sps=(array_pt)a, rs=array_new(8);
-  model_pt m=(model_pt)b;
-  size_t i;
+  rule_pt r=(rule_pt)v;
 
-  for (i=0; i<array_count(sps); i++)
+  (void)k;
+  r->id=array_add((array_pt)data, r);
+}
+
+/* ------------------------------------------------------------ */
+/* what the samples of the shard contribute to good and bad of the
+   registered rules, which are only read */
+static void count_rules_worker(size_t id, size_t n, void *data)
+{
+  train_job_pt job=(train_job_pt)data;
+  model_pt m=job->m;
+  int *c=job->counts[id];
+  array_pt rs=array_new(8);
+  size_t last=parallel_shard_begin(array_count(job->sts), id+1, n);
+  char b[BSIZE];
+  size_t i, j, l;
+
+  for (i=parallel_shard_begin(array_count(job->sts), id, n); i<last; i++)
     {
-      sample_pt sp=(sample_pt)array_get(sps, i);
-      int nor, l;
-      
-      make_rules(m, sps, i, rs, 0);
-      nor=array_count(rs);
-      for (l=0; l<nor; l++)
+      array_pt sps=(array_pt)array_get(job->sts, i);
+
+      for (j=0; j<array_count(sps); j++)
 	{
-	  rule_pt r=(rule_pt)array_get(rs, l);
-	  char *rs=rule2string(m, r);
-	  rule_pt hr=find_rule(m, rs);
-	  
+	  sample_pt sp=(sample_pt)array_get(sps, j);
+
+	  make_rules(m, sps, j, rs, 0);
+	  for (l=0; l<array_count(rs); l++)
+	    {
+	      rule_pt r=(rule_pt)array_get(rs, l);
+	      rule_pt hr=find_rule(m, format_rule(m, r, b));
+
+	      free_rule(r);
+	      if (!hr || hr->tag==sp->tag) { continue; }
+	      if (hr->tag==sp->reference) { c[2*hr->id]++; }
+	      else if (sp->tag==sp->reference) { c[2*hr->id+1]++; }
+	    }
+	  array_clear(rs);
+	}
+    }
+  array_free(rs);
+}
+
+/* ------------------------------------------------------------ */
+/* precondition_from_template() registers the prefixes and suffixes
+   that templates ask for by length; done beforehand, the string
+   register is only read by the threads */
+static void register_affixes(model_pt m, array_pt sts)
+{
+  char *tmp=NULL;
+  size_t tmp_n=0;
+  size_t i, j, k;
+  int p;
+
+  for (k=0; k<array_count(m->templates); k++)
+    {
+      rule_pt t=(rule_pt)array_get(m->templates, k);
+
+      for (p=0; p<t->nop; p++)
+	{
+	  precondition_pt pc=&t->pc[p];
+
+	  if (!(pc->type==PRE_PREFIX && !pc->u.prefix.prefix) &&
+	      !(pc->type==PRE_SUFFIX && !pc->u.suffix.suffix)) { continue; }
+	  for (i=0; i<array_count(sts); i++)
+	    {
+	      array_pt sps=(array_pt)array_get(sts, i);
+
+	      for (j=0; j<array_count(sps); j++)
+		{
+		  char *w=((sample_pt)array_get(sps, j))->word;
+
+		  if (pc->type==PRE_PREFIX)
+		    { (void)REGISTER_STRING(substr(w, 0, pc->u.prefix.length, &tmp, &tmp_n)); }
+		  else
+		    { (void)REGISTER_STRING(substr(w, strlen(w)-1, -pc->u.suffix.length, &tmp, &tmp_n)); }
+		}
+	    }
+	}
+    }
+  if (tmp) { free(tmp); }
+}
+
+/* ------------------------------------------------------------ */
+/* registers the rules that would correct a sample and counts their
+   good and bad, with nt threads on shards of the sentences; the
+   shards' rules are registered in order, and the counts are summed,
+   so the outcome is the same for any number of threads */
+static void count_initial_rules(model_pt m, array_pt sts, size_t nt)
+{
+  array_pt found[nt], rules=array_new(1024);
+  int *counts[nt];
+  train_job_t job={ m, sts, NULL, NULL, NULL, NULL, found, counts };
+  size_t i, k;
+
+  if (nt>1) { register_affixes(m, sts); }
+  for (k=0; k<nt; k++) { found[k]=array_new(1024); }
+  parallel_run(nt, find_correcting_rules_worker, &job);
+  for (k=0; k<nt; k++)
+    {
+      for (i=0; i<array_count(found[k]); i++)
+	{
+	  rule_pt r=(rule_pt)array_get(found[k], i);
+
+	  (void)register_rule(m, r);
+	  free(r->string);
 	  free_rule(r);
-	  if (!hr) { continue; }
-	  if (hr->tag==sp->tag) { continue; }
-	  if (hr->tag==sp->reference)
-#if 1
-	    { hr->good++; hr->delta++; }
-#else
-	  {
-	    sample_pt spm1= i>0 ? (sample_pt)array_get(sps, i-1) : NULL;
-	    sample_pt spp1= i+1<array_count(sps) ? (sample_pt)array_get(sps, i+1) : NULL;
-	    char *ttm1= spm1 ? iregister_get_name(m->tags, spm1->tag) : "NONE";
-	    char *ttp1= spp1 ? iregister_get_name(m->tags, spp1->tag) : "NONE";
-	    hr->good++; hr->delta++;
-	    if (!strcmp(rule2string(m, hr), "NE rare[0] suffix[0]=a"))
-	      {
-		word_pt w=get_word(m, sp->word);
-		int x=w?w->tagcount[hr->tag]:0;
-		report(-1, "POS2: %d %s/%s ->%s%s[%d]/%s<- %s/%s\n", i,
-		       spm1?spm1->word:"B", ttm1,
-		       sp->word, is_rare(m, sp->word)?"*":"", x, iregister_get_name(m->tags, sp->tmptag),
-		       spp1?spp1->word:"B", ttp1);
-	      }
-	  }
-#endif	  
-	  else if (sp->tag==sp->reference)
-#if 1
-	    { hr->bad++; hr->delta--; }
-#else
-	  {
-	    sample_pt spm1= i>0 ? (sample_pt)array_get(sps, i-1) : NULL;
-	    sample_pt spp1= i+1<array_count(sps) ? (sample_pt)array_get(sps, i+1) : NULL;
-	    char *ttm1= spm1 ? iregister_get_name(m->tags, spm1->tag) : "NONE";
-	    char *ttp1= spp1 ? iregister_get_name(m->tags, spp1->tag) : "NONE";
-	    hr->bad++; hr->delta--;
-	    if (!strcmp(rule2string(m, hr), "NE rare[0] suffix[0]=a"))
-	      {
-		word_pt w=get_word(m, sp->word);
-		int x=w?w->tagcount[hr->tag]:0;
-		report(-1, "NEG2: %d %s/%s ->%s%s[%d]/%s<- %s/%s\n", i,
-		       spm1?spm1->word:"B", ttm1,
-		       sp->word, is_rare(m, sp->word)?"*":"", x, iregister_get_name(m->tags, sp->tmptag),
-		       spp1?spp1->word:"B", ttp1);
-	      }
-	  }
-#endif
 	}
-      array_clear(rs);
+      array_free(found[k]);
+    }
+  report(1, "initially generated %d rules\n", hash_size(m->rulehash));
+
+  hash_map1(m->rulehash, collect_rule, rules);
+  for (k=0; k<nt; k++)
+    {
+      counts[k]=(int *)mem_malloc((2*array_count(rules)+1)*sizeof(int));
+      memset(counts[k], 0, 2*array_count(rules)*sizeof(int));
+    }
+  parallel_run(nt, count_rules_worker, &job);
+  for (i=0; i<array_count(rules); i++)
+    {
+      rule_pt r=(rule_pt)array_get(rules, i);
+
+      for (k=0; k<nt; k++) { r->good+=counts[k][2*i]; r->bad+=counts[k][2*i+1]; }
+      r->delta=r->good-r->bad;
+      r->counted=1;
+      rule_heap_push(m, r);
+    }
+  for (k=0; k<nt; k++) { mem_free(counts[k]); }
+  array_free(rules);
+}
+
+/* ------------------------------------------------------------ */
+/* adds sign times what sample i contributes to good and bad of the
+   registered rules */
+static void count_rules_at(model_pt m, array_pt sps, size_t i, array_pt rs, int sign)
+{
+  sample_pt sp=(sample_pt)array_get(sps, i);
+  size_t l;
+
+  make_rules(m, sps, i, rs, 0);
+  for (l=0; l<array_count(rs); l++)
+    {
+      rule_pt r=(rule_pt)array_get(rs, l);
+      rule_pt hr=find_rule(m, rule2string(m, r));
+
+      free_rule(r);
+      if (!hr) { continue; }
+      if (hr->tag==sp->tag) { continue; }
+      if (hr->tag==sp->reference) { hr->good+=sign; hr->delta+=sign; }
+      else if (sp->tag==sp->reference) { hr->bad+=sign; hr->delta-=sign; }
+      else { continue; }
+      rule_heap_update(m, hr);
+    }
+  array_clear(rs);
+}
+
+/* ------------------------------------------------------------ */
+/* how far from a sample the templates look */
+static int template_window(model_pt m)
+{
+  int w=0, j;
+  size_t i;
+
+  for (i=0; i<array_count(m->templates); i++)
+    {
+      rule_pt t=(rule_pt)array_get(m->templates, i);
+      for (j=0; j<t->nop; j++) { w=MAX(w, abs(t->pc[j].pos)); }
+    }
+  return w;
+}
+
+/* ------------------------------------------------------------ */
+/* applies r like apply_rule(); the counts of the registered rules
+   only change at samples within w of a sample whose tag changed, so
+   only those are taken out before and put back in after, and may
+   register new rules (fnTBL, Ngai & Florian 2001) */
+static int apply_rule_incrementally(model_pt m, array_pt sts, rule_pt r, int w)
+{
+  array_pt rs=array_new(8);
+  int g=0, b=0;
+  size_t i;
+
+  for (i=0; i<array_count(sts); i++)
+    {
+      array_pt sps=(array_pt)array_get(sts, i);
+      ssize_t n=array_count(sps), j, k;
+      char affected[n];
+      int changed=0;
+
+      for (j=0; j<n; j++)
+	{
+	  sample_pt sp=(sample_pt)array_get(sps, j);
+
+	  sp->tmptag=sp->tag;
+	  if (!rule_matches_sample(m, sps, j, r)) { continue; }
+	  if (r->tag==sp->tag) { continue; }
+	  if (r->tag==sp->reference) { g++; }
+	  else if (sp->tag==sp->reference) { b++; }
+	  sp->tmptag=r->tag;
+	  changed=1;
+	}
+      if (!changed) { continue; }
+
+      memset(affected, 0, n);
+      for (j=0; j<n; j++)
+	{
+	  sample_pt sp=(sample_pt)array_get(sps, j);
+
+	  if (sp->tmptag==sp->tag) { continue; }
+	  for (k=MAX(0, j-w); k<=j+w && k<n; k++) { affected[k]=1; }
+	}
+      for (k=0; k<n; k++)
+	{ if (affected[k]) { count_rules_at(m, sps, k, rs, -1); } }
+      array_map(sps, set_tag_to_tmptag);
+      for (k=0; k<n; k++)
+	{ if (affected[k]) { register_correcting_rules_at(m, sps, k, rs); } }
+      for (k=0; k<n; k++)
+	{ if (affected[k]) { count_rules_at(m, sps, k, rs, 1); } }
     }
   array_free(rs);
+  report(-1, "rule %s %d - %d == %d\n", rule2string(m, r), g, b, g-b);
+  return g-b;
 }
 
 /* ------------------------------------------------------------ */
@@ -1231,7 +1597,7 @@ static void training(model_pt m, globals_pt g, int mi, int md)
 {
   array_pt sts=read_cooked_file(m, g->ipf), rs=array_new(128);
   rule_pt br;
-  int i;
+  int i, w;
   
   read_template_file(m, g->tf);
 
@@ -1267,38 +1633,440 @@ static void training(model_pt m, globals_pt g, int mi, int md)
     }
 
   /* find all correcting rules, add deltas */
-  array_map1(sts, register_correcting_rules, m);
-  report(1, "initially generated %d rules\n", hash_size(m->rulehash));
-  array_map1(sts, make_deltas, m);
+  if (g->threads>1)
+    { report(1, "using %lu threads%s\n", (unsigned long)g->threads, parallel_available() ? "" : " sequentially"); }
+  count_initial_rules(m, sts, g->threads);
+  w=template_window(m);
 
   /* get best rule & update loop */
-  for (i=1, br=find_best_rule(m);
+  for (i=1, br=find_best_rule(m, sts, g->threads);
        br && br->delta >= md && (mi < 0 || i <= mi);
-       i++, br=find_best_rule(m))
+       i++, br=find_best_rule(m, sts, g->threads))
     {
-      int delta=apply_rule(m, sts, br, 0);
-      
+      /* applying br updates its counts as well */
+      int bd=br->delta, delta;
+
       report(1, "best rule is %s delta %d good %d - bad %d == %d\n",
 	     br->string, br->delta, br->good, br->bad, br->good-br->bad);
       append_rule_to_rule_file(m, g->rf, br);
-      if (br->delta!=delta)
-	{ error("ERROR: internal delta mismatch %d %d\n", br->delta, delta); }
+      delta=apply_rule_incrementally(m, sts, br, w);
+      if (bd!=delta)
+	{ error("ERROR: internal delta mismatch %d %d\n", bd, delta); }
       g->pos+=delta; g->neg-=delta;
       report(2, "iteration %d: %dp + %dn==%d delta %d accuracy %7.3f%%\n",
 	     i, g->pos, g->neg, g->pos+g->neg, delta, 100.0*g->pos/(g->pos+g->neg));
-      hash_map(m->rulehash, free_rule_key_value);
-      hash_clear(m->rulehash);
-      array_map1(sts, register_correcting_rules, m);
-      array_map1(sts, make_deltas, m);
     }
+  hash_map(m->rulehash, free_rule_key_value);
+  hash_clear(m->rulehash);
+  mem_free(m->heap);
+  m->heap=NULL;
+  m->heap_size=m->heap_cap=0;
   array_free(rs);
 }
 
+/* ------------------------------------------------------------ */
+/* The rule list compiled for tagging. Preconditions on the word
+   become ids of features (the word itself, its prefixes and suffixes
+   of the lengths the rules use, rareness and the digit and
+   capitalization subtypes) that are looked up once per word, not
+   once per rule and position. A rule is only tried where one of its
+   preconditions, the anchor, holds; the words with a feature or a tag
+   are kept in lists per sentence. */
+#define CF_RARE 0
+#define CF_DIGIT 0              /* +PRE_NO, PRE_SOME or PRE_ALL */
+#define CF_CAP 3                /* +PRE_NO, PRE_SOME or PRE_ALL */
+#define CF_FIRST 7              /* first id of words, prefixes and suffixes */
+
+#define CS_WORD 0               /* feature slots of a word */
+#define CS_RARE 1
+#define CS_DIGIT 2
+#define CS_CAP 3
+#define CS_AFFIX 4              /* first prefix or suffix slot */
+
+#define CP_TAG 0                /* compiled preconditions */
+#define CP_FEATURE 1
+#define CP_BOS 2
+#define CP_EOS 3
+#define CP_SAMPLE 4             /* any word of the sentence */
+#define CP_OTHER 5              /* left to precondition_satisfied() */
+
+typedef struct cprecondition_s
+{
+  int type;                     /* CP_* */
+  int pos;
+  int slot;                     /* CP_FEATURE: slot of the feature */
+  int value;                    /* tag or feature id */
+} cprecondition_t;
+typedef cprecondition_t *cprecondition_pt;
+
+typedef struct crule_s
+{
+  rule_pt rule;
+  int anchor;                   /* precondition the positions come from, -1 for all */
+  cprecondition_t pc[MAX_NO_PC];
+} crule_t;
+typedef crule_t *crule_pt;
+
+typedef struct crules_s
+{
+  crule_t *rules;
+  size_t no_rules;
+  hash_pt words, prefixes, suffixes; /* string -> feature id+1 */
+  int no_features;
+  int no_slots;
+  int affix_suffix[MAX_NO_PC*64]; /* per affix slot: suffix, not prefix */
+  size_t affix_length[MAX_NO_PC*64];
+  char *buf;                    /* a prefix to look up */
+  size_t buf_size;
+  /* per sentence */
+  size_t size;                  /* words there is room for */
+  int *feat;                    /* no_slots feature ids per word, -1 for none */
+  int *fnext;                   /* per slot of a word: next word+1 with the feature */
+  word_pt *wp;                  /* lexicon entry per word */
+  int *tnext, *tprev;           /* per word: next and previous word+1 with its tag */
+  int *match;
+  int *fhead;                   /* per feature: first word+1 */
+  int *fstamp;                  /* per feature: sentence fhead is valid for */
+  int stamp;
+  int *thead;                   /* per tag: first word+1 */
+  size_t no_tags;
+} crules_t;
+typedef crules_t *crules_pt;
+
+/* ------------------------------------------------------------ */
+static int crules_feature(crules_pt cr, hash_pt h, char *s)
+{
+  size_t id=(size_t)hash_get(h, s);
+
+  if (!id) { id=++cr->no_features; hash_put(h, s, (void *)id); }
+  return (int)id-1;
+}
+
+/* ------------------------------------------------------------ */
+static int crules_affix_slot(crules_pt cr, int suffix, size_t l)
+{
+  int k;
+
+  for (k=CS_AFFIX; k<cr->no_slots; k++)
+    { if (cr->affix_suffix[k-CS_AFFIX]==suffix && cr->affix_length[k-CS_AFFIX]==l) { return k; } }
+  if (k-CS_AFFIX>=(int)(sizeof(cr->affix_length)/sizeof(size_t))) { return -1; }
+  cr->affix_suffix[k-CS_AFFIX]=suffix;
+  cr->affix_length[k-CS_AFFIX]=l;
+  if (!suffix && l+1>cr->buf_size)
+    {
+      cr->buf_size=l+1;
+      cr->buf=(char *)mem_realloc(cr->buf, cr->buf_size);
+    }
+  return cr->no_slots++;
+}
+
+/* ------------------------------------------------------------ */
+static void compile_precondition(crules_pt cr, precondition_pt pc, cprecondition_pt cp)
+{
+  size_t l;
+
+  cp->type=CP_FEATURE;
+  cp->pos=pc->pos;
+  switch (pc->type)
+    {
+    case PRE_TAG:
+      cp->type=CP_TAG;
+      cp->value=pc->u.tag;
+      return;
+    case PRE_WORD:
+      cp->slot=CS_WORD;
+      cp->value=crules_feature(cr, cr->words, pc->u.word);
+      return;
+    case PRE_PREFIX:
+      /* strstr() finds the empty prefix in every word */
+      if (!(l=strlen(pc->u.prefix.prefix))) { cp->type=CP_SAMPLE; return; }
+      if ((cp->slot=crules_affix_slot(cr, 0, l))<0) { break; }
+      cp->value=crules_feature(cr, cr->prefixes, pc->u.prefix.prefix);
+      return;
+    case PRE_SUFFIX:
+      if ((l=strlen(pc->u.suffix.suffix))!=pc->u.suffix.length) { break; }
+      if (!l) { cp->type=CP_SAMPLE; return; }
+      if ((cp->slot=crules_affix_slot(cr, 1, l))<0) { break; }
+      cp->value=crules_feature(cr, cr->suffixes, pc->u.suffix.suffix);
+      return;
+    case PRE_BOS:
+      cp->type=CP_BOS;
+      return;
+    case PRE_EOS:
+      cp->type=CP_EOS;
+      return;
+    case PRE_DIGIT:
+      if (pc->u.digit<PRE_NO || pc->u.digit>PRE_ALL) { break; }
+      cp->slot=CS_DIGIT;
+      cp->value=CF_DIGIT+pc->u.digit;
+      return;
+    case PRE_CAP:
+      if (pc->u.cap<PRE_NO || pc->u.cap>PRE_ALL) { break; }
+      cp->slot=CS_CAP;
+      cp->value=CF_CAP+pc->u.cap;
+      return;
+    case PRE_RARE:
+      cp->slot=CS_RARE;
+      cp->value=CF_RARE;
+      return;
+    }
+  cp->type=CP_OTHER;
+}
+
+/* ------------------------------------------------------------ */
+/* how good a precondition is as anchor, 0 for not at all */
+static int anchor_rank(cprecondition_pt cp)
+{
+  switch (cp->type)
+    {
+    case CP_BOS: case CP_EOS: return 4;
+    case CP_FEATURE:
+      return cp->slot==CS_WORD || cp->slot>=CS_AFFIX ? 3 : 1;
+    case CP_TAG: return 2;
+    }
+  return 0;
+}
+
+/* ------------------------------------------------------------ */
+static crules_pt compile_rules(model_pt m)
+{
+  crules_pt cr=(crules_pt)mem_malloc(sizeof(crules_t));
+  size_t i;
+
+  memset(cr, 0, sizeof(crules_t));
+  cr->no_rules=array_count(m->rules);
+  cr->rules=(crule_t *)mem_malloc((cr->no_rules+1)*sizeof(crule_t));
+  cr->words=hash_new(1000, .5, hash_string_hash, hash_string_equal);
+  cr->prefixes=hash_new(100, .5, hash_string_hash, hash_string_equal);
+  cr->suffixes=hash_new(100, .5, hash_string_hash, hash_string_equal);
+  cr->no_features=CF_FIRST;
+  cr->no_slots=CS_AFFIX;
+  for (i=0; i<cr->no_rules; i++)
+    {
+      crule_pt c=&cr->rules[i];
+      int j, best=0;
+
+      c->rule=(rule_pt)array_get(m->rules, i);
+      c->anchor=-1;
+      for (j=0; j<c->rule->nop; j++)
+	{
+	  int rank;
+
+	  compile_precondition(cr, &c->rule->pc[j], &c->pc[j]);
+	  if ((rank=anchor_rank(&c->pc[j]))>best) { best=rank; c->anchor=j; }
+	}
+    }
+  cr->fhead=(int *)mem_malloc(cr->no_features*sizeof(int));
+  cr->fstamp=(int *)mem_malloc(cr->no_features*sizeof(int));
+  memset(cr->fstamp, 0, cr->no_features*sizeof(int));
+  report(2, "compiled %lu rules, %d word features in %d slots\n",
+	 (unsigned long)cr->no_rules, cr->no_features-CF_FIRST, cr->no_slots);
+  return cr;
+}
+
+/* ------------------------------------------------------------ */
+static void delete_compiled_rules(crules_pt cr)
+{
+  hash_delete(cr->words);
+  hash_delete(cr->prefixes);
+  hash_delete(cr->suffixes);
+  mem_free(cr->rules);
+  mem_free(cr->buf);
+  mem_free(cr->feat);
+  mem_free(cr->fnext);
+  mem_free(cr->wp);
+  mem_free(cr->tnext);
+  mem_free(cr->tprev);
+  mem_free(cr->match);
+  mem_free(cr->fhead);
+  mem_free(cr->fstamp);
+  mem_free(cr->thead);
+  mem_free(cr);
+}
+
+/* ------------------------------------------------------------ */
+/* the feature ids of the words of the sentence, and the lists of
+   the words with a feature and with a tag */
+static void crules_setup(model_pt m, crules_pt cr, array_pt sps)
+{
+  size_t n=array_count(sps), not=iregister_get_length(m->tags);
+  int ns=cr->no_slots;
+  size_t i;
+  int k;
+
+  if (n>cr->size)
+    {
+      while (n>cr->size) { cr->size= cr->size ? 2*cr->size : 64; }
+      cr->feat=(int *)mem_realloc(cr->feat, cr->size*ns*sizeof(int));
+      cr->fnext=(int *)mem_realloc(cr->fnext, cr->size*ns*sizeof(int));
+      cr->wp=(word_pt *)mem_realloc(cr->wp, cr->size*sizeof(word_pt));
+      cr->tnext=(int *)mem_realloc(cr->tnext, cr->size*sizeof(int));
+      cr->tprev=(int *)mem_realloc(cr->tprev, cr->size*sizeof(int));
+      cr->match=(int *)mem_realloc(cr->match, cr->size*sizeof(int));
+    }
+  if (not>cr->no_tags)
+    {
+      cr->no_tags=not;
+      cr->thead=(int *)mem_realloc(cr->thead, not*sizeof(int));
+    }
+  memset(cr->thead, 0, not*sizeof(int));
+  cr->stamp++;
+
+  /* backwards, so that the lists are in sentence order */
+  for (i=n; i-->0; )
+    {
+      sample_pt sp=(sample_pt)array_get(sps, i);
+      int *f=cr->feat+i*ns;
+      size_t l=strlen(sp->word);
+      word_pt w=get_word(m, sp->word);
+
+      cr->wp[i]=w;
+      f[CS_WORD]=(int)(size_t)hash_get(cr->words, sp->word)-1;
+      f[CS_RARE]= !w || w->count<=m->rwt ? CF_RARE : -1;
+      f[CS_DIGIT]=CF_DIGIT+digit_subtype(sp->word);
+      f[CS_CAP]=CF_CAP+cap_subtype(sp->word);
+      for (k=CS_AFFIX; k<ns; k++)
+	{
+	  size_t al=cr->affix_length[k-CS_AFFIX];
+
+	  f[k]=-1;
+	  if (al>l) { continue; }
+	  if (cr->affix_suffix[k-CS_AFFIX])
+	    { f[k]=(int)(size_t)hash_get(cr->suffixes, sp->word+l-al)-1; }
+	  else
+	    {
+	      memcpy(cr->buf, sp->word, al);
+	      cr->buf[al]='\0';
+	      f[k]=(int)(size_t)hash_get(cr->prefixes, cr->buf)-1;
+	    }
+	}
+      for (k=0; k<ns; k++)
+	{
+	  int id=f[k];
+
+	  if (id<0) { continue; }
+	  if (cr->fstamp[id]!=cr->stamp) { cr->fstamp[id]=cr->stamp; cr->fhead[id]=0; }
+	  cr->fnext[i*ns+k]=cr->fhead[id];
+	  cr->fhead[id]=i+1;
+	}
+      cr->tprev[i]=0;
+      cr->tnext[i]=cr->thead[sp->tag];
+      if (cr->thead[sp->tag]) { cr->tprev[cr->thead[sp->tag]-1]=i+1; }
+      cr->thead[sp->tag]=i+1;
+    }
+}
+
+/* ------------------------------------------------------------ */
+/* like rule_matches_sample() */
+static int crule_matches(model_pt m, crules_pt cr, array_pt sps, int p, crule_pt c)
+{
+  int n=array_count(sps), ns=cr->no_slots;
+  rule_pt r=c->rule;
+  int j;
+
+  if (p<0 || p>=n) { return 0; }
+  for (j=0; j<r->nop; j++)
+    {
+      cprecondition_pt cp=&c->pc[j];
+      int q=p+cp->pos;
+
+      switch (cp->type)
+	{
+	case CP_TAG:
+	  if (q<0 || q>=n || ((sample_pt)array_get(sps, q))->tag!=cp->value) { return 0; }
+	  break;
+	case CP_FEATURE:
+	  if (q<0 || q>=n || cr->feat[q*ns+cp->slot]!=cp->value) { return 0; }
+	  break;
+	case CP_BOS:
+	  if (q!=-1) { return 0; }
+	  break;
+	case CP_EOS:
+	  if (q!=n) { return 0; }
+	  break;
+	case CP_SAMPLE:
+	  if (q<0 || q>=n) { return 0; }
+	  break;
+	default:
+	  if (!precondition_satisfied(m, sps, p, r, j)) { return 0; }
+	}
+    }
+  /* Only allow lexical tags for frequent words. */
+  if (cr->feat[p*ns+CS_RARE]<0 && 0==cr->wp[p]->tagcount[r->tag]) { return 0; }
+  return 1;
+}
+
+/* ------------------------------------------------------------ */
+/* applies the rules in order to the tags of the sentence, with the
+   same result as applying each one with rule_matches_sample() */
+static void apply_compiled_rules(model_pt m, crules_pt cr, array_pt sps)
+{
+  int n=array_count(sps), ns=cr->no_slots, p;
+  size_t i;
+
+  crules_setup(m, cr, sps);
+  for (i=0; i<cr->no_rules; i++)
+    {
+      crule_pt c=&cr->rules[i];
+      cprecondition_pt a= c->anchor>=0 ? &c->pc[c->anchor] : NULL;
+      int nm=0, q;
+
+      /* where the rule matches, before any tag changes */
+      switch (a ? a->type : CP_OTHER)
+	{
+	case CP_BOS:
+	  if (crule_matches(m, cr, sps, -1-a->pos, c)) { cr->match[nm++]=-1-a->pos; }
+	  break;
+	case CP_EOS:
+	  if (crule_matches(m, cr, sps, n-a->pos, c)) { cr->match[nm++]=n-a->pos; }
+	  break;
+	case CP_FEATURE:
+	  if (cr->fstamp[a->value]!=cr->stamp) { break; }
+	  for (q=cr->fhead[a->value]; q; q=cr->fnext[(q-1)*ns+a->slot])
+	    { if (crule_matches(m, cr, sps, q-1-a->pos, c)) { cr->match[nm++]=q-1-a->pos; } }
+	  break;
+	case CP_TAG:
+	  if (a->value<0 || (size_t)a->value>=cr->no_tags) { break; }
+	  for (q=cr->thead[a->value]; q; q=cr->tnext[q-1])
+	    { if (crule_matches(m, cr, sps, q-1-a->pos, c)) { cr->match[nm++]=q-1-a->pos; } }
+	  break;
+	default:
+	  for (p=0; p<n; p++)
+	    { if (crule_matches(m, cr, sps, p, c)) { cr->match[nm++]=p; } }
+	}
+
+      /* retag, moving the words to the list of their new tag */
+      while (nm-->0)
+	{
+	  sample_pt sp=(sample_pt)array_get(sps, p=cr->match[nm]);
+	  int t=c->rule->tag;
+
+	  if (sp->tag==t) { continue; }
+	  if (cr->tprev[p]) { cr->tnext[cr->tprev[p]-1]=cr->tnext[p]; }
+	  else { cr->thead[sp->tag]=cr->tnext[p]; }
+	  if (cr->tnext[p]) { cr->tprev[cr->tnext[p]-1]=cr->tprev[p]; }
+	  cr->tprev[p]=0;
+	  cr->tnext[p]=cr->thead[t];
+	  if (cr->thead[t]) { cr->tprev[cr->thead[t]-1]=p+1; }
+	  cr->thead[t]=p+1;
+	  sp->tag=t;
+	}
+    }
+  for (p=0; p<n; p++)
+    {
+      sample_pt sp=(sample_pt)array_get(sps, p);
+      sp->tmptag=sp->tag;
+    }
+}
+
 /* ------------------------------------------------------------ */
 static void tagging(model_pt m, globals_pt g)
 {
   FILE *f= g->ipf ? try_to_open(g->ipf, "r") : stdin;  
-  array_pt pool=array_new(128), sps=array_new(128);
+  array_pt pool=array_new(128), sps=array_new(128), tokens=array_new(256);
+  sentcache_pt c= g->cache>0 ? sentcache_new(g->cache*1024*1024) : NULL;
+  crules_pt cr=compile_rules(m);
+  const int *ct=NULL;
   ssize_t r;
   char *s;
   char *buf = NULL;
@@ -1339,19 +2107,35 @@ static void tagging(model_pt m, globals_pt g)
 	  sp->tmptag=sp->tag;
 	  array_add(sps, sp);
 	}
-      /* now that we have the sentence, apply rules */
-      for (i=0; i<array_count(m->rules); i++)
+      /* the tokens, and for cooked input the tags, make up the key */
+      ct=NULL;
+      if (c && array_count(sps)>0)
+	{
+	  array_clear(tokens);
+	  for (i=0; i<array_count(sps); i++)
+	    {
+	      sample_pt sp=(sample_pt)array_get(sps, i);
+	      array_add(tokens, sp->word);
+	      if (!g->rawinput) { array_add(tokens, (void *)iregister_get_name(m->tags, sp->tag)); }
+	    }
+	  ct=sentcache_get(c, (char **)tokens->v, array_count(tokens));
+	}
+      if (ct)
 	{
-	  rule_pt r=(rule_pt)array_get(m->rules, i);
-	  size_t j;
-	  for (j=0; j<array_count(sps); j++)
+	  for (i=0; i<array_count(sps); i++)
+	    { ((sample_pt)array_get(sps, i))->tmptag=ct[i]; }
+	}
+      else
+	{
+	  /* now that we have the sentence, apply rules */
+	  apply_compiled_rules(m, cr, sps);
+	  if (c && array_count(sps)>0)
 	    {
-	      sample_pt sp=(sample_pt)array_get(sps, j);
-	      if (!rule_matches_sample(m, sps, j, r)) { continue; }
-/* 	      sp->tag=sp->tmptag=r->tag; */
-	      sp->tmptag=r->tag;
+	      int ts[array_count(sps)];
+	      for (i=0; i<array_count(sps); i++)
+		{ ts[i]=((sample_pt)array_get(sps, i))->tmptag; }
+	      sentcache_put(c, (char **)tokens->v, array_count(tokens), ts, array_count(sps));
 	    }
-	  array_map(sps, set_tag_to_tmptag);
 	}
       /* print cooked sentence */
       for (i=0; i<array_count(sps); i++)
@@ -1362,9 +2146,16 @@ static void tagging(model_pt m, globals_pt g)
 	}
       fprintf(stdout, "\n");
     }
+  delete_compiled_rules(cr);
   array_free(sps);
+  array_free(tokens);
   array_map(pool, (void (*)(void *))free_sample);
   array_free(pool);
+  if (c)
+    {
+      sentcache_report(c, 1);
+      sentcache_delete(c);
+    }
   if (f!=stdin) { fclose(f); }
   if(buf) {
 	  free(buf);
@@ -1441,6 +2232,8 @@ static globals_pt new_globals(globals_pt old)
   g->rf=g->ipf=g->plf=g->tf=NULL;
   g->rawinput=0;
   g->pos=g->neg=0;
+  g->cache=0;
+  g->threads=1;
   return g;
 }
 
@@ -1459,6 +2252,8 @@ int main(int argc, char **argv)
   char *p = NULL;
   char *t = NULL;
   char *u = NULL;
+  unsigned long c = 0;
+  unsigned long j = 1;
   enum OPTION_OPERATION_MODE o = OPTION_OPERATION_TAG;
   option_callback_data_t cd = {
     &o,
@@ -1482,6 +2277,8 @@ int main(int argc, char **argv)
 		  { 'R', OPTION_NONE, (void*)&R, "assume raw format for input [cooked format]" },
 		  { 't', OPTION_STRING, (void*)&t, "template file [none]" },
 		  { 'u', OPTION_STRING, (void*)&u, "unknown word default tag [lexicon based]" },
+		  { 'c', OPTION_UNSIGNED_LONG, (void*)&c, "sentence cache size in MB for tag mode [0, no cache]" },
+		  { 'j', OPTION_UNSIGNED_LONG, (void*)&j, "number of threads for train mode [1]" },
 		  { '\0', OPTION_NONE, NULL, NULL }
 	  }
   };
@@ -1496,6 +2293,9 @@ int main(int argc, char **argv)
   model->rwt = r;
   g->tf = t;
   g->plf = p;
+  g->cache = c;
+  if (j==0) { j=1; }
+  g->threads = j;
   if (idx<argc)
   {
 	  g->rf=argv[idx];
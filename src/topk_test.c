@@ -0,0 +1,110 @@
+/*
+  Benchmark of eqsort versus eqsort_top for the top k of n outcomes
+
+  Copyright (c) 2007-2016, ACOPOST Developers Team
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+   * Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in
+     the documentation and/or other materials provided with the
+     distribution.
+   * Neither the name of the ACOPOST Developers Team nor the names of
+     its contributors may be used to endorse or promote products
+     derived from this software without specific prior written
+     permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "eqsort.h"
+#define N_ITEMS 2000000
+#define K 5
+
+static int idx[1000];
+static double prob[1000];
+
+// descending order of the probabilities, as in acopost-met
+static int data_cmp(const void *a, const void *b, void *data)
+{
+	double *dp = (double *)data;
+	int i = *(const int *)a;
+	int j = *(const int *)b;
+	if (dp[i] < dp[j]) return 1;
+	if (dp[i] > dp[j]) return -1;
+	return 0;
+}
+
+static void fill(size_t n)
+{
+	size_t i;
+	double sum = 0.0;
+	for (i = 0; i < n; i++) { idx[i] = i; prob[i] = rand() / (double)RAND_MAX; sum += prob[i]; }
+	for (i = 0; i < n; i++) { prob[i] /= sum; }
+}
+
+int main(void)
+{
+	size_t sizes[] = { 50, 300, 1000 };
+	size_t s;
+
+	printf("\n Top %d of n: eqsort versus eqsort_top \n", K);
+	for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		size_t n = sizes[s];
+		size_t rounds = N_ITEMS / n;
+		size_t i, j;
+		int top[K];
+		clock_t a, b, c, d, e, f;
+
+		srand(2007);
+		e = clock();
+		for (j = 0; j < rounds; j++) { fill(n); }
+		f = clock();
+
+		srand(2007);
+		a = clock();
+		for (j = 0; j < rounds; j++)
+		{
+			fill(n);
+			eqsort(idx, n, sizeof(int), data_cmp, prob);
+		}
+		b = clock();
+		for (i = 0; i < K; i++) { top[i] = idx[i]; }
+
+		srand(2007);
+		c = clock();
+		for (j = 0; j < rounds; j++)
+		{
+			fill(n);
+			eqsort_top(idx, n, K, sizeof(int), data_cmp, prob);
+		}
+		d = clock();
+		for (i = 0; i < K && top[i] == idx[i]; i++) { }
+		/* the time for filling the arrays is subtracted */
+		printf("n=%4lu: eqsort %f / eqsort_top %f%s\n", (unsigned long)n,
+		       (float)((b-a)-(f-e))/CLOCKS_PER_SEC, (float)((d-c)-(f-e))/CLOCKS_PER_SEC,
+		       i < K ? " (top items differ!)" : "");
+	}
+	return 0;
+}